@@ -0,0 +1,93 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Backoff policies, see backoff.h.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "backoff.h"
+#include "diff_timespec.h"
+#include "dpf.h"
+
+#include <sched.h>
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Spin for 1 << attempt pauses, capped at BACKOFF_MAX_SHIFT.
+ */
+static inline void spin(uint32_t attempt) {
+  uint32_t pauses = 1u << ((attempt < BACKOFF_MAX_SHIFT) ? attempt : BACKOFF_MAX_SHIFT);
+  for (uint32_t i = 0; i < pauses; i++) {
+    cpu_pause();
+  }
+}
+
+/**
+ * Sleep for sleep_ns, a producer doesn't know we're waiting so
+ * it can't wake us sooner.
+ */
+static void nap(uint64_t sleep_ns) {
+  struct timespec duration = {
+    .tv_sec = sleep_ns / ns_u64,
+    .tv_nsec = sleep_ns % ns_u64,
+  };
+  nanosleep(&duration, NULL);
+}
+
+/**
+ * @see backoff.h
+ */
+void backoff_init(Backoff_t* pB, uint32_t kind, uint32_t spin_limit,
+    uint32_t yield_limit, uint64_t sleep_ns) {
+  pB->kind = kind;
+  pB->spin_limit = spin_limit;
+  pB->yield_limit = yield_limit;
+  pB->sleep_ns = sleep_ns;
+  pB->spins = 0;
+  pB->yields = 0;
+  pB->sleeps = 0;
+}
+
+/**
+ * @see backoff.h
+ */
+void backoff(Backoff_t* pB, uint32_t* pAttempt) {
+  uint32_t attempt = *pAttempt;
+  *pAttempt = attempt + 1;
+
+  switch (pB->kind) {
+    case (BACKOFF_SPIN): {
+      pB->spins += 1;
+      spin(attempt);
+      break;
+    }
+    case (BACKOFF_SPIN_YIELD): {
+      if (attempt < pB->spin_limit) {
+        pB->spins += 1;
+        spin(attempt);
+      } else {
+        pB->yields += 1;
+        sched_yield();
+      }
+      break;
+    }
+    case (BACKOFF_SPIN_SLEEP):
+    default: {
+      if (attempt < pB->spin_limit) {
+        pB->spins += 1;
+        spin(attempt);
+      } else if ((attempt - pB->spin_limit) < pB->yield_limit) {
+        pB->yields += 1;
+        sched_yield();
+      } else {
+        pB->sleeps += 1;
+        nap(pB->sleep_ns);
+      }
+      break;
+    }
+  }
+}
@@ -0,0 +1,91 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Backoff policies for the loops that wait on another thread,
+ * a Backoff_t is used by a single thread which calls backoff
+ * each time it finds it must still wait.
+ */
+
+#ifndef _BACKOFF_H
+#define _BACKOFF_H
+
+#include <sched.h>
+#include <stdint.h>
+
+/** Only spin, pausing exponentially longer, for dedicated cores */
+#define BACKOFF_SPIN       0
+
+/** Spin spin_limit times and then yield, for shared cores */
+#define BACKOFF_SPIN_YIELD 1
+
+/**
+ * Spin, then yield yield_limit times and then sleep for sleep_ns.
+ * Nothing wakes a sleeper early so sleep_ns bounds the latency, use
+ * enable_rmv_wait for a consumer that parks until a producer wakes it.
+ */
+#define BACKOFF_SPIN_SLEEP 2
+
+/** The longest spin is 1 << BACKOFF_MAX_SHIFT pauses */
+#define BACKOFF_MAX_SHIFT  10
+
+/**
+ * Producers backing off after a failed compare and exchange pause
+ * exponentially longer and yield after this many attempts.
+ */
+#define BACKOFF_CONTENDED_YIELD 16
+
+typedef struct Backoff_t {
+  // Policy
+  uint32_t kind;
+  uint32_t spin_limit;
+  uint32_t yield_limit;
+  uint64_t sleep_ns;
+
+  // Number of times each stage was used
+  uint64_t spins;
+  uint64_t yields;
+  uint64_t sleeps;
+} Backoff_t;
+
+/** A cpu hint that we're spinning */
+static inline void cpu_pause(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ volatile ("yield": : :"memory");
+#else
+  __asm__ volatile ("": : :"memory");
+#endif
+}
+
+/**
+ * Initialize a policy and clear its counters.
+ */
+extern void backoff_init(Backoff_t* pB, uint32_t kind, uint32_t spin_limit,
+    uint32_t yield_limit, uint64_t sleep_ns);
+
+/**
+ * Wait a little, *pAttempt is the number of times we've waited so
+ * far and is incremented, set it to zero before the first call.
+ */
+extern void backoff(Backoff_t* pB, uint32_t* pAttempt);
+
+/**
+ * Backoff for producers contending on a compare and exchange, pause
+ * exponentially longer and yield after BACKOFF_CONTENDED_YIELD
+ * attempts. Keeps no counters so nothing is shared.
+ */
+static inline void backoff_contended(uint32_t* pAttempt) {
+  uint32_t attempt = *pAttempt;
+  *pAttempt = attempt + 1;
+  if (attempt >= BACKOFF_CONTENDED_YIELD) {
+    sched_yield();
+    return;
+  }
+  uint32_t pauses = 1u << ((attempt < BACKOFF_MAX_SHIFT) ? attempt : BACKOFF_MAX_SHIFT);
+  for (uint32_t i = 0; i < pauses; i++) {
+    cpu_pause();
+  }
+}
+
+#endif
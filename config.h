@@ -0,0 +1,76 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Compile time configuration, each may be overridden on
+ * the command line with -D.
+ */
+
+#ifndef _CONFIG_H
+#define _CONFIG_H
+
+#include <stddef.h>
+
+/**
+ * When MPSC_STATS is 1 the ring buffer, link list and fifo maintain
+ * a count of the messages they hold and MsgPool_t maintains
+ * ret_msg_count. These are atomic read modify writes shared by every
+ * producer and the consumer so by default they are compiled out.
+ * msgs_processed and get_msg_count are only written by the consumer
+ * and are always maintained.
+ */
+#ifndef MPSC_STATS
+#define MPSC_STATS 0
+#endif
+
+/**
+ * The size of a cache line. The queues keep the fields written by
+ * producers, the fields written by the consumer and the read mostly
+ * fields on separate cache lines to avoid false sharing.
+ */
+#ifndef CACHE_LINE_SIZE
+#define CACHE_LINE_SIZE 64
+#endif
+
+/**
+ * When MPSC_PACKED_LAYOUT is 1 the queue fields are not separated
+ * onto their own cache lines. This is only useful for measuring
+ * the cost of false sharing, e.g. with perf c2c.
+ */
+#ifndef MPSC_PACKED_LAYOUT
+#define MPSC_PACKED_LAYOUT 0
+#endif
+
+#if MPSC_PACKED_LAYOUT
+#define CACHE_LINE_ALIGNED
+#else
+#define CACHE_LINE_ALIGNED __attribute__(( aligned (CACHE_LINE_SIZE) ))
+#endif
+
+/**
+ * When MPSC_COMPACT_CELLS is 1 a Cell_t is 16 bytes rather than a
+ * cache line, cutting the memory used by rings and pools by 8x at the
+ * cost of producers filling neighbouring ring cells sharing a line.
+ * Deep pools and rings that don't fit in the caches benefit most.
+ */
+#ifndef MPSC_COMPACT_CELLS
+#define MPSC_COMPACT_CELLS 0
+#endif
+
+/**
+ * When MPSC_INTRUSIVE is 1 the link lists link messages through
+ * Msg_t.pNext and their stub is a Msg_t they own. Messages keep no
+ * Cell_t, so a remove only touches the message and pools can free
+ * all of their memory. The rings still use their own cells.
+ */
+#ifndef MPSC_INTRUSIVE
+#define MPSC_INTRUSIVE 0
+#endif
+
+/**
+ * True if fields a and b of type are on the same cache line,
+ * assumes type is cache line aligned.
+ */
+#define SAME_CACHE_LINE(type, a, b) \
+  ((offsetof(type, a) / CACHE_LINE_SIZE) == (offsetof(type, b) / CACHE_LINE_SIZE))
+
+#endif
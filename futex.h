@@ -0,0 +1,38 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Thin wrappers around the linux futex system call for
+ * futexes private to this process.
+ */
+
+#ifndef _FUTEX_H
+#define _FUTEX_H
+
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <stdint.h>
+#include <time.h>
+
+/**
+ * Sleep while *addr == val or until timeout, a relative time, expires.
+ * If timeout is NULL wait forever.
+ *
+ * @return 0 if woken, -1 with errno EAGAIN if *addr != val,
+ * ETIMEDOUT if timeout expired or EINTR if interrupted.
+ */
+static inline long futex_wait(volatile uint32_t* addr, uint32_t val, const struct timespec* timeout) {
+  return syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, val, timeout, NULL, 0);
+}
+
+/**
+ * Wake up to count waiters sleeping on addr.
+ *
+ * @return number woken.
+ */
+static inline long futex_wake(volatile uint32_t* addr, uint32_t count) {
+  return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+#endif
@@ -0,0 +1,218 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A MpscFaaRing is a thread safe multi-producer single consumer
+ * bounded ring buffer where producers claim cells with fetch and
+ * add, see mpscfaaring.h.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "msg.h"
+#include "mpscfaaring.h"
+#include "crash.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Take up to n free cells.
+ *
+ * @return number taken.
+ */
+static inline uint32_t faa_take_free(MpscFaaRing_t* pFaa, uint32_t n) {
+  // One read modify write whether or not the cells are there
+  int32_t free_count = __atomic_fetch_sub(&pFaa->free_count, n, __ATOMIC_ACQUIRE);
+  if (free_count >= (int32_t)n) {
+    return n;
+  }
+
+  // Give back what we took but wasn't there, until we do free_count
+  // is short and others may see the ring full when it isn't
+  uint32_t taken = (free_count > 0) ? (uint32_t)free_count : 0;
+  __atomic_fetch_add(&pFaa->free_count, n - taken, __ATOMIC_RELAXED);
+  return taken;
+}
+
+/**
+ * Fill the cells claimed at pos, they must have been emptied
+ * by the consumer as we hold a free cell for each.
+ */
+static inline void faa_fill(MpscFaaRing_t* pFaa, uint32_t pos, Msg_t** msgs, uint32_t n) {
+  for (uint32_t i = 0; i < n; i++) {
+    Cell_t* cell = &pFaa->ring_buffer[(pos + i) & pFaa->mask];
+    if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != (pos + i)) {
+      printf(LDR "faa_fill:*pFaa=%p 1 WTF cell not empty\n", ldr(), pFaa);
+      CRASH();
+      printf(LDR "faa_fill:*pFaa=%p 2 WTF cell not empty\n", ldr(), pFaa);
+    }
+    cell->pMsg = msgs[i];
+    __atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * @see mpscfaaring.h
+ */
+MpscFaaRing_t* faa_init(MpscFaaRing_t* pFaa, uint32_t size) {
+  DPF(LDR "faa_init:+pFaa=%p size=%u\n", ldr(), pFaa, size);
+  if ((size == 0) || ((size & (size - 1)) != 0) || (size > INT32_MAX)) {
+    printf(LDR "faa_init:-pFaa=%p size=%u not power of 2 return NULL\n", ldr(), pFaa, size);
+    return NULL;
+  }
+  pFaa->ring_buffer = malloc(size * sizeof(pFaa->ring_buffer[0]));
+  if (pFaa->ring_buffer == NULL) {
+    printf(LDR "faa_init:-pFaa=%p size=%u could not allocate ring_buffer return NULL\n", ldr(), pFaa, size);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < size; i++) {
+    pFaa->ring_buffer[i].seq = i;
+    pFaa->ring_buffer[i].pMsg = NULL;
+  }
+  pFaa->add_idx = 0;
+  pFaa->free_count = size;
+  pFaa->rmv_idx = 0;
+  pFaa->msgs_processed = 0;
+  pFaa->size = size;
+  pFaa->mask = size - 1;
+  pFaa->count = 0;
+  DPF(LDR "faa_init:-pFaa=%p size=%u\n", ldr(), pFaa, size);
+  return pFaa;
+}
+
+/**
+ * @see mpscfaaring.h
+ */
+uint64_t faa_deinit(MpscFaaRing_t* pFaa) {
+  DPF(LDR "faa_deinit:+pFaa=%p\n", ldr(), pFaa);
+  uint64_t msgs_processed = pFaa->msgs_processed;
+  free(pFaa->ring_buffer);
+  pFaa->ring_buffer = NULL;
+  pFaa->add_idx = 0;
+  pFaa->free_count = 0;
+  pFaa->rmv_idx = 0;
+  pFaa->size = 0;
+  pFaa->mask = 0;
+  pFaa->count = 0;
+  pFaa->msgs_processed = 0;
+  DPF(LDR "faa_deinit:-pFaa=%p msgs_processed=%lu\n", ldr(), pFaa, msgs_processed);
+  return msgs_processed;
+}
+
+/**
+ * @see mpscfaaring.h
+ */
+bool faa_add(MpscFaaRing_t* pFaa, Msg_t* pMsg) {
+  DPF(LDR "faa_add:+pFaa=%p pMsg=%p\n", ldr(), pFaa, pMsg);
+  if (faa_take_free(pFaa, 1) == 0) {
+    DPF(LDR "faa_add:-pFaa=%p FULL pMsg=%p\n", ldr(), pFaa, pMsg);
+    return false;
+  }
+  uint32_t pos = __atomic_fetch_add(&pFaa->add_idx, 1, __ATOMIC_ACQ_REL);
+#if MPSC_STATS
+  pFaa->count += 1;
+#endif
+  faa_fill(pFaa, pos, &pMsg, 1);
+
+  DPF(LDR "faa_add:-pFaa=%p pMsg=%p\n", ldr(), pFaa, pMsg);
+  return true;
+}
+
+/**
+ * @see mpscfaaring.h
+ */
+uint32_t faa_add_batch(MpscFaaRing_t* pFaa, Msg_t** msgs, uint32_t n) {
+  DPF(LDR "faa_add_batch:+pFaa=%p n=%u\n", ldr(), pFaa, n);
+  uint32_t cnt = faa_take_free(pFaa, n);
+  if (cnt == 0) {
+    DPF(LDR "faa_add_batch:-pFaa=%p FULL n=%u\n", ldr(), pFaa, n);
+    return 0;
+  }
+  uint32_t pos = __atomic_fetch_add(&pFaa->add_idx, cnt, __ATOMIC_ACQ_REL);
+#if MPSC_STATS
+  pFaa->count += cnt;
+#endif
+  faa_fill(pFaa, pos, msgs, cnt);
+
+  DPF(LDR "faa_add_batch:-pFaa=%p n=%u cnt=%u\n", ldr(), pFaa, n, cnt);
+  return cnt;
+}
+
+/**
+ * @see mpscfaaring.h
+ */
+uint32_t faa_load(MpscFaaRing_t* pFaa, Msg_t** msgs, uint32_t n) {
+  DPF(LDR "faa_load:+pFaa=%p n=%u\n", ldr(), pFaa, n);
+  int32_t free_count = __atomic_load_n(&pFaa->free_count, __ATOMIC_RELAXED);
+  uint32_t cnt = ((int32_t)n < free_count) ? n : (uint32_t)free_count;
+  uint32_t pos = pFaa->add_idx;
+  for (uint32_t i = 0; i < cnt; i++) {
+    Cell_t* cell = &pFaa->ring_buffer[(pos + i) & pFaa->mask];
+    cell->pMsg = msgs[i];
+    cell->seq = pos + i + 1;
+  }
+  __atomic_store_n(&pFaa->free_count, free_count - cnt, __ATOMIC_RELAXED);
+  __atomic_store_n(&pFaa->add_idx, pos + cnt, __ATOMIC_RELAXED);
+#if MPSC_STATS
+  pFaa->count += cnt;
+#endif
+
+  DPF(LDR "faa_load:-pFaa=%p n=%u cnt=%u\n", ldr(), pFaa, n, cnt);
+  return cnt;
+}
+
+/**
+ * @see mpscfaaring.h
+ */
+Msg_t* faa_rmv(MpscFaaRing_t* pFaa) {
+  Msg_t* pMsg;
+  return (faa_rmv_batch(pFaa, &pMsg, 1) == 1) ? pMsg : NULL;
+}
+
+/**
+ * @see mpscfaaring.h
+ */
+uint32_t faa_rmv_batch(MpscFaaRing_t* pFaa, Msg_t** msgs, uint32_t max) {
+  DPF(LDR "faa_rmv_batch:+pFaa=%p max=%u\n", ldr(), pFaa, max);
+  uint32_t pos = pFaa->rmv_idx;
+  uint32_t cnt;
+
+  for (cnt = 0; cnt < max; cnt++) {
+    Cell_t* cell = &pFaa->ring_buffer[(pos + cnt) & pFaa->mask];
+    uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    if (seq != (pos + cnt + 1)) {
+      break;
+    }
+    Msg_t* pMsg = cell->pMsg;
+    if (pMsg == NULL) {
+      printf(LDR "faa_rmv_batch:*pFaa=%p 1 WTF unexpected pMsg == NULL\n", ldr(), pFaa);
+      CRASH();
+      printf(LDR "faa_rmv_batch:*pFaa=%p 2 WTF unexpected pMsg == NULL\n", ldr(), pFaa);
+    }
+    msgs[cnt] = pMsg;
+    __atomic_store_n(&cell->seq, pos + cnt + pFaa->mask + 1, __ATOMIC_RELAXED);
+  }
+
+  if (cnt != 0) {
+    pFaa->rmv_idx = pos + cnt;
+#if MPSC_STATS
+    pFaa->count -= cnt;
+#endif
+    pFaa->msgs_processed += cnt;
+
+    // Release orders the cells being emptied before they're reused
+    __atomic_fetch_add(&pFaa->free_count, cnt, __ATOMIC_RELEASE);
+  }
+
+  DPF(LDR "faa_rmv_batch:-pFaa=%p cnt=%u\n", ldr(), pFaa, cnt);
+  return cnt;
+}
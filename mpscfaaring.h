@@ -0,0 +1,111 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A MpscFaaRing is a thread safe multi-producer single consumer
+ * bounded ring buffer where producers claim cells with fetch and
+ * add rather than a compare and exchange loop, so contending
+ * producers never retry.
+ *
+ * A producer first takes one of the free cells from free_count with
+ * a fetch and sub, if there are none it gives it back and the ring
+ * is full. Until it's given back free_count may be below zero and
+ * another producer may then find the ring full when it isn't, that's
+ * harmless as add changes to the link list as it does when the ring
+ * is really full. Having taken one the cell at the position it then
+ * claims from add_idx is guaranteed to have been emptied by the
+ * consumer, so there are never unusable cells to skip. The consumer
+ * returns cells to free_count after removing their messages.
+ */
+
+#ifndef COM_SAVILLE_MPSCFAARING_H
+#define COM_SAVILLE_MPSCFAARING_H
+
+#include "msg.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct MpscFaaRing_t {
+  // Written by producers
+  volatile _Atomic(uint32_t) add_idx CACHE_LINE_ALIGNED;
+
+  // Written by producers and the consumer
+  volatile _Atomic(int32_t) free_count CACHE_LINE_ALIGNED;
+
+  // Written by the consumer
+  uint32_t volatile rmv_idx CACHE_LINE_ALIGNED;
+  uint64_t msgs_processed;
+
+  // Read mostly
+  uint32_t size CACHE_LINE_ALIGNED;
+  uint32_t mask;
+  Cell_t* ring_buffer;
+
+  // Written by producers and the consumer, only if MPSC_STATS
+  volatile _Atomic(uint32_t) count CACHE_LINE_ALIGNED;
+} MpscFaaRing_t;
+
+#if !MPSC_PACKED_LAYOUT
+_Static_assert(!SAME_CACHE_LINE(MpscFaaRing_t, add_idx, free_count), "add_idx and free_count share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFaaRing_t, add_idx, rmv_idx), "add_idx and rmv_idx share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFaaRing_t, free_count, rmv_idx), "free_count and rmv_idx share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFaaRing_t, rmv_idx, mask), "rmv_idx and mask share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFaaRing_t, count, rmv_idx), "count and rmv_idx share a cache line");
+#endif
+
+/**
+ * Initialize the MpscFaaRing_t, size must be a power of two.
+ *
+ * @return NULL if size cannot be malloced or is not a power of 2.
+ */
+extern MpscFaaRing_t* faa_init(MpscFaaRing_t* pFaa, uint32_t size);
+
+/**
+ * Deinitialize the MpscFaaRing_t, assumes it's empty.
+ *
+ * @return number of messages removed.
+ */
+extern uint64_t faa_deinit(MpscFaaRing_t* pFaa);
+
+/**
+ * Add a Msg_t, this maybe used by multiple entities on the same
+ * or different threads.
+ *
+ * @return true if added return false if full
+ */
+extern bool faa_add(MpscFaaRing_t* pFaa, Msg_t* pMsg);
+
+/**
+ * Add up to n Msg_t's claiming as many free cells as are available
+ * with one fetch and add.
+ *
+ * @return number added, 0 if full
+ */
+extern uint32_t faa_add_batch(MpscFaaRing_t* pFaa, Msg_t** msgs, uint32_t n);
+
+/**
+ * Add up to n Msg_t's to a ring no other thread is using yet with
+ * plain stores.
+ *
+ * @return number added, 0 if full
+ */
+extern uint32_t faa_load(MpscFaaRing_t* pFaa, Msg_t** msgs, uint32_t n);
+
+/**
+ * Remove a Msg_t. This maybe used only by a single thread.
+ *
+ * @return NULL if empty or the next cell has been claimed but not
+ * yet filled.
+ */
+extern Msg_t* faa_rmv(MpscFaaRing_t* pFaa);
+
+/**
+ * Remove up to max Msg_t's into msgs, the cells are returned to
+ * free_count once for the whole run. This maybe used only by a
+ * single thread.
+ *
+ * @return number removed, 0 if empty.
+ */
+extern uint32_t faa_rmv_batch(MpscFaaRing_t* pFaa, Msg_t** msgs, uint32_t max);
+
+#endif
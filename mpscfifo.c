@@ -23,8 +23,10 @@
 
 #define _DEFAULT_SOURCE
 
+#include "config.h"
+
 #if defined(NDEBUG)
-#define USE_COUNT 0
+#define USE_COUNT MPSC_STATS
 #else
 #define USE_COUNT 1
 #endif
@@ -34,8 +36,15 @@
 #include "crash.h"
 #include "msg_pool.h"
 #include "mpscfifo.h"
+#include "mpscfifoset.h"
 #include "mpscringbuff.h"
 #include "mpsclinklist.h"
+#include "mpscsegring.h"
+#include "mpscfaaring.h"
+#include "spscring.h"
+#include "quiesce.h"
+#include "diff_timespec.h"
+#include "futex.h"
 #include "dpf.h"
 
 #include <sys/types.h>
@@ -46,24 +55,166 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sched.h>
+#include <time.h>
 
 #include <unistd.h>
 
+/**
+ * Adaptive capacity policy, the ring is doubled after GROW_OVERFLOWS
+ * changes to the link list within a sampling window. The depth of the
+ * ring is sampled every SAMPLE_RMVS messages and after SHRINK_SAMPLES
+ * samples with no overflows and a max depth below a quarter of the
+ * ring it is halved.
+ */
+#define GROW_OVERFLOWS 2
+#define SAMPLE_RMVS 0x1000
+#define SHRINK_SAMPLES 16
+
+/**
+ * The default consumer backoff spins briefly and then yields,
+ * see set_backoff.
+ */
+#define DEFAULT_BACKOFF_KIND BACKOFF_SPIN_YIELD
+#define DEFAULT_BACKOFF_SPIN_LIMIT 4
+#define DEFAULT_BACKOFF_YIELD_LIMIT 16
+#define DEFAULT_BACKOFF_SLEEP_NS 50000
+
 /**
  * @see mpscfifo.h
  */
-MpscFifo_t* initMpscFifo(MpscFifo_t* pQ) {
-  DPF(LDR "initMpscFifo:*pQ=%p\n", ldr(), pQ);
+_Thread_local MpscParkHook_t park_hook;
+
+/**
+ * The number of handles multicast gets from the pool at a time.
+ */
+#define MULTICAST_BATCH 32
+
+/**
+ * The monotonic time in ns used for the mode counters.
+ */
+static inline uint64_t mode_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (ts.tv_sec * ns_u64) + ts.tv_nsec;
+}
+
+/**
+ * Initialize the state shared by the backends.
+ */
+static void init_state(MpscFifo_t* pQ, uint32_t backend,
+    uint32_t min_capacity, uint32_t max_capacity) {
   ll_init(&pQ->link_lists[0]);
   ll_init(&pQ->link_lists[1]);
-  //rb_init(&pQ->rb, 0x2); // Small for testing
-  rb_init(&pQ->rb, 0x100);
+  pQ->backend = backend;
   pQ->add_state = ADD_STATE_RB;
   pQ->rmv_state = RMV_STATE_RB;
-  pQ->add_pending_count = 0;
   pQ->add_link_list_idx = 0;
   pQ->rmv_link_list_idx = 0;
+  pQ->rmv_lane_idx = 0;
+  qs_snapshot_init(&pQ->rmv_qs);
+  qs_snapshot_init(&pQ->resize_qs);
+  pQ->lanes_pending = 0;
+  pQ->lanes_processed = 0;
+  pQ->lanes_sweep = MPSC_LANE_SWEEP_INTERVAL;
+  pQ->rmv_quiesced = false;
+  pQ->wait_enabled = false;
+  pQ->wait_spin_count = 0;
+  backoff_init(&pQ->backoff, DEFAULT_BACKOFF_KIND, DEFAULT_BACKOFF_SPIN_LIMIT,
+      DEFAULT_BACKOFF_YIELD_LIMIT, DEFAULT_BACKOFF_SLEEP_NS);
+  pQ->sleeping = 0;
   pQ->count = 0;
+  pQ->lane_count = 0;
+  for (uint32_t i = 0; i < MPSC_MAX_LANES; i++) {
+    pQ->lanes[i] = NULL;
+  }
+  pQ->lanes_ready = 0;
+  pQ->lanes_closed = 0;
+  pQ->values.ring_buffer = NULL;
+  pQ->credits = 0;
+  pQ->pSet = NULL;
+  pQ->set_bit = 0;
+  pQ->credit_limit = 0;
+  pQ->min_capacity = min_capacity;
+  pQ->max_capacity = max_capacity;
+  pQ->resize_capacity = 0;
+  pQ->overflows = 0;
+  pQ->rmvs_since_sample = 0;
+  pQ->samples = 0;
+  pQ->max_depth = 0;
+  pQ->ll_enter_retries = 0;
+  memset(&pQ->mode_policy, 0, sizeof(pQ->mode_policy));
+  memset(&pQ->mode_stats, 0, sizeof(pQ->mode_stats));
+  pQ->mode_since_ns = mode_now_ns();
+  pQ->ll_check_ns = pQ->mode_since_ns;
+  pQ->ll_rmvs = 0;
+}
+
+/**
+ * @see mpscfifo.h
+ */
+MpscFifo_t* initMpscFifo(MpscFifo_t* pQ) {
+  //return initMpscFifoCapacity(pQ, 0x2); // Small for testing
+  return initMpscFifoCapacity(pQ, 0x100);
+}
+
+/**
+ * @see mpscfifo.h
+ */
+MpscFifo_t* initMpscFifoCapacity(MpscFifo_t* pQ, uint32_t capacity) {
+  return initMpscFifoAdaptive(pQ, capacity, capacity, capacity);
+}
+
+/**
+ * @see mpscfifo.h
+ */
+MpscFifo_t* initMpscFifoAdaptive(MpscFifo_t* pQ, uint32_t capacity,
+    uint32_t min_capacity, uint32_t max_capacity) {
+  DPF(LDR "initMpscFifo:*pQ=%p capacity=%u min_capacity=%u max_capacity=%u\n",
+      ldr(), pQ, capacity, min_capacity, max_capacity);
+  if ((min_capacity == 0) || ((min_capacity & (min_capacity - 1)) != 0)
+      || ((max_capacity & (max_capacity - 1)) != 0)
+      || (min_capacity > capacity) || (capacity > max_capacity)) {
+    printf(LDR "initMpscFifo:-pQ=%p bad capacity=%u min_capacity=%u max_capacity=%u\n",
+        ldr(), pQ, capacity, min_capacity, max_capacity);
+    return NULL;
+  }
+  if (rb_init(&pQ->rb, capacity) == NULL) {
+    return NULL;
+  }
+  memset(&pQ->sg, 0, sizeof(pQ->sg));
+  memset(&pQ->faa, 0, sizeof(pQ->faa));
+  init_state(pQ, MPSC_BACKEND_RB_LL, min_capacity, max_capacity);
+  return pQ;
+}
+
+/**
+ * @see mpscfifo.h
+ */
+MpscFifo_t* initMpscFifoFaa(MpscFifo_t* pQ, uint32_t capacity) {
+  DPF(LDR "initMpscFifoFaa:*pQ=%p capacity=%u\n", ldr(), pQ, capacity);
+  if (faa_init(&pQ->faa, capacity) == NULL) {
+    return NULL;
+  }
+  memset(&pQ->rb, 0, sizeof(pQ->rb));
+  memset(&pQ->sg, 0, sizeof(pQ->sg));
+  init_state(pQ, MPSC_BACKEND_FAA_LL, capacity, capacity);
+  return pQ;
+}
+
+/**
+ * @see mpscfifo.h
+ */
+MpscFifo_t* initMpscFifoSegmented(MpscFifo_t* pQ) {
+  DPF(LDR "initMpscFifoSegmented:*pQ=%p\n", ldr(), pQ);
+  if (sg_init(&pQ->sg) == NULL) {
+    return NULL;
+  }
+  memset(&pQ->rb, 0, sizeof(pQ->rb));
+  memset(&pQ->faa, 0, sizeof(pQ->faa));
+  init_state(pQ, MPSC_BACKEND_SEGMENTED, 0, 0);
   return pQ;
 }
 
@@ -74,27 +225,267 @@ uint64_t deinitMpscFifo(MpscFifo_t* pQ) {
   uint32_t count = pQ->link_lists[0].count;
   count += pQ->link_lists[1].count;
   count += pQ->rb.count;
+  count += pQ->sg.count;
+  count += pQ->faa.count;
 
   uint64_t msgs_processed = ll_deinit(&pQ->link_lists[0]);
   msgs_processed += ll_deinit(&pQ->link_lists[1]);
   msgs_processed += rb_deinit(&pQ->rb);
+  if (pQ->backend == MPSC_BACKEND_SEGMENTED) {
+    msgs_processed += sg_deinit(&pQ->sg);
+  }
+  if (pQ->backend == MPSC_BACKEND_FAA_LL) {
+    msgs_processed += faa_deinit(&pQ->faa);
+  }
+  for (uint32_t i = 0; i < MPSC_MAX_LANES; i++) {
+    if (pQ->lanes[i] != NULL) {
+      msgs_processed += sr_deinit(pQ->lanes[i]);
+      free(pQ->lanes[i]);
+      pQ->lanes[i] = NULL;
+    }
+  }
+  msgs_processed += pQ->lanes_processed;
+  pQ->lanes_processed = 0;
+  pQ->lanes_pending = 0;
+  pQ->lanes_ready = 0;
+  pQ->lanes_closed = 0;
+  pQ->lane_count = 0;
+  if (pQ->values.ring_buffer != NULL) {
+    msgs_processed += vr_deinit(&pQ->values);
+  }
 
   DPF(LDR "deinitMpscFifo:-pQ=%p count=%u msgs_processed=%lu\n", ldr(), pQ, count, msgs_processed);
   return msgs_processed;
 }
 
 /**
- * @see mpscifo.h
+ * The ring used in ADD_STATE_RB and RMV_STATE_RB, either rb or faa.
  */
-void add(MpscFifo_t* pQ, Msg_t* pMsg) {
-  pQ->add_pending_count += 1;
+static inline bool ring_add(MpscFifo_t* pQ, Msg_t* pMsg) {
+  if (pQ->backend == MPSC_BACKEND_FAA_LL) {
+    return faa_add(&pQ->faa, pMsg);
+  }
+  return rb_add(&pQ->rb, pMsg);
+}
+
+static inline uint32_t ring_add_batch(MpscFifo_t* pQ, Msg_t** msgs, uint32_t n) {
+  if (pQ->backend == MPSC_BACKEND_FAA_LL) {
+    return faa_add_batch(&pQ->faa, msgs, n);
+  }
+  return rb_add_batch(&pQ->rb, msgs, n);
+}
+
+static inline Msg_t* ring_rmv(MpscFifo_t* pQ) {
+  if (pQ->backend == MPSC_BACKEND_FAA_LL) {
+    return faa_rmv(&pQ->faa);
+  }
+  return rb_rmv(&pQ->rb);
+}
+
+static inline uint32_t ring_rmv_batch(MpscFifo_t* pQ, Msg_t** msgs, uint32_t max) {
+  if (pQ->backend == MPSC_BACKEND_FAA_LL) {
+    return faa_rmv_batch(&pQ->faa, msgs, max);
+  }
+  return rb_rmv_batch(&pQ->rb, msgs, max);
+}
+
+/**
+ * True if a producer has claimed a cell in the ring and not yet filled it.
+ */
+static inline bool ring_busy(MpscFifo_t* pQ) {
+  if (pQ->backend == MPSC_BACKEND_FAA_LL) {
+    return __atomic_load_n(&pQ->faa.add_idx, __ATOMIC_ACQUIRE) != pQ->faa.rmv_idx;
+  }
+  return __atomic_load_n(&pQ->rb.add_idx, __ATOMIC_ACQUIRE) != pQ->rb.rmv_idx;
+}
+
+/**
+ * Change add_state from ADD_STATE_RB to ADD_STATE_LL, flipping the
+ * link list producers add to.
+ *
+ * @return false if another thread is changing or has changed it.
+ */
+static inline bool change_to_ll(MpscFifo_t* pQ) {
+  uint32_t add_state_rb = ADD_STATE_RB;
+  if (__atomic_compare_exchange_n(&pQ->add_state, &add_state_rb, ADD_STATE_CHANGING_TO_LL, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+    uint32_t idx = __atomic_load_n(&pQ->add_link_list_idx, __ATOMIC_ACQUIRE);
+    idx ^= 1;
+    __atomic_store_n(&pQ->add_link_list_idx, idx, __ATOMIC_RELEASE);
+    __atomic_store_n(&pQ->add_state, ADD_STATE_LL, __ATOMIC_RELEASE);
+    DPF(LDR "change_to_ll: pQ=%p ADD_STATE_RB changed to ADD_STATE_LL idx=%d\n", ldr(), pQ, idx);
+    return true;
+  }
+  return false;
+}
+
+/**
+ * Called by the consumer as it follows the producers into the link
+ * list, if it keeps happening request a bigger ring.
+ */
+static inline void rmv_overflowed(MpscFifo_t* pQ) {
+  if ((pQ->max_capacity != pQ->min_capacity) && (pQ->resize_capacity == 0)) {
+    pQ->overflows += 1;
+    if ((pQ->overflows >= GROW_OVERFLOWS) && (pQ->rb.size < pQ->max_capacity)) {
+      pQ->resize_capacity = pQ->rb.size * 2;
+      DPF(LDR "rmv_overflowed: pQ=%p grow size=%u to %u\n", ldr(), pQ, pQ->rb.size, pQ->resize_capacity);
+    }
+  }
+}
+
+/**
+ * Called by the consumer after removing cnt messages from the ring,
+ * periodically samples the depth of the ring and if it stays shallow
+ * requests a smaller ring. The ring can only be swapped while the
+ * producers are using the link list so we force a change to it.
+ */
+static inline void rmv_sample_depth(MpscFifo_t* pQ, uint32_t cnt) {
+  if (pQ->max_capacity == pQ->min_capacity) {
+    return;
+  }
+  pQ->rmvs_since_sample += cnt;
+  if (pQ->rmvs_since_sample < SAMPLE_RMVS) {
+    return;
+  }
+  pQ->rmvs_since_sample = 0;
+
+  uint32_t depth = __atomic_load_n(&pQ->rb.add_idx, __ATOMIC_ACQUIRE) - pQ->rb.rmv_idx;
+  if (depth > pQ->max_depth) {
+    pQ->max_depth = depth;
+  }
+  pQ->samples += 1;
+  if (pQ->samples < SHRINK_SAMPLES) {
+    return;
+  }
+
+  if ((pQ->overflows == 0) && (pQ->resize_capacity == 0)
+      && (pQ->max_depth < (pQ->rb.size / 4)) && (pQ->rb.size > pQ->min_capacity)) {
+    pQ->resize_capacity = pQ->rb.size / 2;
+    DPF(LDR "rmv_sample_depth: pQ=%p shrink size=%u to %u max_depth=%u\n",
+        ldr(), pQ, pQ->rb.size, pQ->resize_capacity, pQ->max_depth);
+    change_to_ll(pQ);
+  }
+  pQ->overflows = 0;
+  pQ->samples = 0;
+  pQ->max_depth = 0;
+}
+
+/**
+ * Called by the consumer when it's about to change add_state back
+ * to ADD_STATE_RB and a resize has been requested. Once no producer
+ * that saw ADD_STATE_RB is part way through an add swap in the new
+ * ring, producers that start an add now will see ADD_STATE_LL. If
+ * stall is false and one is, *pBusy is set and we try again on the
+ * next call, add_state stays ADD_STATE_LL until then.
+ *
+ * @return false if the caller must stay in the link list mode, either
+ * a producer is busy or rb_resize failed in which case the ring is
+ * unchanged and the request dropped.
+ */
+static bool rmv_resize(MpscFifo_t* pQ, const bool stall, bool* pBusy) {
+  if (!qs_quiescent(&pQ->resize_qs, pQ, stall, &pQ->backoff)) {
+    *pBusy = true;
+    return false;
+  }
+  DPF(LDR "rmv_resize: pQ=%p size=%u resize_capacity=%u\n", ldr(), pQ, pQ->rb.size, pQ->resize_capacity);
+  bool resized = rb_resize(&pQ->rb, pQ->resize_capacity);
+  pQ->resize_capacity = 0;
+  if (resized) {
+    pQ->overflows = 0;
+    pQ->samples = 0;
+    pQ->max_depth = 0;
+  }
+  return resized;
+}
+
+/**
+ * Called by the consumer as it changes rmv_state to RMV_STATE_LL or
+ * back to RMV_STATE_RB, accumulate the time spent in the old mode.
+ */
+static void rmv_mode_changed(MpscFifo_t* pQ, bool to_ll) {
+  uint64_t now = mode_now_ns();
+  uint64_t elapsed = now - pQ->mode_since_ns;
+  if (to_ll) {
+    pQ->mode_stats.to_ll += 1;
+    pQ->mode_stats.rb_ns += elapsed;
+    pQ->ll_check_ns = now;
+    pQ->ll_rmvs = 0;
+  } else {
+    pQ->mode_stats.to_rb += 1;
+    pQ->mode_stats.ll_ns += elapsed;
+  }
+  pQ->mode_since_ns = now;
+}
+
+/**
+ * Called by the consumer when it finds the link list empty, with
+ * the default policy it leaves immediately. Otherwise it stays until
+ * ll_min_dwell_ns has passed since it entered or last checked and,
+ * if ll_keep_while_busy, no more than ll_exit_low_watermark messages
+ * were removed in that time.
+ *
+ * @return true if the consumer may change back to the ring buffer.
+ */
+static inline bool rmv_ll_may_exit(MpscFifo_t* pQ) {
+  const MpscModePolicy_t* pPolicy = &pQ->mode_policy;
+  if ((pPolicy->ll_min_dwell_ns == 0) && !pPolicy->ll_keep_while_busy) {
+    return true;
+  }
+  uint64_t now = mode_now_ns();
+  if ((now - pQ->ll_check_ns) < pPolicy->ll_min_dwell_ns) {
+    return false;
+  }
+  if (pPolicy->ll_keep_while_busy && (pQ->ll_rmvs > pPolicy->ll_exit_low_watermark)) {
+    DPF(LDR "rmv_ll_may_exit: pQ=%p burst persists ll_rmvs=%u\n", ldr(), pQ, pQ->ll_rmvs);
+    pQ->ll_check_ns = now;
+    pQ->ll_rmvs = 0;
+    return false;
+  }
+  return true;
+}
+
+/**
+ * If rmv_wait is enabled and the consumer is parked wake it. The
+ * fence orders our add before the load of sleeping, the consumer
+ * orders its store of sleeping before it looks at the fifo again,
+ * so either we see it parked or it sees the message. If the fifo
+ * is a member of a set mark it ready, see fs_ready.
+ */
+static inline void wake_consumer(MpscFifo_t* pQ) {
+  MpscFifoSet_t* pSet = __atomic_load_n(&pQ->pSet, __ATOMIC_ACQUIRE);
+  if (pSet != NULL) {
+    fs_ready(pSet, pQ->set_bit);
+  }
+  if (pQ->wait_enabled) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pQ->sleeping, __ATOMIC_RELAXED) != 0) {
+      if (__atomic_exchange_n(&pQ->sleeping, 0, __ATOMIC_ACQ_REL) != 0) {
+        DPF(LDR "wake_consumer: pQ=%p\n", ldr(), pQ);
+        futex_wake(&pQ->sleeping, 1);
+      }
+    }
+  }
+}
+
+/**
+ * Add a message to the ring buffer, link lists or segmented ring.
+ */
+static inline void add_internal(MpscFifo_t* pQ, Msg_t* pMsg) {
+  if (pQ->backend == MPSC_BACKEND_SEGMENTED) {
+    sg_add(&pQ->sg, pMsg);
+#if USE_COUNT
+    pQ->count += 1;
+#endif
+    return;
+  }
+  uint32_t attempt = 0;
+  QsRecord_t* pRec = qs_enter(pQ);
   while (true) {
     uint32_t add_state = __atomic_load_n(&pQ->add_state, __ATOMIC_ACQUIRE);
     switch (add_state) {
       case (ADD_STATE_RB): {
         DPF(LDR "add: pQ=%p ADD_STATE_RB pMsg=%p\n", ldr(), pQ, pMsg);
 
-        if (rb_add(&pQ->rb, pMsg)) {
+        if (ring_add(pQ, pMsg)) {
 #if USE_COUNT
           pQ->count += 1;
 #endif
@@ -105,19 +496,18 @@ void add(MpscFifo_t* pQ, Msg_t* pMsg) {
           pMsg->last_fifo_add_msg_ll_idx = (uint64_t)-1;
           pMsg->last_fifo_add_msg_tick = gTick++;
 #endif
-          pQ->add_pending_count -= 1;
-          DPF(LDR "add:-pQ=%p ADD_STATE_RB added pMsg=%p count=%d add_pending_count=%d\n",
-              ldr(), pQ, pMsg, pQ->count, pQ->add_pending_count);
+          qs_exit(pRec);
+          DPF(LDR "add:-pQ=%p ADD_STATE_RB added pMsg=%p count=%d\n",
+              ldr(), pQ, pMsg, pQ->count);
           return;
         }
+        if (attempt < pQ->ll_enter_retries) {
+          backoff_contended(&attempt);
+          break;
+        }
 
-        uint32_t add_state_rb = ADD_STATE_RB;
-        if (__atomic_compare_exchange_n(&pQ->add_state, &add_state_rb, ADD_STATE_CHANGING_TO_LL, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
-          uint32_t idx = __atomic_load_n(&pQ->add_link_list_idx, __ATOMIC_ACQUIRE);
-          idx ^= 1;
-          __atomic_store_n(&pQ->add_link_list_idx, idx, __ATOMIC_RELEASE);
-          __atomic_store_n(&pQ->add_state, ADD_STATE_LL, __ATOMIC_RELEASE);
-          DPF(LDR "add: pQ=%p ADD_STATE_RB changed to ADD_STATE_LL pMsg=%p idx=%d\n", ldr(), pQ, pMsg, idx);
+        if (change_to_ll(pQ)) {
+          DPF(LDR "add: pQ=%p ADD_STATE_RB changed to ADD_STATE_LL pMsg=%p\n", ldr(), pQ, pMsg);
         } else {
           DPF(LDR "add: pQ=%p ADD_STATE_RB other producer changing pMsg=%p\n", ldr(), pQ, pMsg);
         }
@@ -144,9 +534,75 @@ void add(MpscFifo_t* pQ, Msg_t* pMsg) {
         pMsg->last_fifo_add_msg_ll_idx = idx;
         pMsg->last_fifo_add_msg_tick = gTick++;
 #endif
-        pQ->add_pending_count -= 1;
-        DPF(LDR "add:-pQ=%p ADD_STATE_LL pMsg=%p count=%d add_pending_count=%d\n",
-            ldr(), pQ, pMsg, pQ->count, pQ->add_pending_count);
+        qs_exit(pRec);
+        DPF(LDR "add:-pQ=%p ADD_STATE_LL pMsg=%p count=%d\n",
+            ldr(), pQ, pMsg, pQ->count);
+        return;
+      }
+    }
+  }
+}
+
+/**
+ * Add n messages to the ring buffer, link lists or segmented ring.
+ */
+static inline void add_batch_internal(MpscFifo_t* pQ, Msg_t** msgs, uint32_t n) {
+  if (pQ->backend == MPSC_BACKEND_SEGMENTED) {
+    sg_add_batch(&pQ->sg, msgs, n);
+#if USE_COUNT
+    pQ->count += n;
+#endif
+    return;
+  }
+  uint32_t attempt = 0;
+  QsRecord_t* pRec = qs_enter(pQ);
+  while (true) {
+    uint32_t add_state = __atomic_load_n(&pQ->add_state, __ATOMIC_ACQUIRE);
+    switch (add_state) {
+      case (ADD_STATE_RB): {
+        DPF(LDR "add_batch: pQ=%p ADD_STATE_RB n=%u\n", ldr(), pQ, n);
+
+        uint32_t added = ring_add_batch(pQ, msgs, n);
+#if USE_COUNT
+        pQ->count += added;
+#endif
+        msgs += added;
+        n -= added;
+        if (n == 0) {
+          qs_exit(pRec);
+          DPF(LDR "add_batch:-pQ=%p ADD_STATE_RB added count=%d\n",
+              ldr(), pQ, pQ->count);
+          return;
+        }
+        if (attempt < pQ->ll_enter_retries) {
+          backoff_contended(&attempt);
+          break;
+        }
+
+        if (change_to_ll(pQ)) {
+          DPF(LDR "add_batch: pQ=%p ADD_STATE_RB changed to ADD_STATE_LL n=%u\n", ldr(), pQ, n);
+        } else {
+          DPF(LDR "add_batch: pQ=%p ADD_STATE_RB other producer changing n=%u\n", ldr(), pQ, n);
+        }
+        break;
+      }
+
+      case (ADD_STATE_CHANGING_TO_LL): {
+        // Ring buffer is full, another producer is changing to the link list
+        DPF(LDR "add_batch: pQ=%p ADD_STATE_CHANGING_TO_LL n=%u\n", ldr(), pQ, n);
+        break;
+      }
+
+      case (ADD_STATE_LL): {
+        uint32_t idx = __atomic_load_n(&pQ->add_link_list_idx, __ATOMIC_ACQUIRE);
+        ll_add_batch(&pQ->link_lists[idx], msgs, n);
+
+#if USE_COUNT
+        pQ->count += n;
+#endif
+        qs_exit(pRec);
+        DPF(LDR "add_batch:-pQ=%p ADD_STATE_LL n=%u count=%d\n",
+            ldr(), pQ, n, pQ->count);
         return;
       }
     }
@@ -156,15 +612,119 @@ void add(MpscFifo_t* pQ, Msg_t* pMsg) {
 /**
  * @see mpscifo.h
  */
-Msg_t* rmv(MpscFifo_t* pQ) {
+void add(MpscFifo_t* pQ, Msg_t* pMsg) {
+  add_internal(pQ, pMsg);
+  wake_consumer(pQ);
+}
+
+/**
+ * @see mpscfifo.h
+ */
+void enable_credits(MpscFifo_t* pQ, uint32_t limit) {
+  pQ->credit_limit = limit;
+  __atomic_store_n(&pQ->credits, (int32_t)limit, __ATOMIC_RELEASE);
+}
+
+/**
+ * Return the credit pMsg holds, if any, to its fifo.
+ */
+static inline void ret_credit(Msg_t* pMsg) {
+  MpscFifo_t* pCreditQ = pMsg->pCreditQ;
+  if (pCreditQ != NULL) {
+    pMsg->pCreditQ = NULL;
+    __atomic_fetch_add(&pCreditQ->credits, 1, __ATOMIC_RELEASE);
+  }
+}
+
+/**
+ * @see mpscfifo.h
+ */
+bool try_add(MpscFifo_t* pQ, Msg_t* pMsg) {
+  if (pQ->credit_limit != 0) {
+    // Only take a credit that's there so credits never goes negative
+    int32_t credits = __atomic_load_n(&pQ->credits, __ATOMIC_RELAXED);
+    do {
+      if (credits <= 0) {
+        DPF(LDR "try_add: pQ=%p no credits pMsg=%p\n", ldr(), pQ, pMsg);
+        return false;
+      }
+    } while (!__atomic_compare_exchange_n(&pQ->credits, &credits, credits - 1,
+          true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED));
+
+    // A forwarded message gives back the credit it was sent with
+    ret_credit(pMsg);
+    pMsg->pCreditQ = pQ;
+  }
+  add_internal(pQ, pMsg);
+  wake_consumer(pQ);
+  return true;
+}
+
+/**
+ * @see mpscifo.h
+ */
+void add_batch(MpscFifo_t* pQ, Msg_t** msgs, uint32_t n) {
+  if (n == 0) {
+    return;
+  }
+  add_batch_internal(pQ, msgs, n);
+  wake_consumer(pQ);
+}
+
+/**
+ * @see mpscifo.h
+ */
+void load_batch(MpscFifo_t* pQ, Msg_t** msgs, uint32_t n) {
+  DPF(LDR "load_batch:+pQ=%p n=%u\n", ldr(), pQ, n);
+  if (pQ->backend == MPSC_BACKEND_SEGMENTED) {
+    // Reserves a segment at a time, there's no cheaper way to fill it
+    sg_add_batch(&pQ->sg, msgs, n);
+  } else {
+    uint32_t cnt = 0;
+    if (pQ->add_state == ADD_STATE_RB) {
+      cnt = (pQ->backend == MPSC_BACKEND_FAA_LL) ? faa_load(&pQ->faa, msgs, n) : rb_load(&pQ->rb, msgs, n);
+      if (cnt < n) {
+        // The ring is full, change to the link list as change_to_ll does
+        pQ->add_link_list_idx ^= 1;
+        pQ->add_state = ADD_STATE_LL;
+      }
+    }
+    ll_load(&pQ->link_lists[pQ->add_link_list_idx], &msgs[cnt], n - cnt);
+  }
+#if USE_COUNT
+  pQ->count += n;
+#endif
+  DPF(LDR "load_batch:-pQ=%p n=%u\n", ldr(), pQ, n);
+}
+
+/**
+ * The rmv state machine shared by rmv and rmv_non_stalling. When stall
+ * is true we yield and retry where a producer is part way through an
+ * add, otherwise we return NULL with *pBusy set to true.
+ */
+static inline Msg_t* rmv_internal(MpscFifo_t* pQ, const bool stall, bool* pBusy) {
   Msg_t* pMsg;
+  uint32_t attempt = 0;
 
+  *pBusy = false;
+  if (pQ->backend == MPSC_BACKEND_SEGMENTED) {
+    pMsg = sg_rmv(&pQ->sg);
+    if (pMsg != NULL) {
+#if USE_COUNT
+      pQ->count -= 1;
+#endif
+    } else if (!stall) {
+      *pBusy = sg_busy(&pQ->sg);
+    }
+    return pMsg;
+  }
   while (true) {
     switch (pQ->rmv_state) {
       case (RMV_STATE_RB): {
         DPF(LDR "rmv: pQ=%p RMV_STATE_RB\n", ldr(), pQ);
-        pMsg = rb_rmv(&pQ->rb);
+        pMsg = ring_rmv(pQ);
         if (pMsg != NULL) {
+          rmv_sample_depth(pQ, 1);
 #if USE_COUNT
           pQ->count -= 1;
 #endif
@@ -178,15 +738,21 @@ Msg_t* rmv(MpscFifo_t* pQ) {
           return pMsg;
         }
         if (ADD_STATE_RB == __atomic_load_n(&pQ->add_state, __ATOMIC_ACQUIRE)) {
-          // No messages in RB or LL
+          // No messages in RB or LL, but a producer may have reserved
+          // a slot and not yet filled it.
+          if (!stall) {
+            *pBusy = ring_busy(pQ);
+          }
           DPF(LDR "rmv:-pQ=%p RMV_STATE_RB, empty pMsg=%p count=%d\n", ldr(), pQ, pMsg, pQ->count);
           return NULL;
         }
 
         // Rb is empty but the we need to switch to RMV_STATE_LL too
         pQ->rmv_link_list_idx = pQ->rmv_link_list_idx ^ 1;
+        rmv_overflowed(pQ);
 
         DPF(LDR "rmv: pQ=%p RMV_STATE_RB change to RMV_STATE_LL pMsg=%p\n", ldr(), pQ, pMsg);
+        rmv_mode_changed(pQ, true);
         pQ->rmv_state = RMV_STATE_LL;
 
         break;
@@ -194,13 +760,27 @@ Msg_t* rmv(MpscFifo_t* pQ) {
 
       case (RMV_STATE_CHANGING_ADD_STATE_TO_ADD_STATE_RB): {
         DPF(LDR "rmv: pQ=%p RMV_STATE_CHANGING_ADD_STATE_TO_ADD_STATE_RB\n", ldr(), pQ);
+        if ((pQ->resize_capacity != 0) && !rmv_resize(pQ, stall, pBusy)) {
+          if (*pBusy) {
+            DPF(LDR "rmv:-pQ=%p resize waiting for a producer\n", ldr(), pQ);
+            return NULL;
+          }
+          // The link list is empty, stay with it until it empties again
+          DPF(LDR "rmv:-pQ=%p resize failed, staying in RMV_STATE_LL\n", ldr(), pQ);
+          pQ->rmv_state = RMV_STATE_LL;
+          return NULL;
+        }
         uint32_t add_state_ll = ADD_STATE_LL;
         if (__atomic_compare_exchange_n(&pQ->add_state, &add_state_ll, ADD_STATE_RB, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
           DPF(LDR "rmv: pQ=%p add_state == ADD_STATE_RB\n", ldr(), pQ);
           pQ->rmv_state = RMV_STATE_CHANGING_TO_RB;
         } else {
           DPF(LDR "rmv: pQ=%p add_state != ADD_STATE_LL\n", ldr(), pQ);
-          sched_yield();
+          if (!stall) {
+            *pBusy = true;
+            return NULL;
+          }
+          backoff(&pQ->backoff, &attempt);
         }
         break;
       }
@@ -208,9 +788,18 @@ Msg_t* rmv(MpscFifo_t* pQ) {
       case (RMV_STATE_CHANGING_TO_RB): {
         DPF(LDR "rmv: pQ=%p RMV_STATE_CHANGING_TO_RB\n", ldr(), pQ);
 
-        // Return any lingering messages from the link list
-        pMsg = ll_rmv(&pQ->link_lists[pQ->rmv_link_list_idx]);
-        uint32_t add_pending_count = 0;
+        // Wait until no producer that saw ADD_STATE_LL is still adding
+        // to the link list, then return any lingering messages from it
+        if (!pQ->rmv_quiesced) {
+          if (!qs_quiescent(&pQ->rmv_qs, pQ, stall, &pQ->backoff)) {
+            DPF(LDR "rmv:-pQ=%p RMV_STATE_CHANGING_TO_RB producer busy\n", ldr(), pQ);
+            *pBusy = true;
+            return NULL;
+          }
+          pQ->rmv_quiesced = true;
+        }
+        MpscLinkList_t* pLl = &pQ->link_lists[pQ->rmv_link_list_idx];
+        pMsg = stall ? ll_rmv(pLl, &pQ->backoff) : ll_rmv_non_stalling(pLl, pBusy);
         if (pMsg != NULL) {
 #if USE_COUNT
           pQ->count -= 1;
@@ -223,26 +812,29 @@ Msg_t* rmv(MpscFifo_t* pQ) {
           pMsg->last_fifo_rmv_msg_tick = gTick++;
 #endif
           return pMsg;
-        } else if (0 == (add_pending_count = pQ->add_pending_count)) {
-          DPF(LDR "rmv: pQ=%p add_state == ADD_STATE_RB and LL is empty change to RMV_STATE_RB\n", ldr(), pQ);
-          // link list is empty, now switch to RB
-          pQ->rmv_state = RMV_STATE_RB;
-        } else {
-          DPF(LDR "rmv: pQ=%p add_pending_count=%d != 0\n", ldr(), pQ, add_pending_count);
-          sched_yield();
+        } else if (*pBusy) {
+          DPF(LDR "rmv:-pQ=%p RMV_STATE_CHANGING_TO_RB link list busy\n", ldr(), pQ);
+          return NULL;
         }
 
+        DPF(LDR "rmv: pQ=%p add_state == ADD_STATE_RB and LL is empty change to RMV_STATE_RB\n", ldr(), pQ);
+        // link list is empty, now switch to RB
+        pQ->rmv_quiesced = false;
+        rmv_mode_changed(pQ, false);
+        pQ->rmv_state = RMV_STATE_RB;
         break;
       }
 
       case (RMV_STATE_LL): {
         DPF(LDR "rmv: pQ=%p RMV_STATE_LL\n", ldr(), pQ);
         uint32_t idx = __atomic_load_n(&pQ->rmv_link_list_idx, __ATOMIC_ACQUIRE);
-        pMsg = ll_rmv(&pQ->link_lists[idx]);
+        MpscLinkList_t* pLl = &pQ->link_lists[idx];
+        pMsg = stall ? ll_rmv(pLl, &pQ->backoff) : ll_rmv_non_stalling(pLl, pBusy);
         if (pMsg != NULL) {
 #if USE_COUNT
           pQ->count -= 1;
 #endif
+          pQ->ll_rmvs += 1;
           DPF(LDR "rmv:-pQ=%p RMV_STATE_LL pMsg=%p count=%d\n", ldr(), pQ, pMsg, pQ->count);
 #ifndef NDEBUG
           pMsg->last_fifo_rmv_msg_pthread_id = pthread_self();
@@ -251,6 +843,12 @@ Msg_t* rmv(MpscFifo_t* pQ) {
           pMsg->last_fifo_rmv_msg_tick = gTick++;
 #endif
           return pMsg;
+        } else if (*pBusy) {
+          DPF(LDR "rmv:-pQ=%p RMV_STATE_LL link list busy\n", ldr(), pQ);
+          return NULL;
+        } else if (!rmv_ll_may_exit(pQ)) {
+          DPF(LDR "rmv:-pQ=%p RMV_STATE_LL empty, staying in RMV_STATE_LL\n", ldr(), pQ);
+          return NULL;
         }
 
         DPF(LDR "rmv: pQ=%p RMV_STATE_LL, change rmv_state=RMV_STATE_CHANGING_TO_RB\n", ldr(), pQ);
@@ -262,13 +860,586 @@ Msg_t* rmv(MpscFifo_t* pQ) {
   }
 }
 
+/**
+ * A lane and its bit in lanes_ready, register_lane returns &ring.
+ */
+typedef struct MpscLane_t {
+  SpscRing_t ring;
+  uint64_t bit;
+} MpscLane_t;
+
+/**
+ * Mark a lane ready and wake the consumer, like fs_ready the fence
+ * orders the add before the load of lanes_ready so either we set the
+ * bit or the consumer, which takes the bits before it looks at the
+ * lanes, sees the add. Only used when a lane becomes non-empty.
+ */
+static inline void lane_ready(MpscFifo_t* pQ, uint64_t bit) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if ((__atomic_load_n(&pQ->lanes_ready, __ATOMIC_RELAXED) & bit) == 0) {
+    __atomic_fetch_or(&pQ->lanes_ready, bit, __ATOMIC_SEQ_CST);
+  }
+  wake_consumer(pQ);
+}
+
+/**
+ * @see mpscfifo.h
+ */
+SpscRing_t* register_lane(MpscFifo_t* pQ, uint32_t size) {
+  // Allocate first so a failure doesn't use up a slot
+  const size_t alloc_size = (sizeof(MpscLane_t) + CACHE_LINE_SIZE - 1) & ~(CACHE_LINE_SIZE - 1);
+  MpscLane_t* pLane = aligned_alloc(CACHE_LINE_SIZE, alloc_size);
+  if (pLane == NULL) {
+    return NULL;
+  }
+  if (sr_init(&pLane->ring, size) == NULL) {
+    free(pLane);
+    return NULL;
+  }
+
+  // add_lane relies on qs_order pairing with the consumer's qs_barrier
+  qs_setup();
+
+  // Claim the first free slot, it's polled once lane_count covers it
+  for (uint32_t idx = 0; idx < MPSC_MAX_LANES; idx++) {
+    SpscRing_t* pFree = NULL;
+    pLane->bit = 1ULL << idx;
+    if (__atomic_compare_exchange_n(&pQ->lanes[idx], &pFree, &pLane->ring,
+          false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+      uint32_t lane_count = __atomic_load_n(&pQ->lane_count, __ATOMIC_RELAXED);
+      while ((lane_count <= idx) && !__atomic_compare_exchange_n(&pQ->lane_count,
+            &lane_count, idx + 1, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      }
+      DPF(LDR "register_lane:-pQ=%p lanes[%u]=%p\n", ldr(), pQ, idx, pLane);
+      return &pLane->ring;
+    }
+  }
+  DPF(LDR "register_lane:-pQ=%p no more lanes\n", ldr(), pQ);
+  sr_deinit(&pLane->ring);
+  free(pLane);
+  return NULL;
+}
+
+/**
+ * @see mpscfifo.h
+ */
+void unregister_lane(MpscFifo_t* pQ, SpscRing_t* pLane) {
+  uint64_t bit = ((MpscLane_t*)pLane)->bit;
+  DPF(LDR "unregister_lane: pQ=%p pLane=%p bit=0x%lx\n", ldr(), pQ, pLane, bit);
+
+  // Release our adds to the consumer, it frees the lane once empty
+  __atomic_fetch_or(&pQ->lanes_closed, bit, __ATOMIC_RELEASE);
+  lane_ready(pQ, bit);
+}
+
+/**
+ * @see mpscfifo.h
+ */
+bool add_lane(MpscFifo_t* pQ, SpscRing_t* pLane, Msg_t* pMsg) {
+  uint32_t pos = pLane->add_idx;
+  if (!sr_add(pLane, pMsg)) {
+    return false;
+  }
+#if USE_COUNT
+  pQ->count += 1;
+#endif
+
+  // Only the add to an empty lane marks it ready. If we see the
+  // consumer hasn't got to pos yet it will, or if it has already
+  // found the lane empty its sweep before parking sees this add.
+  qs_order();
+  pLane->rmv_idx_cache = __atomic_load_n(&pLane->rmv_idx, __ATOMIC_ACQUIRE);
+  if (pLane->rmv_idx_cache == pos) {
+    lane_ready(pQ, ((MpscLane_t*)pLane)->bit);
+  }
+  return true;
+}
+
+/**
+ * @see mpscfifo.h
+ */
+bool sweep_lanes(MpscFifo_t* pQ) {
+  uint32_t lane_count = __atomic_load_n(&pQ->lane_count, __ATOMIC_ACQUIRE);
+  uint64_t closed = __atomic_load_n(&pQ->lanes_closed, __ATOMIC_ACQUIRE);
+  for (uint32_t idx = 0; idx < lane_count; idx++) {
+    uint64_t bit = 1ULL << idx;
+    SpscRing_t* pLane = __atomic_load_n(&pQ->lanes[idx], __ATOMIC_ACQUIRE);
+    if ((pLane == NULL) || ((pQ->lanes_pending & bit) != 0)) {
+      continue;
+    }
+    if (((closed & bit) != 0)
+        || (__atomic_load_n(&pLane->add_idx, __ATOMIC_ACQUIRE) != pLane->rmv_idx)) {
+      DPF(LDR "sweep_lanes: pQ=%p lanes[%u] missed\n", ldr(), pQ, idx);
+      pQ->lanes_pending |= bit;
+    }
+  }
+  return (pQ->lanes_pending | __atomic_load_n(&pQ->lanes_ready, __ATOMIC_RELAXED)) != 0;
+}
+
+/**
+ * The number of lanes the consumer polls.
+ */
+static inline uint32_t polled_lanes(MpscFifo_t* pQ) {
+  return __atomic_load_n(&pQ->lane_count, __ATOMIC_ACQUIRE);
+}
+
+/**
+ * Take the ready lanes and return the next one with messages at or
+ * after rmv_lane_idx, or lane_count for the fifo itself.
+ */
+static inline uint32_t next_lane(MpscFifo_t* pQ, uint32_t lane_count) {
+  if (__atomic_load_n(&pQ->lanes_ready, __ATOMIC_RELAXED) != 0) {
+    pQ->lanes_pending |= __atomic_exchange_n(&pQ->lanes_ready, 0, __ATOMIC_ACQ_REL);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  }
+  uint32_t idx = pQ->rmv_lane_idx;
+  uint64_t after = (idx < MPSC_MAX_LANES) ? pQ->lanes_pending & ~((1ULL << idx) - 1) : 0;
+  uint32_t next = (after != 0) ? (uint32_t)__builtin_ctzll(after) : lane_count;
+  pQ->rmv_lane_idx = (next >= lane_count) ? 0 : next + 1;
+
+  // Now and then pick up a lane whose ready bit was missed, so it
+  // doesn't wait for the consumer to park while the fifo is busy
+  if ((next >= lane_count) && (--pQ->lanes_sweep == 0)) {
+    pQ->lanes_sweep = MPSC_LANE_SWEEP_INTERVAL;
+    sweep_lanes(pQ);
+  }
+  return next;
+}
+
+/**
+ * Remove up to max Msg_t's from lanes[idx]. Once it's empty it's no
+ * longer pending, its producer sets it ready again when it adds, and
+ * if it was unregistered it's freed.
+ */
+static uint32_t lane_rmv_batch(MpscFifo_t* pQ, uint32_t idx, Msg_t** msgs, uint32_t max) {
+  uint64_t bit = 1ULL << idx;
+  SpscRing_t* pLane = __atomic_load_n(&pQ->lanes[idx], __ATOMIC_ACQUIRE);
+  if (pLane == NULL) {
+    pQ->lanes_pending &= ~bit;
+    return 0;
+  }
+
+  // Once closed all of its adds are visible
+  bool closed = (__atomic_load_n(&pQ->lanes_closed, __ATOMIC_ACQUIRE) & bit) != 0;
+  uint32_t cnt = sr_rmv_batch(pLane, msgs, max);
+  if (cnt != 0) {
+#if USE_COUNT
+    pQ->count -= cnt;
+#endif
+    return cnt;
+  }
+  pQ->lanes_pending &= ~bit;
+  if (closed) {
+    DPF(LDR "lane_rmv_batch: pQ=%p free lanes[%u]=%p\n", ldr(), pQ, idx, pLane);
+    pQ->lanes_processed += sr_deinit(pLane);
+    free(pLane);
+    __atomic_fetch_and(&pQ->lanes_closed, ~bit, __ATOMIC_RELAXED);
+    __atomic_store_n(&pQ->lanes[idx], NULL, __ATOMIC_RELEASE);
+  }
+  return 0;
+}
+
+/**
+ * Poll the ready lanes and then the ring buffer or link lists round
+ * robin starting where the previous poll left off, rmv_lane_idx ==
+ * lane_count is the fifo itself.
+ */
+static inline Msg_t* rmv_polling(MpscFifo_t* pQ, const bool stall, bool* pBusy) {
+  uint32_t lane_count = polled_lanes(pQ);
+  if (lane_count == 0) {
+    return rmv_internal(pQ, stall, pBusy);
+  }
+
+  // Each pending lane and the fifo get a turn
+  bool busy = false;
+  uint32_t turns = __builtin_popcountll(pQ->lanes_pending | pQ->lanes_ready) + 1;
+  for (uint32_t i = 0; i < turns; i++) {
+    uint32_t idx = next_lane(pQ, lane_count);
+    Msg_t* pMsg = NULL;
+    if (idx >= lane_count) {
+      pMsg = rmv_internal(pQ, stall, &busy);
+    } else {
+      lane_rmv_batch(pQ, idx, &pMsg, 1);
+    }
+    if (pMsg != NULL) {
+      *pBusy = false;
+      return pMsg;
+    }
+  }
+  *pBusy = busy;
+  return NULL;
+}
+
+/**
+ * @see mpscifo.h
+ */
+Msg_t* rmv_non_stalling(MpscFifo_t* pQ, bool* pBusy) {
+  return rmv_polling(pQ, false, pBusy);
+}
+
+/**
+ * @see mpscifo.h
+ */
+Msg_t* rmv(MpscFifo_t* pQ) {
+  bool busy;
+  return rmv_polling(pQ, true, &busy);
+}
+
+/**
+ * @see mpscfifo.h
+ */
+void set_backoff(MpscFifo_t* pQ, const Backoff_t* pPolicy) {
+  backoff_init(&pQ->backoff, pPolicy->kind, pPolicy->spin_limit,
+      pPolicy->yield_limit, pPolicy->sleep_ns);
+}
+
+/**
+ * @see mpscfifo.h
+ */
+const Backoff_t* get_backoff(MpscFifo_t* pQ) {
+  return &pQ->backoff;
+}
+
+/**
+ * @see mpscfifo.h
+ */
+void backoff_rmv(MpscFifo_t* pQ, uint32_t* pAttempt) {
+  backoff(&pQ->backoff, pAttempt);
+}
+
+/**
+ * @see mpscfifo.h
+ */
+void set_mode_policy(MpscFifo_t* pQ, const MpscModePolicy_t* pPolicy) {
+  pQ->mode_policy = *pPolicy;
+  pQ->ll_check_ns = mode_now_ns();
+  pQ->ll_rmvs = 0;
+  __atomic_store_n(&pQ->ll_enter_retries, pPolicy->ll_enter_retries, __ATOMIC_RELAXED);
+}
+
+/**
+ * @see mpscfifo.h
+ */
+const MpscModePolicy_t* get_mode_policy(MpscFifo_t* pQ) {
+  return &pQ->mode_policy;
+}
+
+/**
+ * @see mpscfifo.h
+ */
+void get_mode_stats(MpscFifo_t* pQ, MpscModeStats_t* pStats) {
+  *pStats = pQ->mode_stats;
+  uint64_t elapsed = mode_now_ns() - pQ->mode_since_ns;
+  if ((pQ->rmv_state == RMV_STATE_RB) || (pQ->backend == MPSC_BACKEND_SEGMENTED)) {
+    pStats->rb_ns += elapsed;
+  } else {
+    pStats->ll_ns += elapsed;
+  }
+}
+
+/**
+ * @see mpscfifo.h
+ */
+void enable_rmv_wait(MpscFifo_t* pQ, uint32_t spin_count) {
+  pQ->wait_spin_count = spin_count;
+  pQ->sleeping = 0;
+  __atomic_store_n(&pQ->wait_enabled, true, __ATOMIC_SEQ_CST);
+}
+
+/**
+ * Poll for values, if values is true, and then a message. Values are
+ * never busy, a producer that has claimed a cell but not filled it
+ * wakes the consumer once it has.
+ */
+static inline Msg_t* rmv_poll_input(MpscFifo_t* pQ, bool values, uint64_t* pArg1,
+    uint64_t* pArg2, bool* pValue, bool* pBusy) {
+  if (values && (pQ->values.ring_buffer != NULL) && vr_rmv(&pQ->values, pArg1, pArg2)) {
+    *pValue = true;
+    *pBusy = false;
+    return NULL;
+  }
+  return rmv_polling(pQ, false, pBusy);
+}
+
+/**
+ * Spin and then park until a message is available or the deadline,
+ * if not NULL, passes. If values is true values are also waited for
+ * and removed into *pArg1 and *pArg2.
+ *
+ * @return NULL if the deadline passed or a value was removed.
+ */
+static Msg_t* rmv_wait_until(MpscFifo_t* pQ, struct timespec* deadline,
+    bool values, uint64_t* pArg1, uint64_t* pArg2) {
+  Msg_t* pMsg;
+  bool busy;
+  bool value = false;
+  uint32_t attempt = 0;
+
+  while (true) {
+    for (uint32_t i = 0; i <= pQ->wait_spin_count; i++) {
+      pMsg = rmv_poll_input(pQ, values, pArg1, pArg2, &value, &busy);
+      if ((pMsg != NULL) || value) {
+        return pMsg;
+      }
+    }
+
+    struct timespec timeout;
+    struct timespec* pTimeout = NULL;
+    if (deadline != NULL) {
+      struct timespec now;
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      double remaining_ns = diff_timespec_ns(deadline, &now);
+      if (remaining_ns <= 0) {
+        return NULL;
+      }
+      timeout.tv_sec = (time_t)(remaining_ns / ns_flt);
+      timeout.tv_nsec = (long)(remaining_ns - (timeout.tv_sec * ns_flt));
+      pTimeout = &timeout;
+    }
+
+    if (busy || !pQ->wait_enabled) {
+      // A producer is part way through an add or we can't park
+      backoff(&pQ->backoff, &attempt);
+      continue;
+    }
+
+    if (park_hook != NULL) {
+      park_hook();
+    }
+
+    // Announce we're parking and then look once more, see wake_consumer
+    // and add_lane
+    __atomic_store_n(&pQ->sleeping, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (polled_lanes(pQ) != 0) {
+      qs_barrier();
+      sweep_lanes(pQ);
+    }
+    pMsg = rmv_poll_input(pQ, values, pArg1, pArg2, &value, &busy);
+    if ((pMsg != NULL) || value || busy) {
+      __atomic_store_n(&pQ->sleeping, 0, __ATOMIC_RELAXED);
+      if ((pMsg != NULL) || value) {
+        return pMsg;
+      }
+      continue;
+    }
+
+    DPF(LDR "rmv_wait_until: pQ=%p parking\n", ldr(), pQ);
+    futex_wait(&pQ->sleeping, 1, pTimeout);
+    __atomic_store_n(&pQ->sleeping, 0, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * @see mpscfifo.h
+ */
+Msg_t* rmv_wait(MpscFifo_t* pQ) {
+  return rmv_wait_until(pQ, NULL, false, NULL, NULL);
+}
+
+/**
+ * @see mpscfifo.h
+ */
+Msg_t* rmv_timed_wait(MpscFifo_t* pQ, uint64_t timeout_ns) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout_ns / ns_u64;
+  deadline.tv_nsec += timeout_ns % ns_u64;
+  if (deadline.tv_nsec >= ns_u64) {
+    deadline.tv_sec += 1;
+    deadline.tv_nsec -= ns_u64;
+  }
+  return rmv_wait_until(pQ, &deadline, false, NULL, NULL);
+}
+
+/**
+ * @see mpscfifo.h
+ */
+bool enable_values(MpscFifo_t* pQ, uint32_t size) {
+  return vr_init(&pQ->values, size) != NULL;
+}
+
+/**
+ * @see mpscfifo.h
+ */
+bool add_value(MpscFifo_t* pQ, uint64_t arg1, uint64_t arg2) {
+  if ((pQ->values.ring_buffer == NULL) || !vr_add(&pQ->values, arg1, arg2)) {
+    return false;
+  }
+  wake_consumer(pQ);
+  return true;
+}
+
+/**
+ * @see mpscfifo.h
+ */
+bool rmv_value(MpscFifo_t* pQ, uint64_t* pArg1, uint64_t* pArg2) {
+  return (pQ->values.ring_buffer != NULL) && vr_rmv(&pQ->values, pArg1, pArg2);
+}
+
+/**
+ * @see mpscfifo.h
+ */
+Msg_t* wait_for_input(MpscFifo_t* pQ, uint64_t* pArg1, uint64_t* pArg2) {
+  return rmv_wait_until(pQ, NULL, true, pArg1, pArg2);
+}
+
+/**
+ * Remove up to max messages from the ring buffer and link lists
+ * or the segmented ring, but not the lanes.
+ */
+static uint32_t rmv_batch_internal(MpscFifo_t* pQ, Msg_t** msgs, uint32_t max) {
+  uint32_t cnt = 0;
+  uint32_t attempt = 0;
+  Msg_t* pMsg;
+
+  if (pQ->backend == MPSC_BACKEND_SEGMENTED) {
+    cnt = sg_rmv_batch(&pQ->sg, msgs, max);
+    goto done;
+  }
+  while (cnt < max) {
+    switch (pQ->rmv_state) {
+      case (RMV_STATE_RB): {
+        DPF(LDR "rmv_batch: pQ=%p RMV_STATE_RB\n", ldr(), pQ);
+        uint32_t rb_cnt = ring_rmv_batch(pQ, &msgs[cnt], max - cnt);
+        rmv_sample_depth(pQ, rb_cnt);
+        cnt += rb_cnt;
+        if (cnt == max) {
+          break;
+        }
+        if (ADD_STATE_RB == __atomic_load_n(&pQ->add_state, __ATOMIC_ACQUIRE)) {
+          // No more messages in RB or LL
+          goto done;
+        }
+
+        // Rb is empty but the we need to switch to RMV_STATE_LL too
+        pQ->rmv_link_list_idx = pQ->rmv_link_list_idx ^ 1;
+        rmv_overflowed(pQ);
+
+        DPF(LDR "rmv_batch: pQ=%p RMV_STATE_RB change to RMV_STATE_LL cnt=%u\n", ldr(), pQ, cnt);
+        rmv_mode_changed(pQ, true);
+        pQ->rmv_state = RMV_STATE_LL;
+        break;
+      }
+
+      case (RMV_STATE_CHANGING_ADD_STATE_TO_ADD_STATE_RB): {
+        DPF(LDR "rmv_batch: pQ=%p RMV_STATE_CHANGING_ADD_STATE_TO_ADD_STATE_RB\n", ldr(), pQ);
+        bool busy = false;
+        if ((pQ->resize_capacity != 0) && !rmv_resize(pQ, cnt == 0, &busy)) {
+          // Unless a producer is busy the link list is empty, stay
+          // with it until it empties again
+          if (!busy) {
+            pQ->rmv_state = RMV_STATE_LL;
+          }
+          goto done;
+        }
+        uint32_t add_state_ll = ADD_STATE_LL;
+        if (__atomic_compare_exchange_n(&pQ->add_state, &add_state_ll, ADD_STATE_RB, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+          pQ->rmv_state = RMV_STATE_CHANGING_TO_RB;
+        } else if (cnt != 0) {
+          goto done;
+        } else {
+          backoff(&pQ->backoff, &attempt);
+        }
+        break;
+      }
+
+      case (RMV_STATE_CHANGING_TO_RB): {
+        DPF(LDR "rmv_batch: pQ=%p RMV_STATE_CHANGING_TO_RB\n", ldr(), pQ);
+
+        // Wait until no producer that saw ADD_STATE_LL is still adding
+        // to the link list, then return any lingering messages from it
+        if (!pQ->rmv_quiesced) {
+          if (!qs_quiescent(&pQ->rmv_qs, pQ, cnt == 0, &pQ->backoff)) {
+            goto done;
+          }
+          pQ->rmv_quiesced = true;
+        }
+        MpscLinkList_t* pLl = &pQ->link_lists[pQ->rmv_link_list_idx];
+        cnt += ll_rmv_batch(pLl, &msgs[cnt], max - cnt);
+        if (cnt != 0) {
+          goto done;
+        }
+        if ((pMsg = ll_rmv(pLl, &pQ->backoff)) != NULL) {
+          msgs[cnt++] = pMsg;
+        } else {
+          // link list is empty, now switch to RB
+          pQ->rmv_quiesced = false;
+          rmv_mode_changed(pQ, false);
+          pQ->rmv_state = RMV_STATE_RB;
+        }
+        break;
+      }
+
+      case (RMV_STATE_LL): {
+        DPF(LDR "rmv_batch: pQ=%p RMV_STATE_LL\n", ldr(), pQ);
+        MpscLinkList_t* pLl = &pQ->link_lists[pQ->rmv_link_list_idx];
+        uint32_t ll_cnt = ll_rmv_batch(pLl, &msgs[cnt], max - cnt);
+        pQ->ll_rmvs += ll_cnt;
+        cnt += ll_cnt;
+        if (cnt != 0) {
+          goto done;
+        }
+        if ((pMsg = ll_rmv(pLl, &pQ->backoff)) != NULL) {
+          pQ->ll_rmvs += 1;
+          msgs[cnt++] = pMsg;
+          break;
+        }
+        if (!rmv_ll_may_exit(pQ)) {
+          goto done;
+        }
+
+        DPF(LDR "rmv_batch: pQ=%p RMV_STATE_LL, change rmv_state=RMV_STATE_CHANGING_TO_RB\n", ldr(), pQ);
+        pQ->rmv_state = RMV_STATE_CHANGING_ADD_STATE_TO_ADD_STATE_RB;
+        break;
+      }
+    }
+  }
+
+done:
+#if USE_COUNT
+  pQ->count -= cnt;
+#endif
+  DPF(LDR "rmv_batch:-pQ=%p cnt=%u\n", ldr(), pQ, cnt);
+  return cnt;
+}
+
+/**
+ * @see mpscifo.h
+ */
+uint32_t rmv_batch(MpscFifo_t* pQ, Msg_t** msgs, uint32_t max) {
+  uint32_t lane_count = polled_lanes(pQ);
+  if (lane_count == 0) {
+    return rmv_batch_internal(pQ, msgs, max);
+  }
+
+  // Like rmv_polling, each pending lane and the fifo get a turn
+  uint32_t cnt = 0;
+  uint32_t turns = __builtin_popcountll(pQ->lanes_pending | pQ->lanes_ready) + 1;
+  for (uint32_t i = 0; (i < turns) && (cnt < max); i++) {
+    uint32_t idx = next_lane(pQ, lane_count);
+    if (idx >= lane_count) {
+      cnt += rmv_batch_internal(pQ, &msgs[cnt], max - cnt);
+    } else {
+      cnt += lane_rmv_batch(pQ, idx, &msgs[cnt], max - cnt);
+    }
+  }
+  return cnt;
+}
+
 /**
  * @see mpscfifo.h
  */
 void ret_msg(Msg_t* pMsg) {
   if ((pMsg != NULL) && (pMsg->pPool != NULL)) {
     DPF(LDR "ret_msg: pool=%p msg=%p arg1=%lu arg2=%lu\n", ldr(), pMsg->pPool, pMsg, pMsg->arg1, pMsg->arg2);
+    Msg_t* pParent = pMsg->pParent;
+    ret_credit(pMsg);
     MsgPool_ret_msg(pMsg->pPool, pMsg);
+    if ((pParent != NULL) && (__atomic_sub_fetch(&pParent->refs, 1, __ATOMIC_ACQ_REL) == 0)) {
+      DPF(LDR "ret_msg: last handle msg=%p ret pParent=%p\n", ldr(), pMsg, pParent);
+      ret_msg(pParent);
+    }
     //add(pMsg->pPoolFifo, pMsg);
   } else {
     if (pMsg == NULL) {
@@ -285,6 +1456,43 @@ void ret_msg(Msg_t* pMsg) {
   }
 }
 
+/**
+ * @see mpscfifo.h
+ */
+uint32_t multicast(MsgPool_t* pHandlePool, Msg_t* pMsg, MpscFifo_t** fifos, uint32_t n) {
+  DPF(LDR "multicast:+pMsg=%p n=%u\n", ldr(), pMsg, n);
+  Msg_t* handles[MULTICAST_BATCH];
+
+  // Hold a reference until every handle is sent so pMsg can't be
+  // returned by a consumer that's quicker than us
+  __atomic_store_n(&pMsg->refs, n + 1, __ATOMIC_RELAXED);
+  uint32_t sent = 0;
+  while (sent < n) {
+    uint32_t want = ((n - sent) < MULTICAST_BATCH) ? (n - sent) : MULTICAST_BATCH;
+    uint32_t cnt = MsgPool_get_msgs(pHandlePool, handles, want);
+    for (uint32_t i = 0; i < cnt; i++) {
+      Msg_t* pHandle = handles[i];
+      pHandle->pParent = pMsg;
+      pHandle->pRspQ = pMsg->pRspQ;
+      pHandle->arg1 = pMsg->arg1;
+      pHandle->arg2 = pMsg->arg2;
+      add(fifos[sent + i], pHandle);
+    }
+    sent += cnt;
+    if (cnt < want) {
+      DPF(LDR "multicast: pMsg=%p out of handles sent=%u\n", ldr(), pMsg, sent);
+      break;
+    }
+  }
+
+  // Drop the references of the handles we didn't send and our own
+  if (__atomic_sub_fetch(&pMsg->refs, (n - sent) + 1, __ATOMIC_ACQ_REL) == 0) {
+    ret_msg(pMsg);
+  }
+  DPF(LDR "multicast:-pMsg=%p n=%u sent=%u\n", ldr(), pMsg, n, sent);
+  return sent;
+}
+
 /**
  * @see mpscfifo.h
  */
@@ -297,6 +1505,7 @@ void send_rsp_or_ret(Msg_t* msg, uint64_t arg1) {
 
   if (msg->pRspQ != NULL) {
     MpscFifo_t* pRspQ = msg->pRspQ;
+    ret_credit(msg);
     msg->pRspQ = NULL;
     msg->arg1 = arg1;
     DPF(LDR "send_rsp_or_ret: send pRspQ=%p msg=%p pool=%p arg1=%lu arg2=%lu\n",
@@ -25,6 +25,12 @@
 #include "msg.h"
 #include "mpscringbuff.h"
 #include "mpsclinklist.h"
+#include "mpscsegring.h"
+#include "mpscfaaring.h"
+#include "mpscvaluering.h"
+#include "spscring.h"
+#include "backoff.h"
+#include "quiesce.h"
 
 #include <stdbool.h>
 #include <stdint.h>
@@ -38,19 +44,135 @@
 #define RMV_STATE_CHANGING_ADD_STATE_TO_ADD_STATE_RB 0x30
 #define RMV_STATE_CHANGING_TO_RB   0x40 
 
+#define MPSC_BACKEND_RB_LL         0x00
+#define MPSC_BACKEND_SEGMENTED     0x01
+#define MPSC_BACKEND_FAA_LL        0x02
+
+#define MPSC_MAX_LANES             64
+
+// Turns of the fifo between the consumer's sweeps of the lanes
+#define MPSC_LANE_SWEEP_INTERVAL   64
+
+typedef struct MpscFifoSet_t MpscFifoSet_t;
+
+/**
+ * When to change between the ring buffer and the link lists, see
+ * set_mode_policy. The default enters the link list the first time
+ * the ring is full and leaves as soon as the link list drains.
+ */
+typedef struct MpscModePolicy_t {
+  // Times a producer retries a full ring before changing to the link list
+  uint32_t ll_enter_retries;
+
+  // Minimum time in link list mode before changing back to the ring
+  uint64_t ll_min_dwell_ns;
+
+  // If true stay in link list mode while the burst persists, that is
+  // while more than ll_exit_low_watermark messages were removed from
+  // the link list since it was last found empty and could leave. Set
+  // the watermark to the ring occupancy you're happy to return to.
+  bool ll_keep_while_busy;
+  uint32_t ll_exit_low_watermark;
+} MpscModePolicy_t;
+
+/**
+ * Mode changes as seen by the consumer, see get_mode_stats.
+ */
+typedef struct MpscModeStats_t {
+  uint64_t to_ll;
+  uint64_t to_rb;
+  uint64_t rb_ns;
+  uint64_t ll_ns;
+} MpscModeStats_t;
+
 typedef struct MpscFifo_t {
+  // Read by every producer, written when changing modes
+  uint32_t add_state CACHE_LINE_ALIGNED;
+  uint32_t add_link_list_idx;
+  uint32_t backend;
+  uint32_t wait_enabled;
+  uint32_t ll_enter_retries;
+  MpscFifoSet_t* pSet;
+  uint64_t set_bit;
+
+  // Written by the consumer
+  uint32_t rmv_state CACHE_LINE_ALIGNED;
+  uint32_t rmv_link_list_idx;
+  uint32_t rmv_lane_idx;
+  uint64_t lanes_pending;
+  uint64_t lanes_processed;
+  uint32_t lanes_sweep;
+  uint32_t rmv_quiesced;
+  QsSnapshot_t rmv_qs;
+  uint32_t wait_spin_count;
+  Backoff_t backoff;
+
+  // Adaptive ring capacity, only used by the consumer
+  uint32_t min_capacity;
+  uint32_t max_capacity;
+  uint32_t resize_capacity;
+  QsSnapshot_t resize_qs;
+  uint32_t overflows;
+  uint32_t rmvs_since_sample;
+  uint32_t samples;
+  uint32_t max_depth;
+
+  // Mode policy and counters, only used by the consumer
+  MpscModePolicy_t mode_policy;
+  MpscModeStats_t mode_stats;
+  uint64_t mode_since_ns;
+  uint64_t ll_check_ns;
+  uint32_t ll_rmvs;
+
+  // Written by producers and the consumer, only if MPSC_STATS
+  volatile _Atomic(int32_t) count CACHE_LINE_ALIGNED;
+
+  // Credits try_add takes and the consumer returns, only after
+  // enable_credits
+  volatile _Atomic(int32_t) credits CACHE_LINE_ALIGNED;
+  uint32_t credit_limit;
+
+  // Futex word, set by the consumer when it parks and cleared
+  // by the producer that wakes it
+  volatile uint32_t sleeping CACHE_LINE_ALIGNED;
+
+  // Written by producers only when registering a lane and by the
+  // consumer when it frees an unregistered one
+  volatile _Atomic(uint32_t) lane_count CACHE_LINE_ALIGNED;
+  SpscRing_t* volatile lanes[MPSC_MAX_LANES];
+
+  // A bit per lane, set by its producer when its add makes the lane
+  // non-empty or it unregisters it and taken by the consumer
+  volatile _Atomic(uint64_t) lanes_ready CACHE_LINE_ALIGNED;
+  volatile _Atomic(uint64_t) lanes_closed;
+
   MpscRingBuff_t rb;
-  uint32_t add_state;
-  uint32_t rmv_state;
-  volatile _Atomic(uint32_t) add_pending_count;
 
   MpscLinkList_t link_lists[2];
 
-  uint32_t add_link_list_idx;
-  uint32_t rmv_link_list_idx;
+  // Only used by MPSC_BACKEND_SEGMENTED
+  MpscSegRing_t sg;
 
-  volatile _Atomic(int32_t) count;
+  // Used instead of rb by MPSC_BACKEND_FAA_LL
+  MpscFaaRing_t faa;
+
+  // Only used after enable_values
+  MpscValueRing_t values;
 } MpscFifo_t;
+
+#if !MPSC_PACKED_LAYOUT
+_Static_assert(!SAME_CACHE_LINE(MpscFifo_t, add_state, rmv_state), "add_state and rmv_state share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFifo_t, count, rmv_state), "count and rmv_state share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFifo_t, count, add_state), "count and add_state share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFifo_t, lane_count, count), "lane_count and count share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFifo_t, credits, count), "credits and count share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFifo_t, credits, sleeping), "credits and sleeping share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFifo_t, credits, rmv_state), "credits and rmv_state share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFifo_t, sleeping, count), "sleeping and count share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFifo_t, sleeping, lane_count), "sleeping and lane_count share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFifo_t, lanes_ready, lanes), "lanes_ready and lanes share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFifo_t, lanes_ready, rmv_state), "lanes_ready and rmv_state share a cache line");
+#endif
   
 /**
  * Initialize an MpscFifo_t. Don't forget to empty the fifo
@@ -58,28 +180,151 @@ typedef struct MpscFifo_t {
  */
 extern MpscFifo_t* initMpscFifo(MpscFifo_t* pQ);
 
+/**
+ * Initialize an MpscFifo_t whose ring buffer has capacity
+ * entries, capacity must be a power of two.
+ *
+ * @return NULL if capacity is invalid or can't be allocated.
+ */
+extern MpscFifo_t* initMpscFifoCapacity(MpscFifo_t* pQ, uint32_t capacity);
+
+/**
+ * Initialize an MpscFifo_t whose ring buffer starts with capacity
+ * entries and is resized by the consumer between min_capacity and
+ * max_capacity. When the ring keeps overflowing into the link list it
+ * is doubled and when it stays shallow it is halved. The new ring is
+ * swapped in while the producers are using the link list and none
+ * are part way through an add. All must be powers of two with
+ * min_capacity <= capacity <= max_capacity.
+ *
+ * @return NULL if a capacity is invalid or can't be allocated.
+ */
+extern MpscFifo_t* initMpscFifoAdaptive(MpscFifo_t* pQ, uint32_t capacity,
+    uint32_t min_capacity, uint32_t max_capacity);
+
+/**
+ * Initialize an MpscFifo_t that uses an unbounded queue of ring
+ * segments instead of the ring buffer and link lists. Deep queues
+ * stay in consecutive slots rather than a cell per message.
+ *
+ * @return NULL if the first segment can't be allocated.
+ */
+extern MpscFifo_t* initMpscFifoSegmented(MpscFifo_t* pQ);
+
+/**
+ * Initialize an MpscFifo_t whose ring has capacity entries and
+ * whose producers claim cells with fetch and add instead of a
+ * compare and exchange loop, when it's full the link lists are
+ * used as usual. capacity must be a power of two.
+ *
+ * @return NULL if capacity is invalid or can't be allocated.
+ */
+extern MpscFifo_t* initMpscFifoFaa(MpscFifo_t* pQ, uint32_t capacity);
+
 /**
  * Deinitialize the MpscFifo_t and ***pStub is stub if this routine
  * can't return it to its pool (ppStub maybe NULL).  Assumes the
  * fifo is empty and the only member is the stub.
  *
- * @return number of messages removed.
+ * @return number of messages and values removed.
  */
 extern uint64_t deinitMpscFifo(MpscFifo_t* pQ);
 
 /**
  * Add a Msg_t to the Queue. This maybe used by multiple
  * entities on the same or different thread. This will never
- * block as it is a wait free algorithm.
+ * block as it is a wait free algorithm. It doesn't take a credit,
+ * see enable_credits.
  */
 extern void add(MpscFifo_t* pQ, Msg_t* pMsg);
 
+/**
+ * Enable try_add with limit credits, so at most limit messages added
+ * with try_add are queued or being processed by the consumer. This
+ * must be called before any producer uses try_add. Only try_add
+ * takes credits, what add, add_batch, add_lane, add_value and
+ * multicast add isn't limited.
+ */
+extern void enable_credits(MpscFifo_t* pQ, uint32_t limit);
+
+/**
+ * Add a Msg_t to the Queue if a credit is available, the message
+ * holds the credit until the consumer responds with send_rsp_or_ret
+ * or returns it with ret_msg. A message forwarded with try_add gives
+ * back the credit it already holds once it has the new one. If
+ * enable_credits wasn't called this is add and a credit the message
+ * holds stays with it. This maybe used by multiple entities and will never block.
+ *
+ * @return false if there are no credits, the message isn't added.
+ */
+extern bool try_add(MpscFifo_t* pQ, Msg_t* pMsg);
+
+/**
+ * Add n Msg_t's to the Queue in order. In ring buffer mode a
+ * contiguous run of cells is reserved at once and in link list
+ * mode the messages are spliced in as a single chain. This maybe
+ * used by multiple entities and will never block.
+ */
+extern void add_batch(MpscFifo_t* pQ, Msg_t** msgs, uint32_t n);
+
+/**
+ * Add n Msg_t's to a fifo no other thread is using yet, such as one
+ * just initialized. The ring is filled and the rest are pre-linked
+ * into the link list with plain stores and no atomics. Other threads
+ * must be ordered after it, e.g. by pthread_create.
+ */
+extern void load_batch(MpscFifo_t* pQ, Msg_t** msgs, uint32_t n);
+
+/**
+ * Register a lane, a private single producer ring of size entries,
+ * size must be a power of two. The producer that registered it may
+ * then use add_lane with no atomic read modify writes, except for
+ * the add that makes the lane non-empty which sets its ready bit.
+ * The consumer polls the ready lanes and the fifo round robin. Lanes may be
+ * registered by any thread and last until they're unregistered or
+ * the fifo is deinitialized.
+ *
+ * @return NULL if MPSC_MAX_LANES are registered or it can't be allocated.
+ */
+extern SpscRing_t* register_lane(MpscFifo_t* pQ, uint32_t size);
+
+/**
+ * Unregister a lane returned by register_lane, its producer must not
+ * use it afterwards. The consumer removes what's left in it and then
+ * frees it, so its slot may be registered again.
+ */
+extern void unregister_lane(MpscFifo_t* pQ, SpscRing_t* pLane);
+
+/**
+ * Add a Msg_t to a lane returned by register_lane. This maybe
+ * used only by a single thread.
+ *
+ * WARNING: Messages are first in first out only within the lane.
+ * If a full lane is handled by using add instead the message may be
+ * removed before those still in the lane, a producer that needs its
+ * messages in order must retry add_lane until it succeeds.
+ *
+ * @return false if the lane is full.
+ */
+extern bool add_lane(MpscFifo_t* pQ, SpscRing_t* pLane, Msg_t* pMsg);
+
+/**
+ * Look for lanes with messages whose ready bit was missed and make
+ * them pending, used by the consumer. A consumer about to park calls
+ * qs_barrier first so it sees every add_lane that didn't wake it.
+ *
+ * @return true if a lane is pending.
+ */
+extern bool sweep_lanes(MpscFifo_t* pQ);
+
 /**
  * Remove a Msg_t from the Queue. This maybe used only by
- * a single thread and returns NULL if empty or would
- * have blocked.
+ * a single thread and never stalls. Returns NULL if empty
+ * or if it would have stalled waiting on a producer that
+ * is part way through an add, in the later case *pBusy is
+ * set to true and the caller should try again later.
  */
-extern Msg_t* rmv_non_stalling(MpscFifo_t* pQ);
+extern Msg_t* rmv_non_stalling(MpscFifo_t* pQ, bool* pBusy);
 
 /**
  * Remove a Msg_t from the Queue. This maybe used only by
@@ -90,12 +335,146 @@ extern Msg_t* rmv_non_stalling(MpscFifo_t* pQ);
 extern Msg_t* rmv(MpscFifo_t* pQ);
 
 /**
- * Return the message to its pool.
+ * Enable rmv_wait and rmv_timed_wait, the consumer polls an empty
+ * fifo spin_count times before it parks on a futex. Once enabled
+ * every add checks if the consumer is parked and only then makes
+ * the wake system call. This must be called before any producer
+ * adds to the fifo.
+ */
+extern void enable_rmv_wait(MpscFifo_t* pQ, uint32_t spin_count);
+
+/**
+ * Called by rmv_wait, rmv_timed_wait, wait_for_input and the fifo set
+ * waits on this thread just before they park, so the thread can first
+ * hand back what others may be waiting for. NULL if there's none.
+ */
+typedef void (*MpscParkHook_t)(void);
+extern _Thread_local MpscParkHook_t park_hook;
+
+/**
+ * Remove a Msg_t from the Queue waiting until one is available.
+ * This maybe used only by a single thread. If enable_rmv_wait
+ * wasn't called it never parks and yields instead.
+ */
+extern Msg_t* rmv_wait(MpscFifo_t* pQ);
+
+/**
+ * Remove a Msg_t from the Queue waiting at most timeout_ns for one
+ * to be available. This maybe used only by a single thread.
+ *
+ * @return NULL if timeout_ns expired.
+ */
+extern Msg_t* rmv_timed_wait(MpscFifo_t* pQ, uint64_t timeout_ns);
+
+/**
+ * Enable add_value with a ring of size values, size must be a power
+ * of two. This must be called before any producer adds a value.
+ *
+ * @return false if size is invalid or can't be allocated.
+ */
+extern bool enable_values(MpscFifo_t* pQ, uint32_t size);
+
+/**
+ * Add two values without a Msg_t, they're removed by rmv_value or
+ * wait_for_input rather than rmv and are not ordered with respect to
+ * messages. This maybe used by multiple entities on the same or
+ * different threads.
+ *
+ * @return false if the value ring is full or not enabled.
+ */
+extern bool add_value(MpscFifo_t* pQ, uint64_t arg1, uint64_t arg2);
+
+/**
+ * Remove the oldest values into *pArg1 and *pArg2. This maybe used
+ * only by a single thread.
+ *
+ * @return false if there are none.
+ */
+extern bool rmv_value(MpscFifo_t* pQ, uint64_t* pArg1, uint64_t* pArg2);
+
+/**
+ * Wait until a value or a Msg_t is available, values are taken first.
+ * This maybe used only by a single thread, see rmv_wait.
+ *
+ * @return the Msg_t or NULL if values were removed into *pArg1 and
+ * *pArg2.
+ */
+extern Msg_t* wait_for_input(MpscFifo_t* pQ, uint64_t* pArg1, uint64_t* pArg2);
+
+/**
+ * Set the policy the consumer uses while it waits on a producer
+ * that is part way through an add, the counters are cleared.
+ * This maybe used only by the consumer.
+ */
+extern void set_backoff(MpscFifo_t* pQ, const Backoff_t* pPolicy);
+
+/**
+ * Get the consumer's backoff policy and its counters.
+ */
+extern const Backoff_t* get_backoff(MpscFifo_t* pQ);
+
+/**
+ * Wait a little using the consumer's backoff policy, for a consumer
+ * waiting on something other than the fifo, see backoff.
+ */
+extern void backoff_rmv(MpscFifo_t* pQ, uint32_t* pAttempt);
+
+/**
+ * Set the policy for changing between the ring buffer and the link
+ * lists. Entering the link list on the first full ring and leaving
+ * as soon as it drains can ping pong under bursty load, a dwell time
+ * and watermark add hysteresis. This maybe used only by the consumer.
+ */
+extern void set_mode_policy(MpscFifo_t* pQ, const MpscModePolicy_t* pPolicy);
+
+/**
+ * Get the policy for changing between the ring buffer and link lists.
+ */
+extern const MpscModePolicy_t* get_mode_policy(MpscFifo_t* pQ);
+
+/**
+ * Get the number of mode changes and the time spent in each mode
+ * including the current one. This maybe used only by the consumer.
+ */
+extern void get_mode_stats(MpscFifo_t* pQ, MpscModeStats_t* pStats);
+
+/**
+ * Remove up to max Msg_t's from the Queue into msgs. This maybe
+ * used only by a single thread. Like rmv it may stall but only
+ * if no messages have been removed yet.
+ *
+ * @return number removed, 0 if empty.
+ */
+extern uint32_t rmv_batch(MpscFifo_t* pQ, Msg_t** msgs, uint32_t max);
+
+/**
+ * Return the message to its pool, if it's a multicast handle its
+ * parent is returned once the last handle is. A credit it holds is
+ * returned to its fifo.
  */
 extern void ret_msg(Msg_t* pMsg);
 
 /**
- * Send a response arg1 if the msg->pRspQ != NULL otherwise ret msg
+ * Send pMsg to the n fifos, each is sent a handle from pHandlePool
+ * whose pParent is pMsg and whose pRspQ, arg1 and arg2 are copies of
+ * pMsg's. The id isn't copied, n responses can't share the one id an
+ * rpc table expects a single response for, so a handle's id is 0 and
+ * rpc_poll counts responses to it as unmatched. The handles are got
+ * from the pool in batches and pMsg is returned to its pool when the
+ * last one is returned with ret_msg, or now if none could be sent.
+ * This maybe used only by the owner of pHandlePool.
+ *
+ * A handle costs about what sending a message with no data does, so
+ * multicast only pays when pMsg carries data, see perf_multicast in
+ * simple.c where it's cheaper than copies from about 1K bytes on.
+ *
+ * @return number of fifos sent to, less than n if pHandlePool ran out.
+ */
+extern uint32_t multicast(MsgPool_t* pHandlePool, Msg_t* pMsg, MpscFifo_t** fifos, uint32_t n);
+
+/**
+ * Send a response arg1 if the msg->pRspQ != NULL otherwise ret msg,
+ * either way a credit it holds is returned to its fifo.
  */
 extern void send_rsp_or_ret(Msg_t* msg, uint64_t arg1);
 
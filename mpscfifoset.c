@@ -0,0 +1,273 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A MpscFifoSet lets one consumer wait on many MpscFifo_t's,
+ * see mpscfifoset.h.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscfifoset.h"
+#include "mpscfifo.h"
+#include "futex.h"
+#include "msg.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * Look for lanes whose producer didn't set the fifo ready, see
+ * sweep_lanes, and make their fifos pending. Before parking barrier
+ * must be true.
+ *
+ * @return true if one was found.
+ */
+static bool fs_sweep_lanes(MpscFifoSet_t* pSet, bool barrier) {
+  bool lanes = false;
+  for (uint32_t i = 0; i < pSet->count; i++) {
+    lanes |= __atomic_load_n(&pSet->fifos[i]->lane_count, __ATOMIC_ACQUIRE) != 0;
+  }
+  if (!lanes) {
+    return false;
+  }
+  bool found = false;
+  if (barrier) {
+    qs_barrier();
+  }
+  for (uint32_t i = 0; i < pSet->count; i++) {
+    MpscFifo_t* pQ = pSet->fifos[i];
+    if ((__atomic_load_n(&pQ->lane_count, __ATOMIC_ACQUIRE) != 0) && sweep_lanes(pQ)) {
+      pSet->pending |= pQ->set_bit;
+      found = true;
+    }
+  }
+  return found;
+}
+
+/**
+ * Take the ready bits, the fence orders the exchange before the
+ * consumer looks at the fifos, see fs_ready.
+ */
+static inline uint64_t fs_take_ready(MpscFifoSet_t* pSet) {
+  // Now and then pick up a lane whose ready bit was missed, so it
+  // doesn't wait for us to park while other fifos are busy
+  if (--pSet->lanes_sweep == 0) {
+    pSet->lanes_sweep = MPSC_LANE_SWEEP_INTERVAL;
+    fs_sweep_lanes(pSet, false);
+  }
+  if (__atomic_load_n(&pSet->ready, __ATOMIC_RELAXED) == 0) {
+    return 0;
+  }
+  uint64_t bits = __atomic_exchange_n(&pSet->ready, 0, __ATOMIC_ACQ_REL);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return bits;
+}
+
+/**
+ * Spin and then park until a producer sets a ready bit.
+ */
+static void fs_park(MpscFifoSet_t* pSet) {
+  for (uint32_t i = 0; i <= pSet->spin_count; i++) {
+    if (__atomic_load_n(&pSet->ready, __ATOMIC_ACQUIRE) != 0) {
+      return;
+    }
+  }
+
+  if (park_hook != NULL) {
+    park_hook();
+  }
+
+  // Announce we're parking and then look once more, see fs_ready
+  // and add_lane
+  __atomic_store_n(&pSet->sleeping, 1, __ATOMIC_SEQ_CST);
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (!fs_sweep_lanes(pSet, true) && (__atomic_load_n(&pSet->ready, __ATOMIC_SEQ_CST) == 0)) {
+    DPF(LDR "fs_park: pSet=%p parking\n", ldr(), pSet);
+    futex_wait(&pSet->sleeping, 1, NULL);
+  }
+  __atomic_store_n(&pSet->sleeping, 0, __ATOMIC_RELAXED);
+}
+
+/**
+ * @return the index of the first bit in bits after idx, wrapping
+ * around, bits must not be 0.
+ */
+static inline uint32_t fs_next(uint64_t bits, uint32_t idx) {
+  uint64_t after = bits & ~((2ULL << idx) - 1);
+  return __builtin_ctzll((after != 0) ? after : bits);
+}
+
+/**
+ * @see mpscfifoset.h
+ */
+MpscFifoSet_t* fs_init(MpscFifoSet_t* pSet, uint32_t spin_count) {
+  DPF(LDR "fs_init:+pSet=%p spin_count=%u\n", ldr(), pSet, spin_count);
+  pSet->ready = 0;
+  pSet->sleeping = 0;
+  pSet->pending = 0;
+  pSet->count = 0;
+  pSet->spin_count = spin_count;
+  pSet->cur_idx = FS_MAX_FIFOS - 1;
+  pSet->cur_credit = 0;
+  pSet->lanes_sweep = MPSC_LANE_SWEEP_INTERVAL;
+  for (uint32_t i = 0; i < FS_MAX_FIFOS; i++) {
+    pSet->fifos[i] = NULL;
+    pSet->weights[i] = 0;
+  }
+  DPF(LDR "fs_init:-pSet=%p\n", ldr(), pSet);
+  return pSet;
+}
+
+/**
+ * @see mpscfifoset.h
+ */
+void fs_deinit(MpscFifoSet_t* pSet) {
+  DPF(LDR "fs_deinit:+pSet=%p count=%u\n", ldr(), pSet, pSet->count);
+  for (uint32_t i = 0; i < pSet->count; i++) {
+    __atomic_store_n(&pSet->fifos[i]->pSet, NULL, __ATOMIC_RELEASE);
+    pSet->fifos[i]->set_bit = 0;
+    pSet->fifos[i] = NULL;
+  }
+  pSet->count = 0;
+  pSet->ready = 0;
+  pSet->pending = 0;
+  DPF(LDR "fs_deinit:-pSet=%p\n", ldr(), pSet);
+}
+
+/**
+ * @see mpscfifoset.h
+ */
+int32_t fs_register(MpscFifoSet_t* pSet, MpscFifo_t* pQ, uint32_t weight) {
+  if ((pSet->count >= FS_MAX_FIFOS) || (weight == 0)) {
+    printf(LDR "fs_register: pSet=%p pQ=%p count=%u weight=%u can't register\n",
+        ldr(), pSet, pQ, pSet->count, weight);
+    return -1;
+  }
+  uint32_t idx = pSet->count;
+  pSet->fifos[idx] = pQ;
+  pSet->weights[idx] = weight;
+  pSet->count += 1;
+
+  // It may already have messages so start out ready
+  pQ->set_bit = 1ULL << idx;
+  __atomic_fetch_or(&pSet->ready, pQ->set_bit, __ATOMIC_RELAXED);
+  __atomic_store_n(&pQ->pSet, pSet, __ATOMIC_SEQ_CST);
+  DPF(LDR "fs_register: pSet=%p pQ=%p idx=%u weight=%u\n", ldr(), pSet, pQ, idx, weight);
+  return idx;
+}
+
+/**
+ * @see mpscfifoset.h
+ */
+uint64_t fs_wait_any(MpscFifoSet_t* pSet) {
+  while (true) {
+    uint64_t bits = pSet->pending | fs_take_ready(pSet);
+    if (bits != 0) {
+      pSet->pending = 0;
+      pSet->cur_credit = 0;
+      return bits;
+    }
+    fs_park(pSet);
+  }
+}
+
+/**
+ * @see mpscfifoset.h
+ */
+Msg_t* fs_rmv(MpscFifoSet_t* pSet, uint32_t* pIdx) {
+  // Fifos we found without messages, those with values stay pending
+  // for fs_wait_any but aren't looked at again unless set ready
+  uint64_t empty = 0;
+  while (true) {
+    uint64_t cur_bit = 1ULL << pSet->cur_idx;
+    if ((pSet->cur_credit == 0) || (((pSet->pending & ~empty) & cur_bit) == 0)) {
+      // Move on to the next ready fifo, picking up any that became
+      // ready since we last looked
+      uint64_t ready = fs_take_ready(pSet);
+      pSet->pending |= ready;
+      empty &= ~ready;
+      uint64_t bits = pSet->pending & ~empty;
+      if (bits == 0) {
+        return NULL;
+      }
+      pSet->cur_idx = fs_next(bits, pSet->cur_idx);
+      pSet->cur_credit = pSet->weights[pSet->cur_idx];
+      cur_bit = 1ULL << pSet->cur_idx;
+    }
+
+    // A producer part way through an add sets the bit again once
+    // it's done so we can move on rather than stall
+    bool busy;
+    MpscFifo_t* pQ = pSet->fifos[pSet->cur_idx];
+    Msg_t* pMsg = rmv_non_stalling(pQ, &busy);
+    if (pMsg != NULL) {
+      pSet->cur_credit -= 1;
+      *pIdx = pSet->cur_idx;
+      return pMsg;
+    }
+    if ((pQ->values.ring_buffer == NULL) || !vr_ready(&pQ->values)) {
+      pSet->pending &= ~cur_bit;
+    }
+    empty |= cur_bit;
+    pSet->cur_credit = 0;
+  }
+}
+
+/**
+ * @see mpscfifoset.h
+ */
+Msg_t* fs_rmv_wait(MpscFifoSet_t* pSet, uint32_t* pIdx) {
+  while (true) {
+    Msg_t* pMsg = fs_rmv(pSet, pIdx);
+    if (pMsg != NULL) {
+      return pMsg;
+    }
+    fs_park(pSet);
+  }
+}
+
+/**
+ * @see mpscfifoset.h
+ */
+uint32_t fs_rmv_batch_first(MpscFifoSet_t* pSet, Msg_t** msgs, uint32_t max, uint32_t* pIdx) {
+  pSet->pending |= fs_take_ready(pSet);
+  uint64_t bits = pSet->pending;
+  while (bits != 0) {
+    uint32_t idx = __builtin_ctzll(bits);
+    uint64_t bit = 1ULL << idx;
+    MpscFifo_t* pQ = pSet->fifos[idx];
+    uint32_t cnt = rmv_batch(pQ, msgs, max);
+    if (cnt != 0) {
+      *pIdx = idx;
+      return cnt;
+    }
+
+    // The ready bit was taken before we looked so a producer adding
+    // after this sets it again
+    if ((pQ->values.ring_buffer == NULL) || !vr_ready(&pQ->values)) {
+      pSet->pending &= ~bit;
+    }
+    bits &= ~bit;
+  }
+  return 0;
+}
+
+/**
+ * @see mpscfifoset.h
+ */
+void fs_wait(MpscFifoSet_t* pSet) {
+  while (true) {
+    pSet->pending |= fs_take_ready(pSet);
+    if (pSet->pending != 0) {
+      return;
+    }
+    fs_park(pSet);
+  }
+}
@@ -0,0 +1,137 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A MpscFifoSet lets one consumer wait on many MpscFifo_t's. Each
+ * registered fifo has a bit in a ready bitmap, a producer that adds
+ * to it sets the bit if it's clear and wakes the consumer if it's
+ * parked. The consumer takes the whole bitmap with one exchange, so
+ * a bit is set at most once each time the consumer takes it rather
+ * than on every add, and it only looks at the fifos whose bits were
+ * set instead of scanning them all.
+ *
+ * fs_wait_any returns the ready bits for the consumer to service as
+ * it likes. fs_rmv and fs_rmv_wait instead remove messages by
+ * weighted round robin, a fifo of weight w has up to w messages
+ * removed before moving on to the next ready fifo.
+ */
+
+#ifndef COM_SAVILLE_MPSCFIFOSET_H
+#define COM_SAVILLE_MPSCFIFOSET_H
+
+#include "mpscfifo.h"
+#include "futex.h"
+#include "msg.h"
+#include "dpf.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FS_MAX_FIFOS 64
+
+typedef struct MpscFifoSet_t {
+  // Written by producers and taken by the consumer
+  volatile _Atomic(uint64_t) ready CACHE_LINE_ALIGNED;
+
+  // Futex word, set by the consumer when it parks and cleared
+  // by the producer that wakes it
+  volatile uint32_t sleeping CACHE_LINE_ALIGNED;
+
+  // Only used by the consumer
+  uint64_t pending CACHE_LINE_ALIGNED;
+  uint32_t count;
+  uint32_t spin_count;
+  uint32_t cur_idx;
+  uint32_t cur_credit;
+  uint32_t lanes_sweep;
+  MpscFifo_t* fifos[FS_MAX_FIFOS];
+  uint32_t weights[FS_MAX_FIFOS];
+} MpscFifoSet_t;
+
+#if !MPSC_PACKED_LAYOUT
+_Static_assert(!SAME_CACHE_LINE(MpscFifoSet_t, ready, sleeping), "ready and sleeping share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFifoSet_t, ready, pending), "ready and pending share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscFifoSet_t, sleeping, pending), "sleeping and pending share a cache line");
+#endif
+
+/**
+ * Initialize the MpscFifoSet_t, the consumer polls spin_count times
+ * before it parks on a futex.
+ */
+extern MpscFifoSet_t* fs_init(MpscFifoSet_t* pSet, uint32_t spin_count);
+
+/**
+ * Deinitialize the MpscFifoSet_t, the fifos are no longer members
+ * but aren't deinitialized. The producers must be stopped first, one
+ * part way through an add may still mark the set ready.
+ */
+extern void fs_deinit(MpscFifoSet_t* pSet);
+
+/**
+ * Make pQ a member with weight, which must be at least 1. This must
+ * be called before any producer adds to pQ and pQ may be a member
+ * of only one set.
+ *
+ * @return its index, the bit in the ready bits, or -1 if the set
+ * has FS_MAX_FIFOS members.
+ */
+extern int32_t fs_register(MpscFifoSet_t* pSet, MpscFifo_t* pQ, uint32_t weight);
+
+/**
+ * Wait until a member may have a message or value and return the
+ * bit of each such fifo. The bits are cleared, so like an edge
+ * triggered poll the caller must remove from each until it's empty.
+ * This maybe used only by the consumer.
+ */
+extern uint64_t fs_wait_any(MpscFifoSet_t* pSet);
+
+/**
+ * Remove a Msg_t from the members by weighted round robin, *pIdx
+ * is set to the index of its fifo. Only messages are removed, a fifo
+ * with values stays ready so they can be removed after fs_wait_any.
+ * This maybe used only by the consumer and never stalls.
+ *
+ * @return NULL if none are ready.
+ */
+extern Msg_t* fs_rmv(MpscFifoSet_t* pSet, uint32_t* pIdx);
+
+/**
+ * Remove a Msg_t like fs_rmv waiting until one is available.
+ */
+extern Msg_t* fs_rmv_wait(MpscFifoSet_t* pSet, uint32_t* pIdx);
+
+/**
+ * Remove up to max Msg_t's from the ready member with the lowest
+ * index that has messages, *pIdx is set to its index. A member stays
+ * ready while it has messages or values, so a consumer that removes
+ * values with rmv_value sees them after fs_wait. This maybe used
+ * only by the consumer and like rmv_batch it may stall.
+ *
+ * @return number removed, 0 if no member has messages.
+ */
+extern uint32_t fs_rmv_batch_first(MpscFifoSet_t* pSet, Msg_t** msgs, uint32_t max, uint32_t* pIdx);
+
+/**
+ * Wait until a member is ready, unlike fs_wait_any the ready bits
+ * are kept. This maybe used only by the consumer.
+ */
+extern void fs_wait(MpscFifoSet_t* pSet);
+
+/**
+ * Called by a producer after it adds to a member fifo whose bit is
+ * bit. The fence orders the add before the load of ready and the
+ * fetch or orders the bit before the load of sleeping, see fs_park.
+ */
+static inline void fs_ready(MpscFifoSet_t* pSet, uint64_t bit) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if ((__atomic_load_n(&pSet->ready, __ATOMIC_RELAXED) & bit) == 0) {
+    __atomic_fetch_or(&pSet->ready, bit, __ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&pSet->sleeping, __ATOMIC_SEQ_CST) != 0) {
+      if (__atomic_exchange_n(&pSet->sleeping, 0, __ATOMIC_ACQ_REL) != 0) {
+        DPF(LDR "fs_ready: pSet=%p wake\n", ldr(), pSet);
+        futex_wake(&pSet->sleeping, 1);
+      }
+    }
+  }
+}
+
+#endif
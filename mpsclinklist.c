@@ -5,6 +5,7 @@
  * single consumer first in first out queue using a link list.
  * This algorithm is from Dimitry Vyukov's non intrusive MPSC code here:
  *   http://www.1024cores.net/home/lock-free-algorithms/queues/non-intrusive-mpsc-node-based-queue
+ * or his intrusive code if MPSC_INTRUSIVE, see mpsclinklist.h.
  */
 
 #define NDEBUG
@@ -34,10 +35,12 @@
 MpscLinkList_t* ll_init(MpscLinkList_t* pLl) {
   DPF(LDR "ll_init:+pLl=%p\n", ldr(), pLl);
 
-  pLl->cell.pNext = NULL;
-  pLl->cell.pMsg = NULL;
-  pLl->pHead = &pLl->cell;
-  pLl->pTail = &pLl->cell;
+  pLl->stub.pNext = NULL;
+#if !MPSC_INTRUSIVE
+  pLl->stub.pMsg = NULL;
+#endif
+  pLl->pHead = &pLl->stub;
+  pLl->pTail = &pLl->stub;
   pLl->count = 0;
   pLl->msgs_processed = 0;
 
@@ -56,7 +59,7 @@ uint64_t ll_deinit(MpscLinkList_t* pLl) {
   uint32_t count = pLl->count;
 #endif
 
-  Cell_t* pStub = pLl->pHead;
+  LlNode_t* pStub = pLl->pHead;
   pStub->pNext = NULL;
   pLl->pHead = NULL;
   pLl->pTail = NULL;
@@ -67,6 +70,188 @@ uint64_t ll_deinit(MpscLinkList_t* pLl) {
   return msgs_processed;
 }
 
+#if MPSC_INTRUSIVE
+
+/**
+ * Link n > 0 messages into a chain.
+ *
+ * @return the last message, the first is msgs[0].
+ */
+static inline Msg_t* ll_chain(Msg_t** msgs, uint32_t n) {
+  Msg_t* pLast = msgs[0];
+  for (uint32_t i = 1; i < n; i++) {
+    pLast->pNext = msgs[i];
+    pLast = msgs[i];
+  }
+  pLast->pNext = NULL;
+  return pLast;
+}
+
+/**
+ * Splice the chain pFirst to pLast in at the head.
+ */
+static inline void ll_push(MpscLinkList_t* pLl, Msg_t* pFirst, Msg_t* pLast) {
+  Msg_t* pPrev = __atomic_exchange_n(&pLl->pHead, pLast, __ATOMIC_ACQ_REL);
+  // rmv will stall spinning if preempted at this critical spot
+  __atomic_store_n(&pPrev->pNext, pFirst, __ATOMIC_RELEASE);
+}
+
+/**
+ * Wait for a producer to link pMsg->pNext using pBackoff, if pBackoff
+ * is NULL don't wait and set *pBusy to true.
+ *
+ * @return pNext or NULL if we didn't wait.
+ */
+static inline Msg_t* ll_wait_next(Msg_t* pMsg, Backoff_t* pBackoff, bool* pBusy) {
+  Msg_t* pNext;
+  uint32_t attempt = 0;
+  while ((pNext = __atomic_load_n(&pMsg->pNext, __ATOMIC_ACQUIRE)) == NULL) {
+    if (pBackoff == NULL) {
+      *pBusy = true;
+      return NULL;
+    }
+    backoff(pBackoff, &attempt);
+  }
+  return pNext;
+}
+
+/**
+ * Remove the message at the tail skipping the stub, if it's the last
+ * message the stub is added behind it. If pBackoff is NULL this never
+ * stalls and *pBusy is set to true if a producer is part way through
+ * an add.
+ *
+ * @return NULL if empty or busy.
+ */
+static inline Msg_t* ll_take(MpscLinkList_t* pLl, Backoff_t* pBackoff, bool* pBusy) {
+  Msg_t* pStub = &pLl->stub;
+  Msg_t* pTail = pLl->pTail;
+  Msg_t* pNext = __atomic_load_n(&pTail->pNext, __ATOMIC_ACQUIRE);
+
+  *pBusy = false;
+  if (pTail == pStub) {
+    if (pNext == NULL) {
+      if (pTail == __atomic_load_n(&pLl->pHead, __ATOMIC_ACQUIRE)) {
+        return NULL;
+      }
+      if ((pNext = ll_wait_next(pTail, pBackoff, pBusy)) == NULL) {
+        return NULL;
+      }
+    }
+    pLl->pTail = pNext;
+    pTail = pNext;
+    pNext = __atomic_load_n(&pTail->pNext, __ATOMIC_ACQUIRE);
+  }
+  if (pNext == NULL) {
+    if (pTail == __atomic_load_n(&pLl->pHead, __ATOMIC_ACQUIRE)) {
+      // pTail is the last message, the stub takes its place
+      pStub->pNext = NULL;
+      ll_push(pLl, pStub, pStub);
+    }
+    if ((pNext = ll_wait_next(pTail, pBackoff, pBusy)) == NULL) {
+      return NULL;
+    }
+  }
+  pLl->pTail = pNext;
+#if MPSC_STATS
+  pLl->count -= 1;
+#endif
+  pLl->msgs_processed += 1;
+  return pTail;
+}
+
+/**
+ * @see mpsclinklist.h
+ */
+void ll_add(MpscLinkList_t* pLl, Msg_t* pMsg) {
+  DPF(LDR "ll_add:+pLl=%p pMsg=%p\n", ldr(), pLl, pMsg);
+
+  pMsg->pNext = NULL;
+  ll_push(pLl, pMsg, pMsg);
+#if MPSC_STATS
+  pLl->count += 1;
+#endif
+
+  DPF(LDR "ll_add:-pLl=%p pMsg=%p\n", ldr(), pLl, pMsg);
+}
+
+/**
+ * @see mpsclinklist.h
+ */
+void ll_add_batch(MpscLinkList_t* pLl, Msg_t** msgs, uint32_t n) {
+  DPF(LDR "ll_add_batch:+pLl=%p n=%u\n", ldr(), pLl, n);
+  if (n == 0) {
+    return;
+  }
+
+  ll_push(pLl, msgs[0], ll_chain(msgs, n));
+#if MPSC_STATS
+  pLl->count += n;
+#endif
+
+  DPF(LDR "ll_add_batch:-pLl=%p n=%u\n", ldr(), pLl, n);
+}
+
+/**
+ * @see mpsclinklist.h
+ */
+void ll_load(MpscLinkList_t* pLl, Msg_t** msgs, uint32_t n) {
+  DPF(LDR "ll_load:+pLl=%p n=%u\n", ldr(), pLl, n);
+  if (n == 0) {
+    return;
+  }
+
+  Msg_t* pLast = ll_chain(msgs, n);
+  pLl->pHead->pNext = msgs[0];
+  pLl->pHead = pLast;
+#if MPSC_STATS
+  pLl->count += n;
+#endif
+
+  DPF(LDR "ll_load:-pLl=%p n=%u\n", ldr(), pLl, n);
+}
+
+/**
+ * @see mpsclinklist.h
+ */
+Msg_t* ll_rmv(MpscLinkList_t* pLl, Backoff_t* pBackoff) {
+  DPF(LDR "ll_rmv:+pLl=%p\n", ldr(), pLl);
+  bool busy;
+  Msg_t* pMsg = ll_take(pLl, pBackoff, &busy);
+  DPF(LDR "ll_rmv:-pLl=%p pMsg=%p\n", ldr(), pLl, pMsg);
+  return pMsg;
+}
+
+/**
+ * @see mpsclinklist.h
+ */
+Msg_t* ll_rmv_non_stalling(MpscLinkList_t* pLl, bool* pBusy) {
+  DPF(LDR "ll_rmv_non_stalling:+pLl=%p\n", ldr(), pLl);
+  Msg_t* pMsg = ll_take(pLl, NULL, pBusy);
+  DPF(LDR "ll_rmv_non_stalling:-pLl=%p pMsg=%p busy=%u\n", ldr(), pLl, pMsg, *pBusy);
+  return pMsg;
+}
+
+/**
+ * @see mpsclinklist.h
+ */
+uint32_t ll_rmv_batch(MpscLinkList_t* pLl, Msg_t** msgs, uint32_t max) {
+  DPF(LDR "ll_rmv_batch:+pLl=%p max=%u\n", ldr(), pLl, max);
+
+  bool busy;
+  uint32_t cnt;
+  for (cnt = 0; cnt < max; cnt++) {
+    if ((msgs[cnt] = ll_take(pLl, NULL, &busy)) == NULL) {
+      break;
+    }
+  }
+
+  DPF(LDR "ll_rmv_batch:-pLl=%p cnt=%u\n", ldr(), pLl, cnt);
+  return cnt;
+}
+
+#else
+
 /**
  * @see mpsclinklist.h
  */
@@ -79,18 +264,99 @@ void ll_add(MpscLinkList_t* pLl, Msg_t* pMsg) {
   Cell_t* pPrev = __atomic_exchange_n(&pLl->pHead, pCell, __ATOMIC_ACQ_REL);
   // rmv will stall spinning if preempted at this critical spot
   __atomic_store_n(&pPrev->pNext, pCell, __ATOMIC_RELEASE);
+#if MPSC_STATS
   pLl->count += 1;
+#endif
 
   DPF(LDR "ll_add:-pLl=%p pMsg=%p\n", ldr(), pLl, pMsg);
 }
 
+/**
+ * Link the cells of n > 0 messages into a chain.
+ *
+ * @return the last cell, the first is msgs[0]->pCell.
+ */
+static inline Cell_t* ll_chain(Msg_t** msgs, uint32_t n) {
+  Cell_t* pLast = msgs[0]->pCell;
+  pLast->pMsg = msgs[0];
+  for (uint32_t i = 1; i < n; i++) {
+    Cell_t* pCell = msgs[i]->pCell;
+    pCell->pMsg = msgs[i];
+    pLast->pNext = pCell;
+    pLast = pCell;
+  }
+  pLast->pNext = NULL;
+  return pLast;
+}
+
+/**
+ * @see mpsclinklist.h
+ */
+void ll_add_batch(MpscLinkList_t* pLl, Msg_t** msgs, uint32_t n) {
+  DPF(LDR "ll_add_batch:+pLl=%p n=%u\n", ldr(), pLl, n);
+  if (n == 0) {
+    return;
+  }
+
+  Cell_t* pFirst = msgs[0]->pCell;
+  Cell_t* pLast = ll_chain(msgs, n);
+
+  Cell_t* pPrev = __atomic_exchange_n(&pLl->pHead, pLast, __ATOMIC_ACQ_REL);
+  // rmv will stall spinning if preempted at this critical spot
+  __atomic_store_n(&pPrev->pNext, pFirst, __ATOMIC_RELEASE);
+#if MPSC_STATS
+  pLl->count += n;
+#endif
+
+  DPF(LDR "ll_add_batch:-pLl=%p n=%u\n", ldr(), pLl, n);
+}
+
+/**
+ * @see mpsclinklist.h
+ */
+void ll_load(MpscLinkList_t* pLl, Msg_t** msgs, uint32_t n) {
+  DPF(LDR "ll_load:+pLl=%p n=%u\n", ldr(), pLl, n);
+  if (n == 0) {
+    return;
+  }
+
+  Cell_t* pLast = ll_chain(msgs, n);
+  pLl->pHead->pNext = msgs[0]->pCell;
+  pLl->pHead = pLast;
+#if MPSC_STATS
+  pLl->count += n;
+#endif
+
+  DPF(LDR "ll_load:-pLl=%p n=%u\n", ldr(), pLl, n);
+}
+
+/**
+ * Advance pTail to pNext and return the message pNext carried,
+ * pTail's cell is given to the message.
+ */
+static inline Msg_t* ll_take(MpscLinkList_t* pLl, Cell_t* pTail, Cell_t* pNext) {
+  Msg_t* pMsg = pNext->pMsg;
+  pMsg->pCell = pTail;
+  pLl->pTail = pNext;
+  if (pMsg == NULL) {
+    printf(LDR "ll_rmv: pLl=%p WTF 1 pMsg == NULL\n", ldr(), pLl);
+    CRASH();
+    printf(LDR "ll_rmv: pLl=%pWTF 2 pMsg == NULL\n", ldr(), pLl);
+  }
+#if MPSC_STATS
+  pLl->count -= 1;
+#endif
+  pLl->msgs_processed += 1;
+  DPF(LDR "ll_rmv:-pLl=%p pMsg=%p\n", ldr(), pLl, pMsg);
+  return pMsg;
+}
+
 /**
  * @see mpsclinklist.h
  */
-Msg_t* ll_rmv(MpscLinkList_t* pLl) {
+Msg_t* ll_rmv(MpscLinkList_t* pLl, Backoff_t* pBackoff) {
   DPF(LDR "ll_rmv:+pLl=%p\n", ldr(), pLl);
 
-  Msg_t* pMsg;
   Cell_t* pTail = pLl->pTail;
   Cell_t* pNext = pTail->pNext;
   if ((pNext == NULL) && (pTail == __atomic_load_n(&pLl->pHead, __ATOMIC_ACQUIRE))) {
@@ -98,21 +364,67 @@ Msg_t* ll_rmv(MpscLinkList_t* pLl) {
     return NULL;
   } else {
     if (pNext == NULL) {
+      uint32_t attempt = 0;
       while ((pNext = __atomic_load_n(&pTail->pNext, __ATOMIC_ACQUIRE)) == NULL) {
-        sched_yield();
+        backoff(pBackoff, &attempt);
       }
     }
-    pMsg = pNext->pMsg;
-    pMsg->pCell = pTail;
-    pLl->pTail = pNext;
+    return ll_take(pLl, pTail, pNext);
+  }
+}
+
+/**
+ * @see mpsclinklist.h
+ */
+Msg_t* ll_rmv_non_stalling(MpscLinkList_t* pLl, bool* pBusy) {
+  DPF(LDR "ll_rmv_non_stalling:+pLl=%p\n", ldr(), pLl);
+
+  Cell_t* pTail = pLl->pTail;
+  Cell_t* pNext = __atomic_load_n(&pTail->pNext, __ATOMIC_ACQUIRE);
+  if (pNext == NULL) {
+    // Busy if a producer has swapped pHead but hasn't linked pNext yet
+    *pBusy = pTail != __atomic_load_n(&pLl->pHead, __ATOMIC_ACQUIRE);
+    DPF(LDR "ll_rmv_non_stalling:-pLl=%p %s\n", ldr(), pLl, *pBusy ? "BUSY" : "EMPTY");
+    return NULL;
+  }
+  *pBusy = false;
+  return ll_take(pLl, pTail, pNext);
+}
+
+/**
+ * @see mpsclinklist.h
+ */
+uint32_t ll_rmv_batch(MpscLinkList_t* pLl, Msg_t** msgs, uint32_t max) {
+  DPF(LDR "ll_rmv_batch:+pLl=%p max=%u\n", ldr(), pLl, max);
+
+  Cell_t* pTail = pLl->pTail;
+  uint32_t cnt;
+  for (cnt = 0; cnt < max; cnt++) {
+    Cell_t* pNext = __atomic_load_n(&pTail->pNext, __ATOMIC_ACQUIRE);
+    if (pNext == NULL) {
+      break;
+    }
+    Msg_t* pMsg = pNext->pMsg;
     if (pMsg == NULL) {
-      printf(LDR "ll_rmv: pLl=%p WTF 1 pMsg == NULL\n", ldr(), pLl);
+      printf(LDR "ll_rmv_batch: pLl=%p WTF 1 pMsg == NULL\n", ldr(), pLl);
       CRASH();
-      printf(LDR "ll_rmv: pLl=%pWTF 2 pMsg == NULL\n", ldr(), pLl);
+      printf(LDR "ll_rmv_batch: pLl=%pWTF 2 pMsg == NULL\n", ldr(), pLl);
     }
-    pLl->count -= 1;
-    pLl->msgs_processed += 1;
-    DPF(LDR "ll_rmv:-pLl=%p pMsg=%p\n", ldr(), pLl, pMsg);
-    return pMsg;
+    pMsg->pCell = pTail;
+    msgs[cnt] = pMsg;
+    pTail = pNext;
   }
+
+  if (cnt != 0) {
+    pLl->pTail = pTail;
+#if MPSC_STATS
+    pLl->count -= cnt;
+#endif
+    pLl->msgs_processed += cnt;
+  }
+
+  DPF(LDR "ll_rmv_batch:-pLl=%p cnt=%u\n", ldr(), pLl, cnt);
+  return cnt;
 }
+
+#endif
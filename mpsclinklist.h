@@ -5,24 +5,51 @@
  * single consumer first in first out queue using a link list.
  * This algorithm is from Dimitry Vyukov's non intrusive MPSC code here:
  *   http://www.1024cores.net/home/lock-free-algorithms/queues/non-intrusive-mpsc-node-based-queue
+ *
+ * When MPSC_INTRUSIVE is 1 his intrusive variant is used instead:
+ *   http://www.1024cores.net/home/lock-free-algorithms/queues/intrusive-mpsc-node-based-queue
+ * Messages are linked through Msg_t.pNext and the stub is a Msg_t owned
+ * by the list. When the consumer reaches the last message it adds the
+ * stub behind it so it can be removed.
  */
 
 #ifndef COM_SAVILLE_MPSC_LINK_LIST_H
 #define COM_SAVILLE_MPSC_LINK_LIST_H
 
 #include "msg.h"
+#include "backoff.h"
 
 #include <stdbool.h>
 #include <stdint.h>
 
+#if MPSC_INTRUSIVE
+typedef Msg_t LlNode_t;
+#else
+typedef Cell_t LlNode_t;
+#endif
+
 typedef struct MpscLinkList_t {
-  Cell_t* pHead __attribute__(( aligned (64) ));
-  Cell_t* pTail __attribute__(( aligned (64) ));
-  volatile _Atomic(uint32_t) count;
-  volatile _Atomic(uint64_t) msgs_processed;
-  Cell_t cell;
+  // Written by producers
+  LlNode_t* pHead CACHE_LINE_ALIGNED;
+
+  // Written by the consumer
+  LlNode_t* pTail CACHE_LINE_ALIGNED;
+  uint64_t msgs_processed;
+
+  // Written by producers and the consumer, only if MPSC_STATS
+  volatile _Atomic(uint32_t) count CACHE_LINE_ALIGNED;
+
+  // The stub, Msg_t ends with data[] so it must be last
+  LlNode_t stub CACHE_LINE_ALIGNED;
 } MpscLinkList_t;
 
+#if !MPSC_PACKED_LAYOUT
+_Static_assert(!SAME_CACHE_LINE(MpscLinkList_t, pHead, pTail), "pHead and pTail share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscLinkList_t, count, pHead), "count and pHead share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscLinkList_t, count, pTail), "count and pTail share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscLinkList_t, stub, pTail), "stub and pTail share a cache line");
+#endif
+
 
 /**
  * Initialize an MpscLinkList_t. Don't forget to empty the fifo
@@ -44,12 +71,41 @@ extern uint64_t ll_deinit(MpscLinkList_t* pLl);
  */
 extern void ll_add(MpscLinkList_t* pLl, Msg_t* pMsg);
 
+/**
+ * Add n Msg_t's to the head of the link list. The cells are linked
+ * into a chain first and then spliced in with a single exchange.
+ */
+extern void ll_add_batch(MpscLinkList_t* pLl, Msg_t** msgs, uint32_t n);
+
+/**
+ * Add n Msg_t's to the head of a link list no other thread is using
+ * yet, the chain is linked in with plain stores.
+ */
+extern void ll_load(MpscLinkList_t* pLl, Msg_t** msgs, uint32_t n);
+
 /**
  * Remove a Msg_t from the tail of the link list. This maybe used only by
  * a single thread and returns NULL if empty. This may
  * stall if a producer call add and was preempted before
- * finishing.
+ * finishing, while stalled it waits using pBackoff.
+ */
+extern Msg_t* ll_rmv(MpscLinkList_t* pLl, Backoff_t* pBackoff);
+
+/**
+ * Remove a Msg_t from the tail of the link list. This maybe used only by
+ * a single thread and never stalls. Returns NULL if empty or if a producer
+ * has swapped pHead but not yet linked pNext, in the later case *pBusy
+ * is set to true.
+ */
+extern Msg_t* ll_rmv_non_stalling(MpscLinkList_t* pLl, bool* pBusy);
+
+/**
+ * Remove up to max Msg_t's from the tail of the link list following
+ * the pNext chain as far as it is already linked. This maybe used only
+ * by a single thread and never stalls.
+ *
+ * @return number removed.
  */
-extern Msg_t* ll_rmv(MpscLinkList_t* pLl);
+extern uint32_t ll_rmv_batch(MpscLinkList_t* pLl, Msg_t** msgs, uint32_t max);
 
 #endif
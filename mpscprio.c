@@ -0,0 +1,122 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A MpscPrioFifo is a multi-producer single consumer fifo with
+ * priority levels, see mpscprio.h.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscprio.h"
+#include "mpscfifoset.h"
+#include "mpscfifo.h"
+#include "msg.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+/**
+ * @see mpscprio.h
+ */
+MpscPrioFifo_t* pq_init(MpscPrioFifo_t* pP, uint32_t level_count, uint32_t spin_count) {
+  DPF(LDR "pq_init:+pP=%p level_count=%u\n", ldr(), pP, level_count);
+  if ((level_count == 0) || (level_count > PQ_MAX_LEVELS)) {
+    printf(LDR "pq_init:-pP=%p level_count=%u invalid return NULL\n", ldr(), pP, level_count);
+    return NULL;
+  }
+  fs_init(&pP->set, spin_count);
+  pP->level_count = 0;
+  for (uint32_t i = 0; i < level_count; i++) {
+    if (initMpscFifo(&pP->levels[i]) == NULL) {
+      printf(LDR "pq_init:-pP=%p level %u initMpscFifo failed return NULL\n", ldr(), pP, i);
+      pq_deinit(pP);
+      return NULL;
+    }
+    pP->level_count += 1;
+    if (fs_register(&pP->set, &pP->levels[i], 1) < 0) {
+      printf(LDR "pq_init:-pP=%p level %u fs_register failed return NULL\n", ldr(), pP, i);
+      pq_deinit(pP);
+      return NULL;
+    }
+  }
+  DPF(LDR "pq_init:-pP=%p\n", ldr(), pP);
+  return pP;
+}
+
+/**
+ * @see mpscprio.h
+ */
+uint64_t pq_deinit(MpscPrioFifo_t* pP) {
+  DPF(LDR "pq_deinit:+pP=%p\n", ldr(), pP);
+  uint64_t msgs_processed = 0;
+  fs_deinit(&pP->set);
+  for (uint32_t i = 0; i < pP->level_count; i++) {
+    msgs_processed += deinitMpscFifo(&pP->levels[i]);
+  }
+  pP->level_count = 0;
+  DPF(LDR "pq_deinit:-pP=%p msgs_processed=%lu\n", ldr(), pP, msgs_processed);
+  return msgs_processed;
+}
+
+/**
+ * @see mpscprio.h
+ */
+Msg_t* pq_rmv(MpscPrioFifo_t* pP, uint32_t* pPrio) {
+  Msg_t* pMsg;
+  uint32_t prio;
+  if (fs_rmv_batch_first(&pP->set, &pMsg, 1, &prio) == 0) {
+    return NULL;
+  }
+  if (pPrio != NULL) {
+    *pPrio = prio;
+  }
+  return pMsg;
+}
+
+/**
+ * @see mpscprio.h
+ */
+uint32_t pq_rmv_batch(MpscPrioFifo_t* pP, Msg_t** msgs, uint32_t max) {
+  uint32_t prio;
+  return fs_rmv_batch_first(&pP->set, msgs, max, &prio);
+}
+
+/**
+ * @see mpscprio.h
+ */
+void pq_wait(MpscPrioFifo_t* pP) {
+  fs_wait(&pP->set);
+}
+
+/**
+ * @see mpscprio.h
+ */
+Msg_t* pq_rmv_wait(MpscPrioFifo_t* pP, uint32_t* pPrio, uint64_t* pArg1, uint64_t* pArg2) {
+  while (true) {
+    Msg_t* pMsg = pq_rmv(pP, pPrio);
+    if (pMsg != NULL) {
+      return pMsg;
+    }
+
+    // No level has a message so those still pending have values,
+    // remove one or fs_wait would return at once and we'd spin
+    if (pP->set.pending != 0) {
+      uint32_t prio = __builtin_ctzll(pP->set.pending);
+      if (rmv_value(&pP->levels[prio], pArg1, pArg2)) {
+        if (pPrio != NULL) {
+          *pPrio = prio;
+        }
+        return NULL;
+      }
+      pP->set.pending &= ~(1ULL << prio);
+    }
+    fs_wait(&pP->set);
+  }
+}
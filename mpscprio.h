@@ -0,0 +1,101 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A MpscPrioFifo is a multi-producer single consumer fifo with a
+ * small fixed number of priority levels, level 0 is the most urgent.
+ * Each level is its own MpscFifo_t so adding to one never contends
+ * with adding to another, and the levels are members of a
+ * MpscFifoSet_t whose ready bits are the levels in priority order.
+ * The consumer takes the lowest ready bit, so an urgent message
+ * overtakes those queued at lower levels with no lock and no scan of
+ * the empty levels. Within a level messages stay first in first out.
+ *
+ * A level may be given values or credits like any MpscFifo_t, see
+ * pq_level.
+ */
+
+#ifndef COM_SAVILLE_MPSCPRIO_H
+#define COM_SAVILLE_MPSCPRIO_H
+
+#include "mpscfifo.h"
+#include "mpscfifoset.h"
+#include "msg.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define PQ_MAX_LEVELS 4
+
+typedef struct MpscPrioFifo_t {
+  MpscFifoSet_t set;
+  uint32_t level_count;
+  MpscFifo_t levels[PQ_MAX_LEVELS];
+} MpscPrioFifo_t;
+
+/**
+ * Initialize the MpscPrioFifo_t with level_count levels, the
+ * consumer polls spin_count times before it parks on a futex.
+ *
+ * @return NULL if level_count is 0 or more than PQ_MAX_LEVELS or a
+ * level couldn't be initialized.
+ */
+extern MpscPrioFifo_t* pq_init(MpscPrioFifo_t* pP, uint32_t level_count, uint32_t spin_count);
+
+/**
+ * Deinitialize the MpscPrioFifo_t, assumes it's empty.
+ *
+ * @return number of messages and values removed.
+ */
+extern uint64_t pq_deinit(MpscPrioFifo_t* pP);
+
+/**
+ * @return the fifo of level prio, to add to it, enable values or
+ * credits on it or remove its values.
+ */
+static inline MpscFifo_t* pq_level(MpscPrioFifo_t* pP, uint32_t prio) {
+  return &pP->levels[prio];
+}
+
+/**
+ * Add a Msg_t at level prio. This maybe used by multiple entities on
+ * the same or different threads and will never block.
+ */
+static inline void pq_add(MpscPrioFifo_t* pP, uint32_t prio, Msg_t* pMsg) {
+  add(&pP->levels[prio], pMsg);
+}
+
+/**
+ * Remove a Msg_t from the most urgent level that has one. This maybe
+ * used only by a single thread.
+ *
+ * @return NULL if empty, *pPrio is set to the level if not NULL.
+ */
+extern Msg_t* pq_rmv(MpscPrioFifo_t* pP, uint32_t* pPrio);
+
+/**
+ * Remove up to max Msg_t's from the most urgent level that has any,
+ * a batch never mixes levels. This maybe used only by a single thread.
+ *
+ * @return number removed, 0 if empty.
+ */
+extern uint32_t pq_rmv_batch(MpscPrioFifo_t* pP, Msg_t** msgs, uint32_t max);
+
+/**
+ * Wait until a level has a message or value. This maybe used only
+ * by a single thread.
+ */
+extern void pq_wait(MpscPrioFifo_t* pP);
+
+/**
+ * Remove a Msg_t like pq_rmv waiting until one or a value is
+ * available. Like wait_for_input values aren't ordered with respect
+ * to messages, a value is removed from the most urgent level that
+ * has one only when no level has a message. This maybe used only by
+ * a single thread.
+ *
+ * @return NULL if a value was removed into *pArg1 and *pArg2, in
+ * either case *pPrio is set to the level if not NULL.
+ */
+extern Msg_t* pq_rmv_wait(MpscPrioFifo_t* pP, uint32_t* pPrio, uint64_t* pArg1, uint64_t* pArg2);
+
+#endif
@@ -21,6 +21,7 @@
 #include "msg.h"
 #include "mpscfifo.h"
 #include "mpscringbuff.h"
+#include "backoff.h"
 #include "crash.h"
 #include "dpf.h"
 
@@ -54,14 +55,14 @@ MpscRingBuff_t* rb_init(MpscRingBuff_t* pRb, uint32_t size) {
   }
   pRb->count = 0;
   pRb->ring_buffer = malloc(size * sizeof(pRb->ring_buffer[0]));
-  for (uint32_t i = 0; i < pRb->size; i++) {
-    pRb->ring_buffer[i].seq = i;
-    pRb->ring_buffer[i].pMsg = NULL;
-  }
   if (pRb->ring_buffer == NULL) {
     printf(LDR "rb_init:-pRb=%p size=%d could not allocate ring_buffer return NULL\n", ldr(), pRb, size);
     return NULL;
   }
+  for (uint32_t i = 0; i < pRb->size; i++) {
+    pRb->ring_buffer[i].seq = i;
+    pRb->ring_buffer[i].pMsg = NULL;
+  }
   DPF(LDR "rb_init:-pRb=%p size=%d\n", ldr(), pRb, size);
   return pRb;
 }
@@ -87,6 +88,55 @@ uint64_t rb_deinit(MpscRingBuff_t* pRb) {
   return msgs_processed;
 }
 
+/**
+ * @see mpscringbuff.h
+ */
+bool rb_resize(MpscRingBuff_t* pRb, uint32_t size) {
+  DPF(LDR "rb_resize:+pRb=%p size=%u new size=%u\n", ldr(), pRb, pRb->size, size);
+  uint32_t mask = size - 1;
+  if ((size == 0) || ((size & mask) != 0)) {
+    printf(LDR "rb_resize:-pRb=%p size=%u not power of 2\n", ldr(), pRb, size);
+    return false;
+  }
+
+  // Count the messages still in the ring, they're moved to the new one
+  uint32_t pos = pRb->rmv_idx;
+  uint32_t cnt = 0;
+  while ((cnt < pRb->size)
+      && (pRb->ring_buffer[(pos + cnt) & pRb->mask].seq == (pos + cnt + 1))) {
+    cnt += 1;
+  }
+  if (cnt > size) {
+    DPF(LDR "rb_resize:-pRb=%p cnt=%u doesn't fit in size=%u\n", ldr(), pRb, cnt, size);
+    return false;
+  }
+
+  Cell_t* ring_buffer = malloc(size * sizeof(ring_buffer[0]));
+  if (ring_buffer == NULL) {
+    printf(LDR "rb_resize:-pRb=%p size=%u could not allocate ring_buffer\n", ldr(), pRb, size);
+    return false;
+  }
+  for (uint32_t i = 0; i < size; i++) {
+    if (i < cnt) {
+      ring_buffer[i].seq = i + 1;
+      ring_buffer[i].pMsg = pRb->ring_buffer[(pos + i) & pRb->mask].pMsg;
+    } else {
+      ring_buffer[i].seq = i;
+      ring_buffer[i].pMsg = NULL;
+    }
+  }
+
+  free(pRb->ring_buffer);
+  pRb->ring_buffer = ring_buffer;
+  pRb->size = size;
+  pRb->mask = mask;
+  pRb->rmv_idx = 0;
+  __atomic_store_n(&pRb->add_idx, cnt, __ATOMIC_RELEASE);
+
+  DPF(LDR "rb_resize:-pRb=%p size=%u cnt=%u\n", ldr(), pRb, size, cnt);
+  return true;
+}
+
 /**
  * @see mpscringbuff.h
  */
@@ -94,6 +144,7 @@ bool rb_add(MpscRingBuff_t* pRb, Msg_t* pMsg) {
   DPF(LDR "rb_add:+pRb=%p pMsg=%p\n", ldr(), pRb, pMsg);
   Cell_t* cell;
   uint32_t pos = pRb->add_idx;
+  uint32_t attempt = 0;
 
   while (true) {
     cell = &pRb->ring_buffer[pos & pRb->mask];
@@ -104,6 +155,7 @@ bool rb_add(MpscRingBuff_t* pRb, Msg_t* pMsg) {
       if (__atomic_compare_exchange_n((uint32_t*)&pRb->add_idx, &pos, pos + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
         break;
       }
+      backoff_contended(&attempt);
     } else if (dif < 0) {
       DPF(LDR "rb_add:-pRb=%p FULL pMsg=%p\n", ldr(), pRb, pMsg);
       return false;
@@ -112,7 +164,9 @@ bool rb_add(MpscRingBuff_t* pRb, Msg_t* pMsg) {
     }
   }
 
+#if MPSC_STATS
   pRb->count += 1;
+#endif
   cell->pMsg = pMsg;
   __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
 
@@ -120,6 +174,81 @@ bool rb_add(MpscRingBuff_t* pRb, Msg_t* pMsg) {
   return true;
 }
 
+/**
+ * @see mpscringbuff.h
+ */
+uint32_t rb_add_batch(MpscRingBuff_t* pRb, Msg_t** msgs, uint32_t n) {
+  DPF(LDR "rb_add_batch:+pRb=%p n=%u\n", ldr(), pRb, n);
+  uint32_t pos = pRb->add_idx;
+  uint32_t cnt;
+  uint32_t attempt = 0;
+
+  while (true) {
+    Cell_t* cell = &pRb->ring_buffer[pos & pRb->mask];
+    uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    int32_t dif = seq - pos;
+
+    if (dif < 0) {
+      DPF(LDR "rb_add_batch:-pRb=%p FULL n=%u\n", ldr(), pRb, n);
+      return 0;
+    } else if (dif > 0) {
+      pos = pRb->add_idx;
+      continue;
+    }
+
+    // Count the following cells that are also free for this lap, the
+    // consumer frees cells in order so the run ends at the first busy one.
+    for (cnt = 1; cnt < n; cnt++) {
+      cell = &pRb->ring_buffer[(pos + cnt) & pRb->mask];
+      if (__atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE) != (pos + cnt)) {
+        break;
+      }
+    }
+
+    if (__atomic_compare_exchange_n((uint32_t*)&pRb->add_idx, &pos, pos + cnt, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      break;
+    }
+    backoff_contended(&attempt);
+  }
+
+#if MPSC_STATS
+  pRb->count += cnt;
+#endif
+  for (uint32_t i = 0; i < cnt; i++) {
+    Cell_t* cell = &pRb->ring_buffer[(pos + i) & pRb->mask];
+    cell->pMsg = msgs[i];
+    __atomic_store_n(&cell->seq, pos + i + 1, __ATOMIC_RELEASE);
+  }
+
+  DPF(LDR "rb_add_batch:-pRb=%p n=%u cnt=%u\n", ldr(), pRb, n, cnt);
+  return cnt;
+}
+
+/**
+ * @see mpscringbuff.h
+ */
+uint32_t rb_load(MpscRingBuff_t* pRb, Msg_t** msgs, uint32_t n) {
+  DPF(LDR "rb_load:+pRb=%p n=%u\n", ldr(), pRb, n);
+  uint32_t pos = pRb->add_idx;
+  uint32_t cnt;
+
+  for (cnt = 0; cnt < n; cnt++) {
+    Cell_t* cell = &pRb->ring_buffer[(pos + cnt) & pRb->mask];
+    if (cell->seq != (pos + cnt)) {
+      break;
+    }
+    cell->pMsg = msgs[cnt];
+    cell->seq = pos + cnt + 1;
+  }
+  pRb->add_idx = pos + cnt;
+#if MPSC_STATS
+  pRb->count += cnt;
+#endif
+
+  DPF(LDR "rb_load:-pRb=%p n=%u cnt=%u\n", ldr(), pRb, n, cnt);
+  return cnt;
+}
+
 /**
  * @see mpscringbuff.h
  */
@@ -145,7 +274,9 @@ Msg_t* rb_rmv(MpscRingBuff_t* pRb) {
   }
 
   pRb->rmv_idx += 1;
+#if MPSC_STATS
   pRb->count -= 1;
+#endif
   pRb->msgs_processed += 1;
 
   pMsg = cell->pMsg;
@@ -159,3 +290,39 @@ Msg_t* rb_rmv(MpscRingBuff_t* pRb) {
   DPF(LDR "rb_rmv:-pRb=%p pMsg=%p\n", ldr(), pRb, pMsg);
   return pMsg;
 }
+
+/**
+ * @see mpscringbuff.h
+ */
+uint32_t rb_rmv_batch(MpscRingBuff_t* pRb, Msg_t** msgs, uint32_t max) {
+  DPF(LDR "rb_rmv_batch:+pRb=%p max=%u\n", ldr(), pRb, max);
+  uint32_t pos = pRb->rmv_idx;
+  uint32_t cnt;
+
+  for (cnt = 0; cnt < max; cnt++) {
+    Cell_t* cell = &pRb->ring_buffer[(pos + cnt) & pRb->mask];
+    uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    if (seq != (pos + cnt + 1)) {
+      break;
+    }
+    Msg_t* pMsg = cell->pMsg;
+    if (pMsg == NULL) {
+      printf(LDR "rb_rmv_batch:*pRb=%p 1 WTF unexpected pMsg == NULL\n", ldr(), pRb);
+      CRASH();
+      printf(LDR "rb_rmv_batch:*pRb=%p 2 WTF unexpected pMsg == NULL\n", ldr(), pRb);
+    }
+    msgs[cnt] = pMsg;
+    __atomic_store_n(&cell->seq, pos + cnt + pRb->mask + 1, __ATOMIC_RELEASE);
+  }
+
+  if (cnt != 0) {
+    pRb->rmv_idx = pos + cnt;
+#if MPSC_STATS
+    pRb->count -= cnt;
+#endif
+    pRb->msgs_processed += cnt;
+  }
+
+  DPF(LDR "rb_rmv_batch:-pRb=%p cnt=%u\n", ldr(), pRb, cnt);
+  return cnt;
+}
@@ -20,15 +20,30 @@ typedef struct MpscRingBuff_t MpscRingBuff_t;
 typedef struct Msg_t Msg_t;
 
 typedef struct MpscRingBuff_t {
-  uint32_t volatile add_idx __attribute__(( aligned (64) ));
-  uint32_t volatile rmv_idx __attribute__(( aligned (64) ));
-  uint32_t size;
+  // Written by producers
+  uint32_t volatile add_idx CACHE_LINE_ALIGNED;
+
+  // Written by the consumer
+  uint32_t volatile rmv_idx CACHE_LINE_ALIGNED;
+  uint64_t msgs_processed;
+
+  // Read mostly
+  uint32_t size CACHE_LINE_ALIGNED;
   uint32_t mask;
   Cell_t* ring_buffer;
-  volatile _Atomic(uint32_t) count;
-  volatile _Atomic(uint64_t) msgs_processed;
+
+  // Written by producers and the consumer, only if MPSC_STATS
+  volatile _Atomic(uint32_t) count CACHE_LINE_ALIGNED;
 } MpscRingBuff_t;
 
+#if !MPSC_PACKED_LAYOUT
+_Static_assert(!SAME_CACHE_LINE(MpscRingBuff_t, add_idx, rmv_idx), "add_idx and rmv_idx share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscRingBuff_t, add_idx, mask), "add_idx and mask share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscRingBuff_t, rmv_idx, mask), "rmv_idx and mask share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscRingBuff_t, count, add_idx), "count and add_idx share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscRingBuff_t, count, rmv_idx), "count and rmv_idx share a cache line");
+#endif
+
 /**
  * Initialize the MpscRingBuff_t, size must be a power of two.
  *
@@ -43,6 +58,16 @@ extern MpscRingBuff_t* rb_init(MpscRingBuff_t* pRb, uint32_t size);
  */
 extern uint64_t rb_deinit(MpscRingBuff_t *pQ);
 
+/**
+ * Replace the ring with one of size entries, size must be a power
+ * of two. Messages still in the ring are moved to the new one. This
+ * may only be used by the consumer while no producer can be adding.
+ *
+ * @return false if size is invalid, too small or can't be allocated
+ * in which case the ring is unchanged.
+ */
+extern bool rb_resize(MpscRingBuff_t* pRb, uint32_t size);
+
 /**
  * Add a Msg_t to the ring buffer
  *
@@ -50,6 +75,22 @@ extern uint64_t rb_deinit(MpscRingBuff_t *pQ);
  */
 extern bool rb_add(MpscRingBuff_t* pRb, Msg_t* pMsg);
 
+/**
+ * Add up to n Msg_t's to the ring buffer reserving a contiguous
+ * run of cells with a single compare and exchange.
+ *
+ * @return number added, 0 if full
+ */
+extern uint32_t rb_add_batch(MpscRingBuff_t* pRb, Msg_t** msgs, uint32_t n);
+
+/**
+ * Add up to n Msg_t's to a ring buffer no other thread is using yet
+ * with plain stores.
+ *
+ * @return number added, 0 if full
+ */
+extern uint32_t rb_load(MpscRingBuff_t* pRb, Msg_t** msgs, uint32_t n);
+
 /**
  * Remove a Msg_t from the ring buffer. This maybe used only by
  * a single thread.
@@ -58,4 +99,13 @@ extern bool rb_add(MpscRingBuff_t* pRb, Msg_t* pMsg);
  */
 extern Msg_t *rb_rmv(MpscRingBuff_t *pQ);
 
+/**
+ * Remove up to max Msg_t's from the ring buffer, rmv_idx is
+ * advanced once for the whole run. This maybe used only by a
+ * single thread.
+ *
+ * @return number removed, 0 if empty.
+ */
+extern uint32_t rb_rmv_batch(MpscRingBuff_t* pRb, Msg_t** msgs, uint32_t max);
+
 #endif
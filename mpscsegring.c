@@ -0,0 +1,265 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A MpscSegRing is a thread safe multi-producer single consumer
+ * unbounded queue built from a linked list of fixed size ring
+ * segments, see mpscsegring.h.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "msg.h"
+#include "mpscsegring.h"
+#include "backoff.h"
+#include "crash.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+#include <sched.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * Get an empty segment from the spares or allocate a new one.
+ * New segments are zeroed so no slot has a valid seq.
+ */
+static SgSegment_t* sg_get_segment(MpscSegRing_t* pSg) {
+  for (uint32_t i = 0; i < SG_SPARES; i++) {
+    if (__atomic_load_n(&pSg->spares[i], __ATOMIC_RELAXED) != NULL) {
+      SgSegment_t* pSeg = __atomic_exchange_n(&pSg->spares[i], NULL, __ATOMIC_ACQUIRE);
+      if (pSeg != NULL) {
+        pSeg->pNext = NULL;
+        return pSeg;
+      }
+    }
+  }
+  SgSegment_t* pSeg = calloc(1, sizeof(SgSegment_t));
+  if (pSeg == NULL) {
+    printf(LDR "sg_get_segment:*pSg=%p could not allocate segment\n", ldr(), pSg);
+    CRASH();
+  }
+  return pSeg;
+}
+
+/**
+ * Put a segment the consumer has emptied on the spares or free it.
+ * The seq of its slots are from earlier positions so they can't
+ * match a position it will be used for again.
+ */
+static void sg_ret_segment(MpscSegRing_t* pSg, SgSegment_t* pSeg) {
+  for (uint32_t i = 0; i < SG_SPARES; i++) {
+    SgSegment_t* pNull = NULL;
+    if (__atomic_compare_exchange_n(&pSg->spares[i], &pNull, pSeg, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+      return;
+    }
+  }
+  free(pSeg);
+}
+
+/**
+ * Reserve up to n slots in the current segment with a single
+ * compare and exchange. The producer that reserves the last slot
+ * of a segment links and installs the next one before it fills its
+ * slots, so the consumer always finds pNext when it gets there.
+ *
+ * @return number of slots reserved starting at *pPos in *ppSeg.
+ */
+static uint32_t sg_reserve(MpscSegRing_t* pSg, uint32_t n, SgSegment_t** ppSeg, uint64_t* pPos) {
+  uint32_t attempt = 0;
+  while (true) {
+    uint64_t pos = __atomic_load_n(&pSg->add_idx, __ATOMIC_ACQUIRE);
+    uint32_t offset = pos % SG_LAP;
+    if (offset == SG_SEG_CAP) {
+      // Another producer is installing the next segment
+      backoff_contended(&attempt);
+      continue;
+    }
+
+    // pAddSeg is stored before add_idx enters its lap so it's at least
+    // the segment of pos, if it's newer add_idx has moved and the
+    // compare and exchange fails.
+    SgSegment_t* pSeg = __atomic_load_n(&pSg->pAddSeg, __ATOMIC_ACQUIRE);
+    uint32_t cnt = SG_SEG_CAP - offset;
+    if (cnt > n) {
+      cnt = n;
+    }
+    if (__atomic_compare_exchange_n(&pSg->add_idx, &pos, pos + cnt, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+      if ((offset + cnt) == SG_SEG_CAP) {
+        SgSegment_t* pNext = sg_get_segment(pSg);
+        __atomic_store_n(&pSeg->pNext, pNext, __ATOMIC_RELEASE);
+        __atomic_store_n(&pSg->pAddSeg, pNext, __ATOMIC_RELEASE);
+        __atomic_store_n(&pSg->add_idx, pos + cnt + 1, __ATOMIC_RELEASE);
+        DPF(LDR "sg_reserve: pSg=%p installed pNext=%p\n", ldr(), pSg, pNext);
+      }
+      *ppSeg = pSeg;
+      *pPos = pos;
+      return cnt;
+    }
+    backoff_contended(&attempt);
+  }
+}
+
+/**
+ * Remove the message at rmv_idx, moving to the next segment
+ * after the last slot.
+ *
+ * @return NULL if the slot isn't filled.
+ */
+static inline Msg_t* sg_take(MpscSegRing_t* pSg) {
+  uint64_t pos = pSg->rmv_idx;
+  SgSegment_t* pSeg = pSg->pRmvSeg;
+  uint32_t offset = pos % SG_LAP;
+  SgSlot_t* slot = &pSeg->slots[offset];
+
+  if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != (pos + 1)) {
+    return NULL;
+  }
+  Msg_t* pMsg = slot->pMsg;
+  if (pMsg == NULL) {
+    printf(LDR "sg_take:*pSg=%p 1 WTF unexpected pMsg == NULL\n", ldr(), pSg);
+    CRASH();
+    printf(LDR "sg_take:*pSg=%p 2 WTF unexpected pMsg == NULL\n", ldr(), pSg);
+  }
+
+  if ((offset + 1) == SG_SEG_CAP) {
+    pSg->pRmvSeg = __atomic_load_n(&pSeg->pNext, __ATOMIC_ACQUIRE);
+    pSg->rmv_idx = pos + 2;
+    sg_ret_segment(pSg, pSeg);
+  } else {
+    pSg->rmv_idx = pos + 1;
+  }
+  return pMsg;
+}
+
+/**
+ * @see mpscsegring.h
+ */
+MpscSegRing_t* sg_init(MpscSegRing_t* pSg) {
+  DPF(LDR "sg_init:+pSg=%p\n", ldr(), pSg);
+  for (uint32_t i = 0; i < SG_SPARES; i++) {
+    pSg->spares[i] = NULL;
+  }
+  SgSegment_t* pSeg = calloc(1, sizeof(SgSegment_t));
+  if (pSeg == NULL) {
+    printf(LDR "sg_init:-pSg=%p could not allocate segment return NULL\n", ldr(), pSg);
+    return NULL;
+  }
+  pSg->add_idx = 0;
+  pSg->pAddSeg = pSeg;
+  pSg->rmv_idx = 0;
+  pSg->pRmvSeg = pSeg;
+  pSg->msgs_processed = 0;
+  pSg->count = 0;
+  DPF(LDR "sg_init:-pSg=%p\n", ldr(), pSg);
+  return pSg;
+}
+
+/**
+ * @see mpscsegring.h
+ */
+uint64_t sg_deinit(MpscSegRing_t* pSg) {
+  DPF(LDR "sg_deinit:+pSg=%p\n", ldr(), pSg);
+  uint64_t msgs_processed = pSg->msgs_processed;
+  for (uint32_t i = 0; i < SG_SPARES; i++) {
+    free(pSg->spares[i]);
+    pSg->spares[i] = NULL;
+  }
+  free(pSg->pRmvSeg);
+  pSg->pRmvSeg = NULL;
+  pSg->pAddSeg = NULL;
+  pSg->add_idx = 0;
+  pSg->rmv_idx = 0;
+  pSg->count = 0;
+  pSg->msgs_processed = 0;
+  DPF(LDR "sg_deinit:-pSg=%p msgs_processed=%lu\n", ldr(), pSg, msgs_processed);
+  return msgs_processed;
+}
+
+/**
+ * @see mpscsegring.h
+ */
+void sg_add(MpscSegRing_t* pSg, Msg_t* pMsg) {
+  DPF(LDR "sg_add:+pSg=%p pMsg=%p\n", ldr(), pSg, pMsg);
+  SgSegment_t* pSeg;
+  uint64_t pos;
+
+  sg_reserve(pSg, 1, &pSeg, &pos);
+#if MPSC_STATS
+  pSg->count += 1;
+#endif
+  SgSlot_t* slot = &pSeg->slots[pos % SG_LAP];
+  slot->pMsg = pMsg;
+  __atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+  DPF(LDR "sg_add:-pSg=%p pMsg=%p\n", ldr(), pSg, pMsg);
+}
+
+/**
+ * @see mpscsegring.h
+ */
+void sg_add_batch(MpscSegRing_t* pSg, Msg_t** msgs, uint32_t n) {
+  DPF(LDR "sg_add_batch:+pSg=%p n=%u\n", ldr(), pSg, n);
+  while (n != 0) {
+    SgSegment_t* pSeg;
+    uint64_t pos;
+
+    uint32_t cnt = sg_reserve(pSg, n, &pSeg, &pos);
+#if MPSC_STATS
+    pSg->count += cnt;
+#endif
+    for (uint32_t i = 0; i < cnt; i++) {
+      SgSlot_t* slot = &pSeg->slots[(pos + i) % SG_LAP];
+      slot->pMsg = msgs[i];
+      __atomic_store_n(&slot->seq, pos + i + 1, __ATOMIC_RELEASE);
+    }
+    msgs += cnt;
+    n -= cnt;
+  }
+  DPF(LDR "sg_add_batch:-pSg=%p\n", ldr(), pSg);
+}
+
+/**
+ * @see mpscsegring.h
+ */
+Msg_t* sg_rmv(MpscSegRing_t* pSg) {
+  DPF(LDR "sg_rmv:+pSg=%p\n", ldr(), pSg);
+  Msg_t* pMsg = sg_take(pSg);
+  if (pMsg != NULL) {
+#if MPSC_STATS
+    pSg->count -= 1;
+#endif
+    pSg->msgs_processed += 1;
+  }
+  DPF(LDR "sg_rmv:-pSg=%p pMsg=%p\n", ldr(), pSg, pMsg);
+  return pMsg;
+}
+
+/**
+ * @see mpscsegring.h
+ */
+uint32_t sg_rmv_batch(MpscSegRing_t* pSg, Msg_t** msgs, uint32_t max) {
+  DPF(LDR "sg_rmv_batch:+pSg=%p max=%u\n", ldr(), pSg, max);
+  uint32_t cnt;
+
+  for (cnt = 0; cnt < max; cnt++) {
+    Msg_t* pMsg = sg_take(pSg);
+    if (pMsg == NULL) {
+      break;
+    }
+    msgs[cnt] = pMsg;
+  }
+#if MPSC_STATS
+  pSg->count -= cnt;
+#endif
+  pSg->msgs_processed += cnt;
+
+  DPF(LDR "sg_rmv_batch:-pSg=%p cnt=%u\n", ldr(), pSg, cnt);
+  return cnt;
+}
@@ -0,0 +1,122 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A MpscSegRing is a thread safe multi-producer single consumer
+ * unbounded queue built from a linked list of fixed size ring
+ * segments. Each slot has its own sequence number like the
+ * MpscRingBuff so consecutive messages are in consecutive slots
+ * of the same segment and the consumer only follows a pointer
+ * once per segment.
+ *
+ * The position of a slot is lap * SG_LAP + offset, the offset
+ * SG_SEG_CAP isn't a slot it marks that the producer that took
+ * the last slot is installing the next segment. Other producers
+ * wait for it to finish, it's the only time a producer waits.
+ * Segments emptied by the consumer are kept on a small free list
+ * for the producers to reuse.
+ */
+
+#ifndef COM_SAVILLE_MPSCSEGRING_H
+#define COM_SAVILLE_MPSCSEGRING_H
+
+#include "msg.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#define SG_LAP 64
+#define SG_SEG_CAP (SG_LAP - 1)
+#define SG_SPARES 4
+
+typedef struct SgSlot_t {
+  uint64_t volatile seq;
+  Msg_t* pMsg;
+} SgSlot_t;
+
+typedef struct SgSegment_t SgSegment_t;
+
+typedef struct SgSegment_t {
+  SgSegment_t* volatile pNext;
+  SgSlot_t slots[SG_SEG_CAP];
+} SgSegment_t;
+
+typedef struct MpscSegRing_t {
+  // Written by producers
+  uint64_t volatile add_idx CACHE_LINE_ALIGNED;
+  SgSegment_t* volatile pAddSeg;
+
+  // Written by the consumer
+  uint64_t rmv_idx CACHE_LINE_ALIGNED;
+  SgSegment_t* pRmvSeg;
+  uint64_t msgs_processed;
+
+  // Free segments, written by the consumer and the producer
+  // installing a segment
+  SgSegment_t* volatile spares[SG_SPARES] CACHE_LINE_ALIGNED;
+
+  // Written by producers and the consumer, only if MPSC_STATS
+  volatile _Atomic(uint32_t) count CACHE_LINE_ALIGNED;
+} MpscSegRing_t;
+
+#if !MPSC_PACKED_LAYOUT
+_Static_assert(!SAME_CACHE_LINE(MpscSegRing_t, add_idx, rmv_idx), "add_idx and rmv_idx share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscSegRing_t, add_idx, spares), "add_idx and spares share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscSegRing_t, rmv_idx, spares), "rmv_idx and spares share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscSegRing_t, count, add_idx), "count and add_idx share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscSegRing_t, count, rmv_idx), "count and rmv_idx share a cache line");
+#endif
+
+/**
+ * Initialize the MpscSegRing_t with one empty segment.
+ *
+ * @return NULL if the segment can't be allocated.
+ */
+extern MpscSegRing_t* sg_init(MpscSegRing_t* pSg);
+
+/**
+ * Deinitialize the MpscSegRing_t freeing its segments, assumes
+ * it's empty.
+ *
+ * @return number of messages removed.
+ */
+extern uint64_t sg_deinit(MpscSegRing_t* pSg);
+
+/**
+ * Add a Msg_t, this maybe used by multiple entities on the same
+ * or different threads. It never fails as a new segment is
+ * installed when the current one is full.
+ */
+extern void sg_add(MpscSegRing_t* pSg, Msg_t* pMsg);
+
+/**
+ * Add n Msg_t's in order, the slots remaining in the current
+ * segment are reserved with a single compare and exchange.
+ */
+extern void sg_add_batch(MpscSegRing_t* pSg, Msg_t** msgs, uint32_t n);
+
+/**
+ * Remove a Msg_t. This maybe used only by a single thread.
+ *
+ * @return NULL if empty or the next slot has been reserved by
+ * a producer but not yet filled, see sg_busy.
+ */
+extern Msg_t* sg_rmv(MpscSegRing_t* pSg);
+
+/**
+ * Remove up to max Msg_t's into msgs. This maybe used only by
+ * a single thread.
+ *
+ * @return number removed, 0 if empty.
+ */
+extern uint32_t sg_rmv_batch(MpscSegRing_t* pSg, Msg_t** msgs, uint32_t max);
+
+/**
+ * Called by the consumer after sg_rmv returned NULL.
+ *
+ * @return true if a producer has reserved a slot and not yet filled it.
+ */
+static inline bool sg_busy(MpscSegRing_t* pSg) {
+  return __atomic_load_n(&pSg->add_idx, __ATOMIC_ACQUIRE) != pSg->rmv_idx;
+}
+
+#endif
@@ -0,0 +1,148 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A MpscValueRing is a thread safe multi-producer single consumer
+ * bounded ring buffer of values, see mpscvaluering.h.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "mpscvaluering.h"
+#include "backoff.h"
+#include "crash.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @see mpscvaluering.h
+ */
+MpscValueRing_t* vr_init(MpscValueRing_t* pVr, uint32_t size) {
+  DPF(LDR "vr_init:+pVr=%p size=%u\n", ldr(), pVr, size);
+  if ((size == 0) || ((size & (size - 1)) != 0)) {
+    printf(LDR "vr_init:-pVr=%p size=%u not power of 2 return NULL\n", ldr(), pVr, size);
+    return NULL;
+  }
+  pVr->ring_buffer = aligned_alloc(CACHE_LINE_SIZE,
+      (size * sizeof(VrCell_t) + CACHE_LINE_SIZE - 1) & ~((size_t)CACHE_LINE_SIZE - 1));
+  if (pVr->ring_buffer == NULL) {
+    printf(LDR "vr_init:-pVr=%p size=%u could not allocate ring_buffer return NULL\n", ldr(), pVr, size);
+    return NULL;
+  }
+  for (uint32_t i = 0; i < size; i++) {
+    pVr->ring_buffer[i].seq = i;
+  }
+  pVr->add_idx = 0;
+  pVr->rmv_idx = 0;
+  pVr->values_processed = 0;
+  pVr->size = size;
+  pVr->mask = size - 1;
+  pVr->count = 0;
+  DPF(LDR "vr_init:-pVr=%p size=%u\n", ldr(), pVr, size);
+  return pVr;
+}
+
+/**
+ * @see mpscvaluering.h
+ */
+uint64_t vr_deinit(MpscValueRing_t* pVr) {
+  DPF(LDR "vr_deinit:+pVr=%p\n", ldr(), pVr);
+  uint64_t values_processed = pVr->values_processed;
+  free(pVr->ring_buffer);
+  pVr->ring_buffer = NULL;
+  pVr->add_idx = 0;
+  pVr->rmv_idx = 0;
+  pVr->size = 0;
+  pVr->mask = 0;
+  pVr->count = 0;
+  pVr->values_processed = 0;
+  DPF(LDR "vr_deinit:-pVr=%p values_processed=%lu\n", ldr(), pVr, values_processed);
+  return values_processed;
+}
+
+/**
+ * @see mpscvaluering.h
+ */
+bool vr_add(MpscValueRing_t* pVr, uint64_t arg1, uint64_t arg2) {
+  DPF(LDR "vr_add:+pVr=%p arg1=%lu arg2=%lu\n", ldr(), pVr, arg1, arg2);
+  VrCell_t* cell;
+  uint32_t pos = pVr->add_idx;
+  uint32_t attempt = 0;
+
+  while (true) {
+    cell = &pVr->ring_buffer[pos & pVr->mask];
+    uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+    int32_t dif = seq - pos;
+
+    if (dif == 0) {
+      if (__atomic_compare_exchange_n((uint32_t*)&pVr->add_idx, &pos, pos + 1, true, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        break;
+      }
+      backoff_contended(&attempt);
+    } else if (dif < 0) {
+      DPF(LDR "vr_add:-pVr=%p FULL\n", ldr(), pVr);
+      return false;
+    } else {
+      pos = pVr->add_idx;
+    }
+  }
+
+#if MPSC_STATS
+  pVr->count += 1;
+#endif
+  cell->arg1 = arg1;
+  cell->arg2 = arg2;
+  __atomic_store_n(&cell->seq, pos + 1, __ATOMIC_RELEASE);
+
+  DPF(LDR "vr_add:-pVr=%p\n", ldr(), pVr);
+  return true;
+}
+
+/**
+ * @see mpscvaluering.h
+ */
+bool vr_rmv(MpscValueRing_t* pVr, uint64_t* pArg1, uint64_t* pArg2) {
+  uint32_t pos = pVr->rmv_idx;
+  VrCell_t* cell = &pVr->ring_buffer[pos & pVr->mask];
+  uint32_t seq = __atomic_load_n(&cell->seq, __ATOMIC_ACQUIRE);
+  int32_t dif = seq - (pos + 1);
+
+  if (dif < 0) {
+    DPF(LDR "vr_rmv: pVr=%p EMPTY\n", ldr(), pVr);
+    return false;
+  }
+  if (dif > 0) {
+    printf(LDR "vr_rmv:*pVr=%p 1 WTF dif > 0\n", ldr(), pVr);
+    CRASH();
+    printf(LDR "vr_rmv:*pVr=%p 2 WTF dif > 0\n", ldr(), pVr);
+  }
+
+  *pArg1 = cell->arg1;
+  *pArg2 = cell->arg2;
+  __atomic_store_n(&cell->seq, pos + pVr->mask + 1, __ATOMIC_RELEASE);
+  pVr->rmv_idx = pos + 1;
+#if MPSC_STATS
+  pVr->count -= 1;
+#endif
+  pVr->values_processed += 1;
+
+  DPF(LDR "vr_rmv: pVr=%p arg1=%lu arg2=%lu\n", ldr(), pVr, *pArg1, *pArg2);
+  return true;
+}
+
+/**
+ * @see mpscvaluering.h
+ */
+bool vr_ready(MpscValueRing_t* pVr) {
+  uint32_t pos = pVr->rmv_idx;
+  return __atomic_load_n(&pVr->ring_buffer[pos & pVr->mask].seq, __ATOMIC_ACQUIRE) == (pos + 1);
+}
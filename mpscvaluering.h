@@ -0,0 +1,90 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A MpscValueRing is a thread safe multi-producer single consumer
+ * bounded ring buffer whose cells hold two 64 bit values rather than
+ * a Msg_t pointer, so small control messages need no pool, no
+ * message and no pointer to follow. Producers claim cells with a
+ * compare and exchange as MpscRingBuff does.
+ */
+
+#ifndef COM_SAVILLE_MPSCVALUERING_H
+#define COM_SAVILLE_MPSCVALUERING_H
+
+#include "config.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Two cells per cache line so a cell never straddles one.
+ */
+typedef struct VrCell_t {
+  uint32_t seq;
+  uint64_t arg1;
+  uint64_t arg2;
+} __attribute__(( aligned (32) )) VrCell_t;
+
+typedef struct MpscValueRing_t {
+  // Written by producers
+  uint32_t volatile add_idx CACHE_LINE_ALIGNED;
+
+  // Written by the consumer
+  uint32_t volatile rmv_idx CACHE_LINE_ALIGNED;
+  uint64_t values_processed;
+
+  // Read mostly
+  uint32_t size CACHE_LINE_ALIGNED;
+  uint32_t mask;
+  VrCell_t* ring_buffer;
+
+  // Written by producers and the consumer, only if MPSC_STATS
+  volatile _Atomic(uint32_t) count CACHE_LINE_ALIGNED;
+} MpscValueRing_t;
+
+#if !MPSC_PACKED_LAYOUT
+_Static_assert(!SAME_CACHE_LINE(MpscValueRing_t, add_idx, rmv_idx), "add_idx and rmv_idx share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscValueRing_t, add_idx, mask), "add_idx and mask share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscValueRing_t, rmv_idx, mask), "rmv_idx and mask share a cache line");
+_Static_assert(!SAME_CACHE_LINE(MpscValueRing_t, count, rmv_idx), "count and rmv_idx share a cache line");
+#endif
+
+/**
+ * Initialize the MpscValueRing_t, size must be a power of two.
+ *
+ * @return NULL if size cannot be malloced or is not a power of 2.
+ */
+extern MpscValueRing_t* vr_init(MpscValueRing_t* pVr, uint32_t size);
+
+/**
+ * Deinitialize the MpscValueRing_t, any values still in it are dropped.
+ *
+ * @return number of values removed.
+ */
+extern uint64_t vr_deinit(MpscValueRing_t* pVr);
+
+/**
+ * Add arg1 and arg2, this maybe used by multiple entities on the
+ * same or different threads.
+ *
+ * @return true if added return false if full
+ */
+extern bool vr_add(MpscValueRing_t* pVr, uint64_t arg1, uint64_t arg2);
+
+/**
+ * Remove the oldest values into *pArg1 and *pArg2. This maybe used
+ * only by a single thread.
+ *
+ * @return false if empty or the next cell has been claimed but not
+ * yet filled.
+ */
+extern bool vr_rmv(MpscValueRing_t* pVr, uint64_t* pArg1, uint64_t* pArg2);
+
+/**
+ * This maybe used only by the consumer.
+ *
+ * @return true if vr_rmv would remove values.
+ */
+extern bool vr_ready(MpscValueRing_t* pVr);
+
+#endif
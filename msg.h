@@ -5,6 +5,8 @@
 #ifndef _MSG_H
 #define _MSG_H
 
+#include "config.h"
+
 #include <stdint.h>
 
 // Forward declarations
@@ -13,6 +15,17 @@ typedef struct MpscFifo_t MpscFifo_t;
 typedef struct Msg_t Msg_t;
 typedef struct MsgPool_t MsgPool_t;
 
+#if MPSC_COMPACT_CELLS
+typedef struct Cell_t {
+  union {
+    Cell_t* pNext;
+    uint32_t seq;
+  };
+  Msg_t* pMsg;
+} Cell_t;
+
+_Static_assert(sizeof(Cell_t) == 16, "Expect a compact Cell_t to be 16 bytes");
+#else
 typedef struct Cell_t {
   union {
     Cell_t* pNext __attribute__ (( aligned (64) ));
@@ -20,15 +33,35 @@ typedef struct Cell_t {
   };
   Msg_t* pMsg;
 } Cell_t;
+#endif
 
 typedef struct Msg_t {
+#if MPSC_INTRUSIVE
+  // Messages are linked through pNext, pCell isn't used
+  union {
+    Cell_t* pCell;
+    Msg_t* pNext;
+  };
+#else
   Cell_t* pCell;
+#endif
   //MpscFifo_t* pPoolFifo;
   MsgPool_t* pPool;
   MpscFifo_t* pRspQ;
   uint64_t arg1;
   uint64_t arg2;
 
+  // A multicast handle's parent, which holds a reference per handle
+  // in refs, see multicast
+  Msg_t* pParent;
+  volatile _Atomic(uint32_t) refs;
+
+  // Correlation id of a request and its response, see rpc.h
+  uint64_t id;
+
+  // The fifo whose credit this message holds, see try_add
+  MpscFifo_t* pCreditQ;
+
 #if 0
   MpscFifo_t* last_pRspQ;
   uint64_t last_arg1;
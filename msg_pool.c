@@ -8,6 +8,7 @@
 
 #include "mpscfifo.h"
 #include "msg_pool.h"
+#include "crash.h"
 #include "dpf.h"
 
 #include <sys/types.h>
@@ -18,162 +19,484 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 
-bool MsgPool_init(MsgPool_t* pool, uint32_t msg_count) {
-  bool error;
-  Msg_t* msgs = NULL;
-  Msg_t** msg_ptrs = NULL;
-  Msg_t** owned_msgs = NULL;
-  Cell_t* cells = NULL;
-
-  DPF(LDR "MsgPool_init:+pool=%p msg_count=%u\n",
-      ldr(), pool, msg_count);
-
-  // Allocate messages
-  msgs = malloc(sizeof(Msg_t) * msg_count);
-  if (msgs == NULL) {
-    printf(LDR "MsgPool_init:-pool=%p ERROR unable to allocate messages, aborting msg_count=%u\n",
-        ldr(), pool, msg_count);
-    error = true;
-    goto done;
+/**
+ * @see msg_pool.h
+ */
+const uint32_t msg_pool_class_sizes[MSG_POOL_CLASSES] = { 64, 256, 1024, 4096 };
+
+/**
+ * Messages this thread is returning to a pool it doesn't own.
+ */
+typedef struct RetBuf_t {
+  MsgPool_t* pool;
+  uint32_t count;
+  Msg_t* msgs[MSG_POOL_RET_BATCH];
+} RetBuf_t;
+
+static _Thread_local RetBuf_t ret_bufs[MSG_POOL_RET_POOLS];
+static _Thread_local uint32_t ret_buf_evict_idx;
+static _Thread_local bool ret_bufs_registered;
+
+static pthread_once_t ret_bufs_once = PTHREAD_ONCE_INIT;
+static pthread_key_t ret_bufs_key;
+
+// The initialized pools, a thread may exit after a pool it
+// buffered returns for was deinitialized
+static pthread_mutex_t live_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+static MsgPool_t* live_pools;
+
+static void live_pools_add(MsgPool_t* pool) {
+  pthread_mutex_lock(&live_pools_lock);
+  pool->pLiveNext = live_pools;
+  live_pools = pool;
+  pthread_mutex_unlock(&live_pools_lock);
+}
+
+static void live_pools_remove(MsgPool_t* pool) {
+  pthread_mutex_lock(&live_pools_lock);
+  MsgPool_t** ppCur = &live_pools;
+  while (*ppCur != NULL) {
+    if (*ppCur == pool) {
+      *ppCur = pool->pLiveNext;
+      break;
+    }
+    ppCur = &(*ppCur)->pLiveNext;
   }
+  pool->pLiveNext = NULL;
+  pthread_mutex_unlock(&live_pools_lock);
+}
 
-  // Allocate message pointers
-  msg_ptrs = calloc(sizeof(Msg_t*), msg_count);
-  if (msg_ptrs == NULL) {
-    printf(LDR "MsgPool_init:-pool=%p ERROR unable to allocate message pointers, aborting msg_count=%u\n",
-        ldr(), pool, msg_count);
-    error = true;
-    goto done;
+/**
+ * @return true if pool is initialized, live_pools_lock must be held.
+ */
+static bool live_pools_has(MsgPool_t* pool) {
+  for (MsgPool_t* pCur = live_pools; pCur != NULL; pCur = pCur->pLiveNext) {
+    if (pCur == pool) {
+      return true;
+    }
   }
+  return false;
+}
 
-  // Allocate owned message pointers
-  owned_msgs = malloc(sizeof(Msg_t*) * msg_count);
-  if (msg_ptrs == NULL) {
-    printf(LDR "MsgPool_init:-pool=%p ERROR unable to allocate owned messages, aborting msg_count=%u\n",
-        ldr(), pool, msg_count);
-    error = true;
-    goto done;
+/**
+ * Return the buffered messages with one add_batch and free the buffer.
+ */
+static void ret_buf_flush(RetBuf_t* pBuf) {
+  if (pBuf->count != 0) {
+    DPF(LDR "ret_buf_flush: pool=%p count=%u\n", ldr(), pBuf->pool, pBuf->count);
+    add_batch(&pBuf->pool->fifo, pBuf->msgs, pBuf->count);
+    pBuf->count = 0;
   }
+  pBuf->pool = NULL;
+}
 
-  // Allocate cells
-  cells = malloc(sizeof(Cell_t) * msg_count);
-  if (cells == NULL) {
-    printf(LDR "MsgPool_init:-pool=%p ERROR unable to allocate cells, aborting msg_count=%u\n",
-        ldr(), pool, msg_count);
-    error = true;
-    goto done;
+static void ret_bufs_thread_exit(void* p) {
+  (void)p;
+
+  // Hold the lock so a pool can't be deinitialized while we return to it
+  pthread_mutex_lock(&live_pools_lock);
+  for (uint32_t i = 0; i < MSG_POOL_RET_POOLS; i++) {
+    RetBuf_t* pBuf = &ret_bufs[i];
+    if ((pBuf->count != 0) && !live_pools_has(pBuf->pool)) {
+      printf(LDR "ret_bufs_thread_exit: ERROR pool=%p was deinitialized, dropping %u msgs\n",
+          ldr(), pBuf->pool, pBuf->count);
+      pBuf->count = 0;
+    }
+    ret_buf_flush(pBuf);
   }
+  pthread_mutex_unlock(&live_pools_lock);
+}
 
-  // Output info on the pool and messages
-  DPF(LDR "MsgPool_init: pool=%p &msgs[0]=%p &msgs[1]=%p sizeof(Msg_t)=%lu(0x%lx)\n",
-      ldr(), pool, &msgs[0], &msgs[1], sizeof(Msg_t), sizeof(Msg_t));
+static void ret_bufs_init(void) {
+  pthread_key_create(&ret_bufs_key, ret_bufs_thread_exit);
+}
 
-  // Create pool
-  initMpscFifo(&pool->fifo);
-  for (uint32_t i = 0; i < msg_count; i++) {
-    Msg_t* msg = &msgs[i];
-    msg->pCell = &cells[i];
-    DPF(LDR "MsgPool_init: add %u msg=%p%s\n", ldr(), i, msg, i == 0 ? " stub" : "");
-    //msg->pPoolFifo = &pool->fifo;
+/**
+ * Get this thread's buffer for pool, if all are in use the
+ * buffers are evicted round robin.
+ */
+static RetBuf_t* ret_buf_get(MsgPool_t* pool) {
+  RetBuf_t* pBuf = NULL;
+  for (uint32_t i = 0; i < MSG_POOL_RET_POOLS; i++) {
+    if (ret_bufs[i].pool == pool) {
+      return &ret_bufs[i];
+    }
+    if ((pBuf == NULL) && (ret_bufs[i].pool == NULL)) {
+      pBuf = &ret_bufs[i];
+    }
+  }
+  if (!ret_bufs_registered) {
+    // So the buffers are flushed when the thread exits and before it
+    // parks, as the owners may be waiting for them
+    pthread_once(&ret_bufs_once, ret_bufs_init);
+    pthread_setspecific(ret_bufs_key, ret_bufs);
+    ret_bufs_registered = true;
+    park_hook = MsgPool_flush;
+  }
+  if (pBuf == NULL) {
+    pBuf = &ret_bufs[ret_buf_evict_idx++ % MSG_POOL_RET_POOLS];
+    ret_buf_flush(pBuf);
+  }
+  pBuf->pool = pool;
+  return pBuf;
+}
+
+/**
+ * Flush this thread's buffer for pool if it has one.
+ */
+static void ret_buf_flush_pool(MsgPool_t* pool) {
+  for (uint32_t i = 0; i < MSG_POOL_RET_POOLS; i++) {
+    if (ret_bufs[i].pool == pool) {
+      ret_buf_flush(&ret_bufs[i]);
+    }
+  }
+}
+
+bool MsgPool_init(MsgPool_t* pool, uint32_t msg_count) {
+  return MsgPool_init_sized(pool, msg_count, 0);
+}
+
+/**
+ * Get count cells for a new slab, those of trimmed slabs are used
+ * first as cells may be in use on other fifos and are never freed.
+ *
+ * @return false if they can't be allocated.
+ */
+static bool slab_cells(MsgPool_t* pool, Cell_t** cells, uint32_t count) {
+#if MPSC_INTRUSIVE
+  // Messages are linked directly and don't need cells
+  for (uint32_t i = 0; i < count; i++) {
+    cells[i] = NULL;
+  }
+  return true;
+#else
+  uint32_t i;
+  for (i = 0; (i < count) && (pool->spare_cells != NULL); i++) {
+    cells[i] = pool->spare_cells;
+    pool->spare_cells = cells[i]->pNext;
+  }
+  if (i == count) {
+    return true;
+  }
+  // aligned_alloc requires the size to be a multiple of the alignment
+  size_t size = sizeof(Cell_t) * (count - i);
+  size = (size + CACHE_LINE_SIZE - 1) & ~((size_t)CACHE_LINE_SIZE - 1);
+  Cell_t* new_cells = aligned_alloc(CACHE_LINE_SIZE, size);
+  if (new_cells == NULL) {
+    // Put back the spares we took
+    while (i-- > 0) {
+      cells[i]->pNext = pool->spare_cells;
+      pool->spare_cells = cells[i];
+    }
+    return false;
+  }
+  for (uint32_t j = 0; i < count; i++, j++) {
+    cells[i] = &new_cells[j];
+  }
+  return true;
+#endif
+}
+
+/**
+ * Add a slab of up to slab_msgs messages without exceeding max_msgs,
+ * the new messages are put in the magazine and the rest added to the
+ * fifo. Only used by the owner, or by init before there is one in
+ * which case loading is true and they're loaded with no atomics.
+ *
+ * @return number of messages added, 0 if at max_msgs or out of memory.
+ */
+static uint32_t slab_grow(MsgPool_t* pool, bool loading) {
+  uint32_t count = pool->max_msgs - pool->msg_count;
+  if (count > pool->slab_msgs) {
+    count = pool->slab_msgs;
+  }
+  if (count == 0) {
+    return 0;
+  }
+
+  MsgSlab_t* pSlab = malloc(sizeof(MsgSlab_t));
+  uint8_t* msgs = malloc((size_t)pool->msg_stride * count);
+  Cell_t** cells = malloc(sizeof(Cell_t*) * count);
+  if ((pSlab == NULL) || (msgs == NULL) || (cells == NULL) || !slab_cells(pool, cells, count)) {
+    printf(LDR "slab_grow: pool=%p ERROR unable to allocate slab count=%u msg_count=%u\n",
+        ldr(), pool, count, pool->msg_count);
+    free(pSlab);
+    free(msgs);
+    free(cells);
+    return 0;
+  }
+  DPF(LDR "slab_grow: pool=%p msgs=%p count=%u msg_count=%u\n", ldr(), pool, msgs, count, pool->msg_count);
+
+  Msg_t** new_msgs = (Msg_t**)cells;
+  for (uint32_t i = 0; i < count; i++) {
+    Msg_t* msg = (Msg_t*)(msgs + ((size_t)pool->msg_stride * i));
+    msg->pCell = cells[i];
     msg->pPool = pool;
-    owned_msgs[i] = msg;
-    add(&pool->fifo, msg);
+    msg->pParent = NULL;
+    // Reuse the array for the messages
+    new_msgs[i] = msg;
+  }
+
+  pSlab->msgs = msgs;
+  pSlab->count = count;
+  pSlab->pNext = pool->slabs;
+  pool->slabs = pSlab;
+  pool->msg_count += count;
+
+  uint32_t mag_free = MSG_POOL_MAG_SIZE - pool->mag_count;
+  uint32_t to_mag = (count < mag_free) ? count : mag_free;
+  for (uint32_t i = 0; i < to_mag; i++) {
+    pool->mag[pool->mag_count++] = new_msgs[i];
+  }
+  if (count > to_mag) {
+    if (loading) {
+      load_batch(&pool->fifo, &new_msgs[to_mag], count - to_mag);
+    } else {
+      add_batch(&pool->fifo, &new_msgs[to_mag], count - to_mag);
+    }
   }
+  free(cells);
+  return count;
+}
+
+bool MsgPool_init_sized(MsgPool_t* pool, uint32_t msg_count, uint32_t data_size) {
+  return MsgPool_init_slabs(pool, msg_count, data_size, MSG_POOL_SLAB_MSGS);
+}
+
+bool MsgPool_init_slabs(MsgPool_t* pool, uint32_t msg_count, uint32_t data_size,
+    uint32_t slab_msgs) {
+  // Each message is followed by its data, keep them aligned
+  const size_t align = _Alignof(Msg_t);
+  const uint32_t msg_stride = (sizeof(Msg_t) + data_size + align - 1) & ~(align - 1);
 
+  DPF(LDR "MsgPool_init:+pool=%p msg_count=%u data_size=%u msg_stride=%u slab_msgs=%u\n",
+      ldr(), pool, msg_count, data_size, msg_stride, slab_msgs);
+
+  pool->slabs = NULL;
+  pool->spare_cells = NULL;
+  pool->max_msgs = msg_count;
+  pool->msg_count = 0;
+  pool->slab_msgs = (slab_msgs != 0) ? slab_msgs : MSG_POOL_SLAB_MSGS;
+  pool->data_size = data_size;
+  pool->msg_stride = msg_stride;
   pool->get_msg_count = 0;
   pool->ret_msg_count = 0;
+  pool->mag_count = 0;
+  pool->owner = pthread_self();
+  pool->pLiveNext = NULL;
 
-  DPF(LDR "MsgPool_init: pool=%p, sizeof(*pool)=%lu(0x%lx)\n",
-      ldr(), pool, sizeof(*pool), sizeof(*pool));
-
-  error = false;
-done:
+  // Create pool with its first slab, with room in the ring for all
+  // of it so loading it doesn't start the fifo in link list mode
+  uint32_t first_slab = (msg_count < pool->slab_msgs) ? msg_count : pool->slab_msgs;
+  uint32_t capacity = 0x100;
+  while (capacity < first_slab) {
+    capacity <<= 1;
+  }
+  if (initMpscFifoCapacity(&pool->fifo, capacity) == NULL) {
+    printf(LDR "MsgPool_init:-pool=%p ERROR unable to init fifo, aborting\n", ldr(), pool);
+    return true;
+  }
+  bool error = (msg_count == 0) || (slab_grow(pool, true) == 0);
   if (error) {
-    free(msgs);
-    pool->msgs = NULL;
-    free(cells);
-    pool->cells = NULL;
-    free(msg_ptrs);
-    pool->msg_ptrs = NULL;
-    free(owned_msgs);
-    pool->owned_msgs = NULL;
-    pool->msg_count = 0;
+    printf(LDR "MsgPool_init:-pool=%p ERROR unable to allocate messages, aborting msg_count=%u\n",
+        ldr(), pool, msg_count);
+    deinitMpscFifo(&pool->fifo);
   } else {
-    pool->msgs = msgs;
-    pool->cells = cells;
-    pool->msg_ptrs = msg_ptrs;
-    pool->owned_msgs = owned_msgs;
-    pool->msg_count = msg_count;
+    live_pools_add(pool);
   }
 
-  DPF(LDR "MsgPool_init:-pool=%p msg_count=%u error=%u\n",
-      ldr(), pool, msg_count, error);
-
+  DPF(LDR "MsgPool_init:-pool=%p, sizeof(*pool)=%lu(0x%lx) error=%u\n",
+      ldr(), pool, sizeof(*pool), sizeof(*pool), error);
   return error;
 }
 
 uint64_t MsgPool_deinit(MsgPool_t* pool) {
-  DPF(LDR "MsgPool_deinit:+pool=%p msgs=%p fifo=%p\n", ldr(), pool, pool->msgs, &pool->fifo);
+  DPF(LDR "MsgPool_deinit:+pool=%p slabs=%p fifo=%p\n", ldr(), pool, pool->slabs, &pool->fifo);
   uint64_t msgs_processed = 0;
-#if 0
-  msgs_processed += pool->fifo.msgs_processed;
-  msgs_processed += pool->fifo.rb.msgs_processed;
-#else
-  if (pool->msgs != NULL) {
-    // Empty the pool
+  if (pool->slabs != NULL) {
+    // Empty the pool, starting with the magazine and any we're holding
     DPF(LDR "MsgPool_deinit: pool=%p pool->msg_count=%u get_msg_count=%u ret_msg_count=%u\n",
         ldr(), pool, pool->msg_count, pool->get_msg_count, pool->ret_msg_count);
-    for (uint32_t i = 0; i < pool->msg_count; i++) {
-      Msg_t* msg;
-
-      // Wait until this is returned
-      // TODO: Bug it may never be returned!
-      bool once = false;
-      while ((msg = rmv(&pool->fifo)) == NULL) {
-        if (!once) {
-          once = true;
-          DPF(LDR "MsgPool_deinit: waiting for %u\n", ldr(), i);
-        }
-        sched_yield();
+    ret_buf_flush_pool(pool);
+    for (uint32_t i = pool->mag_count; i < pool->msg_count; i++) {
+      // Wait until this is returned, if it never is it was leaked
+      Msg_t* msg = rmv_timed_wait(&pool->fifo, MSG_POOL_DEINIT_TIMEOUT_NS);
+      if (msg == NULL) {
+        printf(LDR "MsgPool_deinit: ERROR pool=%p msg %u of %u was never returned\n",
+            ldr(), pool, i, pool->msg_count);
+        CRASH();
       }
-
-      pool->msg_ptrs[i] = msg;
       DPF(LDR "MsgPool_deinit: removed %u msg=%p\n", ldr(), i, msg);
     }
+    live_pools_remove(pool);
 
     DPF(LDR "MsgPool_deinit: pool=%p deinitMpscFifo pool->msg_count=%u get_msg_count=%u ret_msg_count=%u\n",
         ldr(), pool, pool->msg_count, pool->get_msg_count, pool->ret_msg_count);
     msgs_processed = deinitMpscFifo(&pool->fifo);
 
-    // Free msgs
-    DPF(LDR "MsgPool_deinit: pool=%p free msgs=%p\n", ldr(), pool, pool->msgs);
-    free(pool->msgs);
-    pool->msgs = NULL;
-
-    // BUG: we can't free cells because the cells could be in use on other fifos.
-    DPF(LDR "MsgPool_deinit: pool=%p CANNOT cells msgs=%p\n", ldr(), pool, pool->msgs);
-    //free(pool->cells);
-    //pool->cells = NULL;
+    // Free the slabs
+    // BUG: unless MPSC_INTRUSIVE we can't free cells because the cells
+    // could be in use on other fifos.
+    while (pool->slabs != NULL) {
+      MsgSlab_t* pSlab = pool->slabs;
+      DPF(LDR "MsgPool_deinit: pool=%p free slab msgs=%p\n", ldr(), pool, pSlab->msgs);
+      pool->slabs = pSlab->pNext;
+      free(pSlab->msgs);
+      free(pSlab);
+    }
+    pool->spare_cells = NULL;
     pool->msg_count = 0;
+    pool->mag_count = 0;
   }
   DPF(LDR "MsgPool_deinit:-pool=%p msgs_processed=%lu pool->msg_count=%u get_msg_count=%u ret_msg_count=%u\n",
         ldr(), pool, msgs_processed, pool->msg_count, pool->get_msg_count, pool->ret_msg_count);
-#endif
   return msgs_processed;
 }
 
-Msg_t* MsgPool_get_msg(MsgPool_t* pool) {
-  DPF(LDR "MsgPool_get_msg:+pool=%p\n", ldr(), pool);
-  Msg_t* msg = rmv(&pool->fifo);
-  if (msg != NULL) {
-    msg->pRspQ = NULL;
-    msg->arg1 = 0;
-    msg->arg2 = 0;
+static int cmp_ptrs(const void* a, const void* b) {
+  uintptr_t pa = (uintptr_t)*(void* const*)a;
+  uintptr_t pb = (uintptr_t)*(void* const*)b;
+  return (pa > pb) - (pa < pb);
+}
+
+uint32_t MsgPool_trim(MsgPool_t* pool) {
+  DPF(LDR "MsgPool_trim:+pool=%p msg_count=%u\n", ldr(), pool, pool->msg_count);
+  Msg_t** free_msgs = malloc(sizeof(Msg_t*) * pool->msg_count);
+  if (free_msgs == NULL) {
+    return 0;
+  }
+
+  // Gather the free messages and sort them so each slab's are together
+  uint32_t free_count = pool->mag_count;
+  for (uint32_t i = 0; i < free_count; i++) {
+    free_msgs[i] = pool->mag[i];
+  }
+  pool->mag_count = 0;
+  uint32_t cnt;
+  while ((cnt = rmv_batch(&pool->fifo, &free_msgs[free_count], pool->msg_count - free_count)) != 0) {
+    free_count += cnt;
+  }
+  qsort(free_msgs, free_count, sizeof(free_msgs[0]), cmp_ptrs);
+
+  // Free the slabs whose messages are all free, keeping one
+  uint32_t slabs_freed = 0;
+  MsgSlab_t** ppSlab = &pool->slabs;
+  while (*ppSlab != NULL) {
+    MsgSlab_t* pSlab = *ppSlab;
+    uint8_t* first = pSlab->msgs;
+    uint8_t* end = first + ((size_t)pool->msg_stride * pSlab->count);
+
+    // Binary search for the first free message in the slab
+    uint32_t lo = 0;
+    uint32_t hi = free_count;
+    while (lo < hi) {
+      uint32_t mid = lo + ((hi - lo) / 2);
+      if ((uint8_t*)free_msgs[mid] < first) {
+        lo = mid + 1;
+      } else {
+        hi = mid;
+      }
+    }
+    bool all_free = ((lo + pSlab->count) <= free_count)
+        && ((uint8_t*)free_msgs[lo] == first)
+        && ((uint8_t*)free_msgs[lo + pSlab->count - 1] < end);
+    if (!all_free || (pool->msg_count == pSlab->count)) {
+      ppSlab = &pSlab->pNext;
+      continue;
+    }
+
+    // Keep their cells for the next slab and remove them from free_msgs
+#if !MPSC_INTRUSIVE
+    for (uint32_t i = lo; i < lo + pSlab->count; i++) {
+      Cell_t* pCell = free_msgs[i]->pCell;
+      pCell->pNext = pool->spare_cells;
+      pool->spare_cells = pCell;
+    }
+#endif
+    memmove(&free_msgs[lo], &free_msgs[lo + pSlab->count],
+        sizeof(free_msgs[0]) * (free_count - lo - pSlab->count));
+    free_count -= pSlab->count;
+    pool->msg_count -= pSlab->count;
+    DPF(LDR "MsgPool_trim: pool=%p free slab msgs=%p count=%u\n", ldr(), pool, pSlab->msgs, pSlab->count);
+
+    *ppSlab = pSlab->pNext;
+    free(pSlab->msgs);
+    free(pSlab);
+    slabs_freed += 1;
+  }
+
+  // Put back the rest
+  uint32_t to_mag = (free_count < MSG_POOL_MAG_SIZE) ? free_count : MSG_POOL_MAG_SIZE;
+  for (uint32_t i = 0; i < to_mag; i++) {
+    pool->mag[pool->mag_count++] = free_msgs[i];
+  }
+  if (free_count > to_mag) {
+    add_batch(&pool->fifo, &free_msgs[to_mag], free_count - to_mag);
+  }
+  free(free_msgs);
+
+  DPF(LDR "MsgPool_trim:-pool=%p msg_count=%u slabs_freed=%u\n", ldr(), pool, pool->msg_count, slabs_freed);
+  return slabs_freed;
+}
+
+/**
+ * @return true if this thread owns the pool.
+ */
+static inline bool is_owner(MsgPool_t* pool) {
+  return pthread_equal(__atomic_load_n(&pool->owner, __ATOMIC_ACQUIRE), pthread_self());
+}
+
+/**
+ * Refill an empty magazine from the fifo, or if it's empty too a
+ * new slab. This maybe used only by the owner.
+ *
+ * @return false if the pool is out of messages.
+ */
+static inline bool mag_refill(MsgPool_t* pool) {
+  if (pool->mag_count == 0) {
+    pool->mag_count = rmv_batch(&pool->fifo, pool->mag, MSG_POOL_MAG_SIZE / 2);
+    if (pool->mag_count == 0) {
+      slab_grow(pool, false);
+    }
+  }
+  return pool->mag_count != 0;
+}
+
+/**
+ * Clear the fields of a message being got.
+ */
+static inline void msg_reset(Msg_t* msg) {
+  msg->pRspQ = NULL;
+  msg->arg1 = 0;
+  msg->arg2 = 0;
+  msg->pParent = NULL;
+  msg->id = 0;
+  msg->pCreditQ = NULL;
 #ifndef NDEBUG
-    msg->last_MsgPool_get_msg_pthread_id = pthread_self();
-    msg->last_MsgPool_get_msg_tick = gTick++;
+  msg->last_MsgPool_get_msg_pthread_id = pthread_self();
+  msg->last_MsgPool_get_msg_tick = gTick++;
 #endif
+}
+
+void MsgPool_set_owner(MsgPool_t* pool) {
+  DPF(LDR "MsgPool_set_owner: pool=%p\n", ldr(), pool);
+  __atomic_store_n(&pool->owner, pthread_self(), __ATOMIC_RELEASE);
+}
+
+Msg_t* MsgPool_get_msg(MsgPool_t* pool) {
+  DPF(LDR "MsgPool_get_msg:+pool=%p\n", ldr(), pool);
+  Msg_t* msg = NULL;
+  if (!is_owner(pool)) {
+    // Not the owner, the magazine isn't ours
+    msg = rmv(&pool->fifo);
+    if (msg != NULL) {
+      msg_reset(msg);
+    }
+  } else if (mag_refill(pool)) {
+    msg = pool->mag[--pool->mag_count];
+    msg_reset(msg);
     pool->get_msg_count += 1;
     DPF(LDR "MsgPool_get_msg: pool=%p got msg=%p pool=%p get_msg_count=%d\n", ldr(), pool, msg, msg->pPool, pool->get_msg_count);
   }
@@ -181,6 +504,33 @@ Msg_t* MsgPool_get_msg(MsgPool_t* pool) {
   return msg;
 }
 
+uint32_t MsgPool_get_msgs(MsgPool_t* pool, Msg_t** msgs, uint32_t n) {
+  DPF(LDR "MsgPool_get_msgs:+pool=%p n=%u\n", ldr(), pool, n);
+  uint32_t cnt = 0;
+  if (!is_owner(pool)) {
+    // Not the owner, the magazine isn't ours
+    cnt = rmv_batch(&pool->fifo, msgs, n);
+    for (uint32_t i = 0; i < cnt; i++) {
+      msg_reset(msgs[i]);
+    }
+    DPF(LDR "MsgPool_get_msgs:-pool=%p n=%u cnt=%u not owner\n", ldr(), pool, n, cnt);
+    return cnt;
+  }
+  while ((cnt < n) && mag_refill(pool)) {
+    uint32_t run = ((n - cnt) < pool->mag_count) ? (n - cnt) : pool->mag_count;
+    pool->mag_count -= run;
+    for (uint32_t i = 0; i < run; i++) {
+      Msg_t* msg = pool->mag[pool->mag_count + i];
+      msg_reset(msg);
+      msgs[cnt + i] = msg;
+    }
+    cnt += run;
+  }
+  pool->get_msg_count += cnt;
+  DPF(LDR "MsgPool_get_msgs:-pool=%p n=%u cnt=%u\n", ldr(), pool, n, cnt);
+  return cnt;
+}
+
 void MsgPool_ret_msg(MsgPool_t* pool, Msg_t* pMsg) {
   DPF(LDR "MsgPool_ret_msg:+pool=%p msg=%p\n", ldr(), pool, pMsg);
   if (pMsg != NULL) {
@@ -188,10 +538,67 @@ void MsgPool_ret_msg(MsgPool_t* pool, Msg_t* pMsg) {
     pMsg->last_MsgPool_ret_msg_pthread_id = pthread_self();
     pMsg->last_MsgPool_ret_msg_tick = gTick++;
 #endif
-    add(&pool->fifo, pMsg);
+    if (is_owner(pool)) {
+      // The owner, if the magazine is full return half of it
+      if (pool->mag_count == MSG_POOL_MAG_SIZE) {
+        add_batch(&pool->fifo, &pool->mag[MSG_POOL_MAG_SIZE / 2], MSG_POOL_MAG_SIZE / 2);
+        pool->mag_count = MSG_POOL_MAG_SIZE / 2;
+      }
+      pool->mag[pool->mag_count++] = pMsg;
+    } else {
+      RetBuf_t* pBuf = ret_buf_get(pool);
+      pBuf->msgs[pBuf->count++] = pMsg;
+      if (pBuf->count == MSG_POOL_RET_BATCH) {
+        ret_buf_flush(pBuf);
+      }
+    }
+#if MPSC_STATS
     pool->ret_msg_count += 1;
+#endif
     DPF(LDR "MsgPool_ret_msg: pool=%p got msg=%p pool=%p ret_msg_count=%d\n", ldr(), pool, pMsg, pMsg->pPool, pool->ret_msg_count);
   }
   DPF(LDR "MsgPool_ret_msg:-pool=%p msg=%p\n", ldr(), pool, pMsg);
 }
 
+
+void MsgPool_flush(void) {
+  for (uint32_t i = 0; i < MSG_POOL_RET_POOLS; i++) {
+    if (ret_bufs[i].pool != NULL) {
+      ret_buf_flush(&ret_bufs[i]);
+    }
+  }
+}
+
+bool MsgPools_init(MsgPools_t* pools, uint32_t msg_count) {
+  for (uint32_t i = 0; i < MSG_POOL_CLASSES; i++) {
+    if (MsgPool_init_sized(&pools->pools[i], msg_count, msg_pool_class_sizes[i])) {
+      printf(LDR "MsgPools_init:-pools=%p ERROR unable to init class %u\n", ldr(), pools, i);
+      while (i-- > 0) {
+        MsgPool_deinit(&pools->pools[i]);
+      }
+      return true;
+    }
+  }
+  return false;
+}
+
+uint64_t MsgPools_deinit(MsgPools_t* pools) {
+  uint64_t msgs_processed = 0;
+  for (uint32_t i = 0; i < MSG_POOL_CLASSES; i++) {
+    msgs_processed += MsgPool_deinit(&pools->pools[i]);
+  }
+  return msgs_processed;
+}
+
+Msg_t* MsgPool_get_msg_sized(MsgPools_t* pools, uint32_t size) {
+  DPF(LDR "MsgPool_get_msg_sized:+pools=%p size=%u\n", ldr(), pools, size);
+  Msg_t* msg = NULL;
+  for (uint32_t i = 0; (i < MSG_POOL_CLASSES) && (msg == NULL); i++) {
+    if (size <= msg_pool_class_sizes[i]) {
+      // If this class is empty try the next larger one
+      msg = MsgPool_get_msg(&pools->pools[i]);
+    }
+  }
+  DPF(LDR "MsgPool_get_msg_sized:-pools=%p size=%u msg=%p\n", ldr(), pools, size, msg);
+  return msg;
+}
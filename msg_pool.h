@@ -7,24 +7,170 @@
 
 #include "mpscfifo.h"
 
+#include <pthread.h>
+
 #include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
+/**
+ * The thread that initializes a pool owns it, until another takes it
+ * with MsgPool_set_owner, and keeps up to MSG_POOL_MAG_SIZE free
+ * messages in a magazine. Its gets and returns pop and push the
+ * magazine, which is refilled or emptied half at a time with
+ * rmv_batch and add_batch on the fifo and only the owner grows the
+ * pool. Other threads get directly from the fifo, as it has a single
+ * consumer only one thread may get from a pool at a time.
+ */
+#define MSG_POOL_MAG_SIZE 64
+
+/**
+ * Other threads buffer returns for up to MSG_POOL_RET_POOLS pools
+ * and return MSG_POOL_RET_BATCH at a time with add_batch, see
+ * MsgPool_flush.
+ */
+#define MSG_POOL_RET_BATCH 32
+#define MSG_POOL_RET_POOLS 4
+
+/**
+ * MsgPool_deinit waits for every message to be returned, if none
+ * is returned for this long it's a leak and it crashes rather than
+ * wait forever.
+ */
+#define MSG_POOL_DEINIT_TIMEOUT_NS (10ULL * 1000000000ULL)
+
+/**
+ * The data sizes of the pools in a MsgPools_t, smallest first.
+ */
+#define MSG_POOL_CLASSES 4
+extern const uint32_t msg_pool_class_sizes[MSG_POOL_CLASSES];
+
+/**
+ * Pools start with a slab of MSG_POOL_SLAB_MSGS messages and the
+ * owner adds another each time it runs out, up to the msg_count
+ * the pool was initialized with.
+ */
+#define MSG_POOL_SLAB_MSGS 0x400
+
+typedef struct MsgSlab_t MsgSlab_t;
+
+typedef struct MsgSlab_t {
+  MsgSlab_t* pNext;
+  uint8_t* msgs;
+  uint32_t count;
+} MsgSlab_t;
+
 typedef struct MsgPool_t {
-  Msg_t* msgs;
-  Msg_t** msg_ptrs;
-  Msg_t** owned_msgs;
-  Cell_t* cells;
-  uint32_t msg_count;
-  volatile _Atomic(uint32_t) get_msg_count;
+  uint32_t max_msgs;
+  uint32_t slab_msgs;
+  uint32_t data_size;
+  uint32_t msg_stride;
   volatile _Atomic(uint32_t) ret_msg_count;
+
+  // The thread that uses the magazine, see MsgPool_set_owner
+  pthread_t owner;
+
+  // Next initialized pool, see ret_bufs_thread_exit
+  struct MsgPool_t* pLiveNext;
+
+  // Written only by the owner
+  uint32_t get_msg_count CACHE_LINE_ALIGNED;
+  uint32_t mag_count;
+  Msg_t* mag[MSG_POOL_MAG_SIZE];
+
+  // Slabs allocated so far, only changed by the owner
+  MsgSlab_t* slabs;
+  Cell_t* spare_cells;
+  uint32_t msg_count;
+
   MpscFifo_t fifo;
 } MsgPool_t;
 
+/**
+ * A pool for each of the msg_pool_class_sizes, see MsgPool_get_msg_sized.
+ */
+typedef struct MsgPools_t {
+  MsgPool_t pools[MSG_POOL_CLASSES];
+} MsgPools_t;
+
 bool MsgPool_init(MsgPool_t* pool, uint32_t msg_count);
 uint64_t MsgPool_deinit(MsgPool_t* pool);
 Msg_t* MsgPool_get_msg(MsgPool_t* pool);
 void MsgPool_ret_msg(MsgPool_t* pool, Msg_t* pMsg);
 
+/**
+ * Make this thread the owner of the pool, the previous owner must
+ * no longer be using it and its stores must be visible to us, e.g.
+ * it called this before pthread_create or we were signaled by it.
+ * The magazine comes with the pool.
+ */
+void MsgPool_set_owner(MsgPool_t* pool);
+
+/**
+ * Get up to n messages taking them from the magazine a run at a time.
+ *
+ * @return number got, less than n if the pool ran out.
+ */
+uint32_t MsgPool_get_msgs(MsgPool_t* pool, Msg_t** msgs, uint32_t n);
+
+/**
+ * Initialize a pool whose messages have data_size bytes of data
+ * inline after the Msg_t, MsgPool_init has none.
+ *
+ * @return true if an error.
+ */
+bool MsgPool_init_sized(MsgPool_t* pool, uint32_t msg_count, uint32_t data_size);
+
+/**
+ * Initialize a pool which grows by slab_msgs messages at a time up
+ * to msg_count, MsgPool_init_sized uses MSG_POOL_SLAB_MSGS.
+ *
+ * @return true if an error.
+ */
+bool MsgPool_init_slabs(MsgPool_t* pool, uint32_t msg_count, uint32_t data_size,
+    uint32_t slab_msgs);
+
+/**
+ * Free the slabs, other than the last one, whose messages are all
+ * in the pool so memory tracks the messages in use. Messages held
+ * by other threads or not yet flushed keep their slab. This maybe
+ * used only by the owner.
+ *
+ * @return number of slabs freed.
+ */
+uint32_t MsgPool_trim(MsgPool_t* pool);
+
+/**
+ * Initialize a pool of msg_count messages for each size class.
+ *
+ * @return true if an error.
+ */
+bool MsgPools_init(MsgPools_t* pools, uint32_t msg_count);
+uint64_t MsgPools_deinit(MsgPools_t* pools);
+
+/**
+ * Get a message with at least size bytes of data from the smallest
+ * class that has one, the messages are returned with ret_msg as usual.
+ *
+ * @return NULL if size is larger than the largest class or none are free.
+ */
+Msg_t* MsgPool_get_msg_sized(MsgPools_t* pools, uint32_t size);
+
+/**
+ * The number of bytes of data in a message from a pool.
+ */
+static inline uint32_t MsgPool_data_size(Msg_t* pMsg) {
+  return pMsg->pPool->data_size;
+}
+
+/**
+ * Return the messages this thread has buffered for other threads'
+ * pools so the owners aren't starved. It's this thread's park_hook
+ * once it buffers a return, so rmv_wait, rmv_timed_wait,
+ * wait_for_input and the fifo set waits call it before they park, a
+ * thread that waits some other way must call it, and when the thread
+ * exits its buffers are returned to the pools still initialized.
+ */
+void MsgPool_flush(void);
+
 #endif
@@ -0,0 +1,187 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Quiescence detection for producers, see quiesce.h.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "quiesce.h"
+#include "backoff.h"
+#include "crash.h"
+#include "dpf.h"
+
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <pthread.h>
+#include <unistd.h>
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+_Thread_local QsRecord_t* qs_tls_rec = NULL;
+
+volatile bool qs_producer_fence = false;
+
+static QsRecord_t* volatile qs_head = NULL;
+static pthread_mutex_t qs_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t qs_once = PTHREAD_ONCE_INIT;
+static pthread_key_t qs_key;
+
+/**
+ * When a registered thread exits its record may be reused, its
+ * epoch is even as it isn't part way through an operation.
+ */
+static void qs_thread_exit(void* p) {
+  QsRecord_t* pRec = p;
+  __atomic_store_n(&pRec->pObj, NULL, __ATOMIC_RELAXED);
+  __atomic_store_n(&pRec->in_use, false, __ATOMIC_RELEASE);
+}
+
+/**
+ * Register for expedited membarrier, if we can't producers fence.
+ */
+static void qs_init(void) {
+  if (syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0, 0) != 0) {
+    DPF(LDR "qs_init: membarrier not available, producers will fence\n", ldr());
+    qs_producer_fence = true;
+  }
+  if (pthread_key_create(&qs_key, qs_thread_exit) != 0) {
+    printf(LDR "qs_init:*could not create key\n", ldr());
+    CRASH();
+  }
+}
+
+/**
+ * @see quiesce.h
+ */
+void qs_setup(void) {
+  pthread_once(&qs_once, qs_init);
+}
+
+/**
+ * @see quiesce.h
+ */
+void qs_barrier(void) {
+  pthread_once(&qs_once, qs_init);
+  if (qs_producer_fence) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  } else if (syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0) != 0) {
+    printf(LDR "qs_barrier:*membarrier failed\n", ldr());
+    CRASH();
+  }
+}
+
+/**
+ * @see quiesce.h
+ */
+QsRecord_t* qs_register(void) {
+  pthread_once(&qs_once, qs_init);
+
+  pthread_mutex_lock(&qs_lock);
+  QsRecord_t* pRec;
+  for (pRec = qs_head; pRec != NULL; pRec = pRec->pNext) {
+    if (!pRec->in_use) {
+      break;
+    }
+  }
+  if (pRec == NULL) {
+    pRec = aligned_alloc(CACHE_LINE_SIZE, sizeof(QsRecord_t));
+    if (pRec == NULL) {
+      printf(LDR "qs_register:*could not allocate record\n", ldr());
+      CRASH();
+    }
+    pRec->epoch = 0;
+    pRec->pObj = NULL;
+    pRec->in_use = true;
+    pRec->pNext = qs_head;
+    __atomic_store_n(&qs_head, pRec, __ATOMIC_RELEASE);
+  } else {
+    pRec->in_use = true;
+  }
+  pthread_mutex_unlock(&qs_lock);
+
+  pthread_setspecific(qs_key, pRec);
+  qs_tls_rec = pRec;
+  DPF(LDR "qs_register: pRec=%p\n", ldr(), pRec);
+  return pRec;
+}
+
+/**
+ * @see quiesce.h
+ */
+void qs_snapshot_init(QsSnapshot_t* pSnap) {
+  pSnap->taken = false;
+  pSnap->overflow = false;
+  pSnap->count = 0;
+}
+
+/**
+ * Issue the barrier and record the producers part way through an
+ * operation on pObj, if there are more than QS_SNAPSHOT_MAX note
+ * that we must look again once those recorded have finished.
+ */
+static void qs_snapshot_take(QsSnapshot_t* pSnap, const void* pObj) {
+  qs_barrier();
+
+  pSnap->count = 0;
+  pSnap->overflow = false;
+  QsRecord_t* pRec = __atomic_load_n(&qs_head, __ATOMIC_ACQUIRE);
+  for (; pRec != NULL; pRec = __atomic_load_n(&pRec->pNext, __ATOMIC_ACQUIRE)) {
+    uint64_t epoch = __atomic_load_n(&pRec->epoch, __ATOMIC_ACQUIRE);
+    if (((epoch & 1) == 0) || (__atomic_load_n(&pRec->pObj, __ATOMIC_RELAXED) != pObj)) {
+      continue;
+    }
+    if (pSnap->count == QS_SNAPSHOT_MAX) {
+      pSnap->overflow = true;
+      break;
+    }
+    pSnap->recs[pSnap->count] = pRec;
+    pSnap->epochs[pSnap->count] = epoch;
+    pSnap->count += 1;
+  }
+  pSnap->taken = true;
+}
+
+/**
+ * @see quiesce.h
+ */
+bool qs_quiescent(QsSnapshot_t* pSnap, const void* pObj, bool stall, Backoff_t* pBackoff) {
+  pthread_once(&qs_once, qs_init);
+  if (!pSnap->taken) {
+    qs_snapshot_take(pSnap, pObj);
+  }
+
+  while (true) {
+    // Only wait for the recorded operations to finish, a later one
+    // will have seen the consumer's new state
+    for (uint32_t i = 0; i < pSnap->count; ) {
+      QsRecord_t* pRec = pSnap->recs[i];
+      uint32_t attempt = 0;
+      while (stall && (__atomic_load_n(&pRec->epoch, __ATOMIC_ACQUIRE) == pSnap->epochs[i])) {
+        backoff(pBackoff, &attempt);
+      }
+      if (__atomic_load_n(&pRec->epoch, __ATOMIC_ACQUIRE) != pSnap->epochs[i]) {
+        pSnap->count -= 1;
+        pSnap->recs[i] = pSnap->recs[pSnap->count];
+        pSnap->epochs[i] = pSnap->epochs[pSnap->count];
+      } else {
+        i += 1;
+      }
+    }
+    if (pSnap->count != 0) {
+      DPF(LDR "qs_quiescent: pObj=%p count=%u busy\n", ldr(), pObj, pSnap->count);
+      return false;
+    }
+    if (!pSnap->overflow) {
+      break;
+    }
+    qs_snapshot_take(pSnap, pObj);
+  }
+  pSnap->taken = false;
+  return true;
+}
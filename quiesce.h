@@ -0,0 +1,146 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Quiescence detection for producers, so a consumer can tell that
+ * no producer is part way through an operation on an object without
+ * producers sharing a counter.
+ *
+ * Each producer thread has its own QsRecord_t in a global registry.
+ * qs_enter stores the object and makes its epoch odd, qs_exit makes
+ * it even again, both are plain stores to a cache line only that
+ * thread writes. The consumer changes its state and then calls
+ * qs_quiescent which issues a process wide memory barrier with
+ * membarrier and scans the registry. The barrier pairs with the
+ * compiler barrier in qs_enter, so either the consumer sees the
+ * producer active or the producer sees the consumer's new state.
+ * If membarrier isn't available producers use a full fence instead.
+ *
+ * The producers found active are kept in a QsSnapshot_t, until they
+ * have all finished later calls only check whether their epochs
+ * changed, with no barrier, as any operation started after the
+ * barrier sees the new state.
+ */
+
+#ifndef COM_SAVILLE_QUIESCE_H
+#define COM_SAVILLE_QUIESCE_H
+
+#include "config.h"
+#include "backoff.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct QsRecord_t QsRecord_t;
+
+typedef struct QsRecord_t {
+  // Written only by the owning thread
+  volatile _Atomic(uint64_t) epoch CACHE_LINE_ALIGNED;
+  const void* volatile pObj;
+
+  // Written when registering and when the owner exits
+  QsRecord_t* volatile pNext CACHE_LINE_ALIGNED;
+  volatile uint32_t in_use;
+} QsRecord_t;
+
+#if !MPSC_PACKED_LAYOUT
+_Static_assert(!SAME_CACHE_LINE(QsRecord_t, epoch, pNext), "epoch and pNext share a cache line");
+#endif
+
+/** The most producers a QsSnapshot_t records */
+#define QS_SNAPSHOT_MAX 16
+
+/**
+ * The producers a consumer found part way through an operation on an
+ * object after it changed its state. Only used by the consumer.
+ */
+typedef struct QsSnapshot_t {
+  bool taken;
+  bool overflow;
+  uint32_t count;
+  QsRecord_t* recs[QS_SNAPSHOT_MAX];
+  uint64_t epochs[QS_SNAPSHOT_MAX];
+} QsSnapshot_t;
+
+/** This thread's record, NULL until its first qs_enter */
+extern _Thread_local QsRecord_t* qs_tls_rec;
+
+/** True if membarrier isn't available and producers must fence */
+extern volatile bool qs_producer_fence;
+
+/**
+ * Register this thread, records of exited threads are reused.
+ */
+extern QsRecord_t* qs_register(void);
+
+/**
+ * Find out whether membarrier is available, qs_register and
+ * qs_barrier do this so only needed before using qs_order alone.
+ */
+extern void qs_setup(void);
+
+/**
+ * Make the stores every thread made before its last qs_order
+ * visible to the caller, or the caller's earlier stores visible
+ * to that thread's loads after it.
+ */
+extern void qs_barrier(void);
+
+/**
+ * Order this thread's earlier stores before its later loads with
+ * respect to qs_barrier, just a compiler barrier unless membarrier
+ * isn't available.
+ */
+static inline void qs_order(void) {
+  if (qs_producer_fence) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  } else {
+    __atomic_signal_fence(__ATOMIC_SEQ_CST);
+  }
+}
+
+/**
+ * Mark this thread as part way through an operation on pObj,
+ * this must be done before it reads the state the consumer changes.
+ *
+ * @return the record to pass to qs_exit.
+ */
+static inline QsRecord_t* qs_enter(const void* pObj) {
+  QsRecord_t* pRec = qs_tls_rec;
+  if (pRec == NULL) {
+    pRec = qs_register();
+  }
+  __atomic_store_n(&pRec->pObj, pObj, __ATOMIC_RELAXED);
+  __atomic_store_n(&pRec->epoch, pRec->epoch + 1, __ATOMIC_RELEASE);
+  qs_order();
+  return pRec;
+}
+
+/**
+ * Mark the operation started by qs_enter as finished, its stores
+ * are visible to a consumer that sees the epoch change.
+ */
+static inline void qs_exit(QsRecord_t* pRec) {
+  __atomic_store_n(&pRec->epoch, pRec->epoch + 1, __ATOMIC_RELEASE);
+}
+
+/**
+ * Initialize a snapshot, it's empty until qs_quiescent takes it.
+ */
+extern void qs_snapshot_init(QsSnapshot_t* pSnap);
+
+/**
+ * Called by the consumer after changing the state producers read,
+ * checks whether any producer is part way through an operation on
+ * pObj which may have read the old state. If stall is true wait,
+ * using pBackoff, for each one found to finish.
+ *
+ * The first call after a change issues the barrier and records the
+ * producers it finds in pSnap, calls that return false leave them
+ * there and the following calls only check those. pSnap is emptied
+ * when this returns true, so use one snapshot per state change.
+ *
+ * @return true if none are, always true if stall is true.
+ */
+extern bool qs_quiescent(QsSnapshot_t* pSnap, const void* pObj, bool stall, Backoff_t* pBackoff);
+
+#endif
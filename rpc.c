@@ -0,0 +1,165 @@
+/**
+ * This software is released into the public domain.
+ *
+ * Pipelined requests and responses with correlation ids, see rpc.h.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "rpc.h"
+#include "mpscfifo.h"
+#include "msg_pool.h"
+#include "msg.h"
+#include "dpf.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// Number of responses removed at a time by rpc_poll
+#define RPC_BATCH 32
+
+/**
+ * Complete the request pRsp is the response to and return it.
+ * The slot is freed before done is called so done may send
+ * another request.
+ *
+ * @return false if its id wasn't outstanding.
+ */
+static bool rpc_complete(RpcTable_t* pT, Msg_t* pRsp) {
+  RpcSlot_t* slot = &pT->slots[pRsp->id & pT->mask];
+  if ((pRsp->id == 0) || (slot->id != pRsp->id)) {
+    DPF(LDR "rpc_complete: pT=%p pRsp=%p id=%lu unmatched\n", ldr(), pT, pRsp, pRsp->id);
+    pT->unmatched += 1;
+    ret_msg(pRsp);
+    return false;
+  }
+  RpcDone_t done = slot->done;
+  void* ctx = slot->ctx;
+  slot->id = 0;
+  pT->outstanding -= 1;
+  pT->completed += 1;
+  DPF(LDR "rpc_complete: pT=%p pRsp=%p id=%lu arg1=%lu\n", ldr(), pT, pRsp, pRsp->id, pRsp->arg1);
+  if (done != NULL) {
+    done(ctx, pRsp);
+  }
+  ret_msg(pRsp);
+  return true;
+}
+
+/**
+ * @see rpc.h
+ */
+RpcTable_t* rpc_init(RpcTable_t* pT, MpscFifo_t* pRspQ, uint32_t size) {
+  DPF(LDR "rpc_init:+pT=%p pRspQ=%p size=%u\n", ldr(), pT, pRspQ, size);
+  if ((size == 0) || ((size & (size - 1)) != 0)) {
+    printf(LDR "rpc_init:-pT=%p size=%u not power of 2 return NULL\n", ldr(), pT, size);
+    return NULL;
+  }
+  pT->slots = calloc(size, sizeof(pT->slots[0]));
+  if (pT->slots == NULL) {
+    printf(LDR "rpc_init:-pT=%p size=%u could not allocate slots return NULL\n", ldr(), pT, size);
+    return NULL;
+  }
+  pT->pRspQ = pRspQ;
+  pT->size = size;
+  pT->mask = size - 1;
+  pT->outstanding = 0;
+  pT->next_id = 1;
+  pT->completed = 0;
+  pT->unmatched = 0;
+  DPF(LDR "rpc_init:-pT=%p size=%u\n", ldr(), pT, size);
+  return pT;
+}
+
+/**
+ * @see rpc.h
+ */
+uint64_t rpc_deinit(RpcTable_t* pT) {
+  DPF(LDR "rpc_deinit:+pT=%p outstanding=%u\n", ldr(), pT, pT->outstanding);
+  uint64_t completed = pT->completed;
+  free(pT->slots);
+  pT->slots = NULL;
+  pT->pRspQ = NULL;
+  pT->size = 0;
+  pT->mask = 0;
+  pT->outstanding = 0;
+  pT->completed = 0;
+  DPF(LDR "rpc_deinit:-pT=%p completed=%lu\n", ldr(), pT, completed);
+  return completed;
+}
+
+/**
+ * @see rpc.h
+ */
+uint64_t rpc_send(RpcTable_t* pT, MpscFifo_t* pDst, Msg_t* pMsg, RpcDone_t done, void* ctx) {
+  DPF(LDR "rpc_send:+pT=%p pDst=%p pMsg=%p\n", ldr(), pT, pDst, pMsg);
+  if (pT->outstanding >= pT->size) {
+    DPF(LDR "rpc_send:-pT=%p FULL pMsg=%p\n", ldr(), pT, pMsg);
+    return 0;
+  }
+
+  // There's a free slot so this ends within size ids
+  uint64_t id = pT->next_id;
+  while (pT->slots[id & pT->mask].id != 0) {
+    id += 1;
+  }
+  pT->next_id = id + 1;
+
+  RpcSlot_t* slot = &pT->slots[id & pT->mask];
+  slot->id = id;
+  slot->done = done;
+  slot->ctx = ctx;
+  pT->outstanding += 1;
+
+  pMsg->id = id;
+  pMsg->pRspQ = pT->pRspQ;
+  add(pDst, pMsg);
+  DPF(LDR "rpc_send:-pT=%p pDst=%p pMsg=%p id=%lu\n", ldr(), pT, pDst, pMsg, id);
+  return id;
+}
+
+/**
+ * @see rpc.h
+ */
+uint32_t rpc_poll(RpcTable_t* pT) {
+  Msg_t* msgs[RPC_BATCH];
+  uint32_t completed = 0;
+  uint32_t cnt;
+
+  do {
+    cnt = rmv_batch(pT->pRspQ, msgs, RPC_BATCH);
+    for (uint32_t i = 0; i < cnt; i++) {
+      completed += rpc_complete(pT, msgs[i]) ? 1 : 0;
+    }
+  } while (cnt == RPC_BATCH);
+  return completed;
+}
+
+/**
+ * @see rpc.h
+ */
+uint32_t rpc_wait(RpcTable_t* pT) {
+  DPF(LDR "rpc_wait:+pT=%p outstanding=%u\n", ldr(), pT, pT->outstanding);
+  uint32_t completed = rpc_poll(pT);
+  while ((completed == 0) && (pT->outstanding != 0)) {
+    completed += rpc_complete(pT, rmv_wait(pT->pRspQ)) ? 1 : 0;
+    completed += rpc_poll(pT);
+  }
+  DPF(LDR "rpc_wait:-pT=%p outstanding=%u completed=%u\n", ldr(), pT, pT->outstanding, completed);
+  return completed;
+}
+
+/**
+ * @see rpc.h
+ */
+uint32_t rpc_wait_all(RpcTable_t* pT) {
+  uint32_t completed = 0;
+  while (pT->outstanding != 0) {
+    completed += rpc_wait(pT);
+  }
+  return completed;
+}
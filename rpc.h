@@ -0,0 +1,103 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A RpcTable_t lets a thread have many requests outstanding on one
+ * response fifo. rpc_send stamps each request with a correlation id
+ * and sets its pRspQ, the receiver responds as usual with
+ * send_rsp_or_ret which leaves the id alone. The id selects a slot
+ * in a power of 2 completion table which holds the callback and its
+ * context, so completing a response is an index rather than a search.
+ *
+ * Ids are handed out in sequence and skip those whose slot is still
+ * outstanding, so a slow request only holds its own slot. A table
+ * and its response fifo maybe used only by a single thread.
+ */
+
+#ifndef COM_SAVILLE_RPC_H
+#define COM_SAVILLE_RPC_H
+
+#include "mpscfifo.h"
+#include "msg.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/**
+ * Called with the response to a request, pRsp is returned with
+ * ret_msg after it returns.
+ */
+typedef void (*RpcDone_t)(void* ctx, Msg_t* pRsp);
+
+typedef struct RpcSlot_t {
+  uint64_t id; // 0 if free
+  RpcDone_t done;
+  void* ctx;
+} RpcSlot_t;
+
+typedef struct RpcTable_t {
+  MpscFifo_t* pRspQ;
+  RpcSlot_t* slots;
+  uint32_t size;
+  uint32_t mask;
+  uint32_t outstanding;
+  uint64_t next_id;
+  uint64_t completed;
+  uint64_t unmatched;
+} RpcTable_t;
+
+/**
+ * Initialize the RpcTable_t whose responses are sent to pRspQ,
+ * size is the maximum outstanding and must be a power of two.
+ *
+ * @return NULL if size cannot be malloced or is not a power of 2.
+ */
+extern RpcTable_t* rpc_init(RpcTable_t* pT, MpscFifo_t* pRspQ, uint32_t size);
+
+/**
+ * Deinitialize the RpcTable_t, requests still outstanding are
+ * forgotten and their responses won't be matched.
+ *
+ * @return number of requests completed.
+ */
+extern uint64_t rpc_deinit(RpcTable_t* pT);
+
+/**
+ * Send pMsg to pDst as a request, done is called with ctx when its
+ * response is completed by rpc_poll or one of the waits.
+ *
+ * @return the correlation id or 0 if the table is full, in which case
+ * pMsg isn't sent.
+ */
+extern uint64_t rpc_send(RpcTable_t* pT, MpscFifo_t* pDst, Msg_t* pMsg, RpcDone_t done, void* ctx);
+
+/**
+ * Complete the responses in the response fifo without waiting,
+ * responses whose id isn't outstanding are counted in unmatched
+ * and returned.
+ *
+ * @return number of requests completed.
+ */
+extern uint32_t rpc_poll(RpcTable_t* pT);
+
+/**
+ * Wait until at least one request completes, or none are outstanding.
+ *
+ * @return number of requests completed.
+ */
+extern uint32_t rpc_wait(RpcTable_t* pT);
+
+/**
+ * Wait until no requests are outstanding.
+ *
+ * @return number of requests completed.
+ */
+extern uint32_t rpc_wait_all(RpcTable_t* pT);
+
+/**
+ * @return number of requests outstanding.
+ */
+static inline uint32_t rpc_outstanding(RpcTable_t* pT) {
+  return pT->outstanding;
+}
+
+#endif
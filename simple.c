@@ -7,7 +7,12 @@
 #define _DEFAULT_SOURCE
 
 #include "mpscfifo.h"
+#include "mpscfifoset.h"
+#include "mpscprio.h"
+#include "msg_pool.h"
+#include "rpc.h"
 #include "diff_timespec.h"
+#include "crash.h"
 #include "dpf.h"
 
 #include <sys/types.h>
@@ -18,6 +23,9 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
 
 /**
  * We pass pointers in Msg_t.arg2 which is a uint64_t,
@@ -130,6 +138,1649 @@ bool simple(void) {
   return error;
 }
 
+bool non_stalling(void) {
+  bool error = false;
+  bool busy;
+  MpscFifo_t cmdFifo;
+  MpscLinkList_t ll;
+
+  printf(LDR "non_stalling:+\n", ldr());
+
+  Cell_t cell1;
+  Cell_t cell2;
+
+  Msg_t msg1 = {
+    .pCell = &cell1,
+    .pPool = NULL,
+    .arg1 = 1,
+    .arg2 = -1
+  };
+
+  Msg_t msg2 = {
+    .pCell = &cell2,
+    .pPool = NULL,
+    .arg1 = 2,
+    .arg2 = -2
+  };
+
+  printf(LDR "non_stalling: init cmdFifo=%p\n", ldr(), &cmdFifo);
+  initMpscFifo(&cmdFifo);
+
+  printf(LDR "non_stalling: remove from empty cmdFifo=%p\n", ldr(), &cmdFifo);
+  Msg_t* pMsg = rmv_non_stalling(&cmdFifo, &busy);
+  if ((pMsg != NULL) || busy) {
+    printf(LDR "non_stalling: expected pMsg=%p == NULL and busy=%u == false\n", ldr(), pMsg, busy);
+    error |= true;
+  }
+
+  printf(LDR "non_stalling: add msg1 to empty cmdFifo=%p\n", ldr(), &cmdFifo);
+  add(&cmdFifo, &msg1);
+  pMsg = rmv_non_stalling(&cmdFifo, &busy);
+  if ((pMsg != &msg1) || busy) {
+    printf(LDR "non_stalling: expected pMsg=%p == &msg1=%p and busy=%u == false\n", ldr(), pMsg, &msg1, busy);
+    error |= true;
+  }
+
+  // Simulate a producer preempted after reserving a ring slot
+  printf(LDR "non_stalling: reserve a ring slot in cmdFifo=%p\n", ldr(), &cmdFifo);
+  uint32_t pos = cmdFifo.rb.add_idx;
+  cmdFifo.rb.add_idx = pos + 1;
+  pMsg = rmv_non_stalling(&cmdFifo, &busy);
+  if ((pMsg != NULL) || !busy) {
+    printf(LDR "non_stalling: expected pMsg=%p == NULL and busy=%u == true\n", ldr(), pMsg, busy);
+    error |= true;
+  }
+
+  printf(LDR "non_stalling: fill the reserved slot in cmdFifo=%p\n", ldr(), &cmdFifo);
+  Cell_t* pSlot = &cmdFifo.rb.ring_buffer[pos & cmdFifo.rb.mask];
+  pSlot->pMsg = &msg2;
+  __atomic_store_n(&pSlot->seq, pos + 1, __ATOMIC_RELEASE);
+  pMsg = rmv_non_stalling(&cmdFifo, &busy);
+  if ((pMsg != &msg2) || busy) {
+    printf(LDR "non_stalling: expected pMsg=%p == &msg2=%p and busy=%u == false\n", ldr(), pMsg, &msg2, busy);
+    error |= true;
+  }
+  deinitMpscFifo(&cmdFifo);
+
+  // Simulate a producer preempted between swapping pHead and linking pNext
+  printf(LDR "non_stalling: init ll=%p\n", ldr(), &ll);
+  ll_init(&ll);
+#if MPSC_INTRUSIVE
+  LlNode_t* pNode = &msg1;
+#else
+  LlNode_t* pNode = &cell1;
+  cell1.pMsg = &msg1;
+#endif
+  pNode->pNext = NULL;
+  LlNode_t* pPrev = __atomic_exchange_n(&ll.pHead, pNode, __ATOMIC_ACQ_REL);
+  pMsg = ll_rmv_non_stalling(&ll, &busy);
+  if ((pMsg != NULL) || !busy) {
+    printf(LDR "non_stalling: expected pMsg=%p == NULL and busy=%u == true\n", ldr(), pMsg, busy);
+    error |= true;
+  }
+
+  printf(LDR "non_stalling: link pNext in ll=%p\n", ldr(), &ll);
+  __atomic_store_n(&pPrev->pNext, pNode, __ATOMIC_RELEASE);
+  pMsg = ll_rmv_non_stalling(&ll, &busy);
+  if ((pMsg != &msg1) || busy) {
+    printf(LDR "non_stalling: expected pMsg=%p == &msg1=%p and busy=%u == false\n", ldr(), pMsg, &msg1, busy);
+    error |= true;
+  }
+  pMsg = ll_rmv_non_stalling(&ll, &busy);
+  if ((pMsg != NULL) || busy) {
+    printf(LDR "non_stalling: expected pMsg=%p == NULL and busy=%u == false\n", ldr(), pMsg, busy);
+    error |= true;
+  }
+  ll_deinit(&ll);
+
+  printf(LDR "non_stalling:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool batch(void) {
+  bool error = false;
+  MpscFifo_t cmdFifo;
+  // More than fits in the ring buffer so the batch spills into the link list
+  const uint32_t count = 0x180;
+
+  printf(LDR "batch:+count=%u\n", ldr(), count);
+
+  Msg_t* msgs = calloc(count, sizeof(Msg_t));
+  Cell_t* cells = calloc(count, sizeof(Cell_t));
+  Msg_t** msg_ptrs = calloc(count, sizeof(Msg_t*));
+  if ((msgs == NULL) || (cells == NULL) || (msg_ptrs == NULL)) {
+    printf(LDR "batch: unable to allocate msgs\n", ldr());
+    error |= true;
+    goto done;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    msgs[i].pCell = &cells[i];
+    msgs[i].arg1 = i;
+    msg_ptrs[i] = &msgs[i];
+  }
+
+  printf(LDR "batch: init cmdFifo=%p\n", ldr(), &cmdFifo);
+  initMpscFifo(&cmdFifo);
+
+  printf(LDR "batch: add_batch 3 to empty cmdFifo=%p\n", ldr(), &cmdFifo);
+  add_batch(&cmdFifo, msg_ptrs, 3);
+  for (uint32_t i = 0; i < 3; i++) {
+    Msg_t* pMsg = rmv(&cmdFifo);
+    if (pMsg != &msgs[i]) {
+      printf(LDR "batch: expected pMsg=%p == &msgs[%u]=%p\n", ldr(), pMsg, i, &msgs[i]);
+      error |= true;
+    }
+  }
+
+  printf(LDR "batch: add_batch %u to empty cmdFifo=%p\n", ldr(), count, &cmdFifo);
+  add_batch(&cmdFifo, msg_ptrs, count);
+
+  printf(LDR "batch: rmv_batch %u from cmdFifo=%p\n", ldr(), count, &cmdFifo);
+  Msg_t* rmvd[100];
+  uint32_t rmvd_count = 0;
+  uint32_t n;
+  while ((n = rmv_batch(&cmdFifo, rmvd, sizeof(rmvd) / sizeof(rmvd[0]))) != 0) {
+    for (uint32_t i = 0; i < n; i++, rmvd_count++) {
+      if ((rmvd_count >= count) || (rmvd[i] != &msgs[rmvd_count])) {
+        printf(LDR "batch: expected rmvd[%u]=%p == &msgs[%u]\n", ldr(), i, rmvd[i], rmvd_count);
+        error |= true;
+      }
+    }
+  }
+  if (rmvd_count != count) {
+    printf(LDR "batch: expected rmvd_count=%u == count=%u\n", ldr(), rmvd_count, count);
+    error |= true;
+  }
+
+  printf(LDR "batch: remove from empty cmdFifo=%p\n", ldr(), &cmdFifo);
+  Msg_t* pMsg = rmv(&cmdFifo);
+  if (pMsg != NULL) {
+    printf(LDR "batch: expected pMsg=%p == NULL\n", ldr(), pMsg);
+    error |= true;
+  }
+  deinitMpscFifo(&cmdFifo);
+
+done:
+  free(msg_ptrs);
+  free(cells);
+  free(msgs);
+
+  printf(LDR "batch:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool adaptive(void) {
+  bool error = false;
+  MpscFifo_t cmdFifo;
+  const uint32_t min_capacity = 4;
+  const uint32_t max_capacity = 16;
+  // Twice max_capacity so every round overflows into the link list
+  const uint32_t count = 2 * max_capacity;
+
+  printf(LDR "adaptive:+min_capacity=%u max_capacity=%u\n", ldr(), min_capacity, max_capacity);
+
+  Msg_t msgs[count];
+  Cell_t cells[count];
+  for (uint32_t i = 0; i < count; i++) {
+    msgs[i].pCell = &cells[i];
+    msgs[i].arg1 = i;
+  }
+
+  printf(LDR "adaptive: init cmdFifo=%p\n", ldr(), &cmdFifo);
+  if (initMpscFifoAdaptive(&cmdFifo, 8, 16, 4) != NULL) {
+    printf(LDR "adaptive: expected bad capacities to fail\n", ldr());
+    error |= true;
+  }
+  if (initMpscFifoAdaptive(&cmdFifo, min_capacity, min_capacity, max_capacity) == NULL) {
+    printf(LDR "adaptive: initMpscFifoAdaptive failed\n", ldr());
+    error |= true;
+    goto done;
+  }
+
+  printf(LDR "adaptive: overflow cmdFifo=%p until it grows\n", ldr(), &cmdFifo);
+  for (uint32_t round = 0; round < 8; round++) {
+    for (uint32_t i = 0; i < count; i++) {
+      add(&cmdFifo, &msgs[i]);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      Msg_t* pMsg = rmv(&cmdFifo);
+      if (pMsg != &msgs[i]) {
+        printf(LDR "adaptive: round=%u expected pMsg=%p == &msgs[%u]=%p\n", ldr(), round, pMsg, i, &msgs[i]);
+        error |= true;
+      }
+    }
+    if (rmv(&cmdFifo) != NULL) {
+      printf(LDR "adaptive: round=%u expected empty\n", ldr(), round);
+      error |= true;
+    }
+  }
+  if (cmdFifo.rb.size != max_capacity) {
+    printf(LDR "adaptive: expected rb.size=%u == max_capacity=%u\n", ldr(), cmdFifo.rb.size, max_capacity);
+    error |= true;
+  }
+
+  printf(LDR "adaptive: keep cmdFifo=%p shallow until it shrinks\n", ldr(), &cmdFifo);
+  for (uint32_t i = 0; i < 0x40000; i++) {
+    add(&cmdFifo, &msgs[0]);
+    Msg_t* pMsg = rmv(&cmdFifo);
+    if (pMsg != &msgs[0]) {
+      printf(LDR "adaptive: i=%u expected pMsg=%p == &msgs[0]=%p\n", ldr(), i, pMsg, &msgs[0]);
+      error |= true;
+      break;
+    }
+    // Find it empty so a link list excursion ends
+    if (rmv(&cmdFifo) != NULL) {
+      printf(LDR "adaptive: i=%u expected empty\n", ldr(), i);
+      error |= true;
+      break;
+    }
+  }
+  if (cmdFifo.rb.size != min_capacity) {
+    printf(LDR "adaptive: expected rb.size=%u == min_capacity=%u\n", ldr(), cmdFifo.rb.size, min_capacity);
+    error |= true;
+  }
+  deinitMpscFifo(&cmdFifo);
+
+done:
+  printf(LDR "adaptive:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool segmented(void) {
+  bool error = false;
+  MpscFifo_t cmdFifo;
+  // Several segments worth so adds and removes cross segments
+  const uint32_t count = 5 * SG_SEG_CAP + 7;
+
+  printf(LDR "segmented:+count=%u\n", ldr(), count);
+
+  Msg_t* msgs = calloc(count, sizeof(Msg_t));
+  Msg_t** msg_ptrs = calloc(count, sizeof(Msg_t*));
+  if ((msgs == NULL) || (msg_ptrs == NULL)) {
+    printf(LDR "segmented: unable to allocate msgs\n", ldr());
+    error |= true;
+    goto done;
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    msgs[i].arg1 = i;
+    msg_ptrs[i] = &msgs[i];
+  }
+
+  printf(LDR "segmented: init cmdFifo=%p\n", ldr(), &cmdFifo);
+  if (initMpscFifoSegmented(&cmdFifo) == NULL) {
+    printf(LDR "segmented: initMpscFifoSegmented failed\n", ldr());
+    error |= true;
+    goto done;
+  }
+
+  for (uint32_t round = 0; round < 3; round++) {
+    printf(LDR "segmented: round=%u add %u to cmdFifo=%p\n", ldr(), round, count, &cmdFifo);
+    for (uint32_t i = 0; i < count; i++) {
+      add(&cmdFifo, &msgs[i]);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      Msg_t* pMsg = rmv(&cmdFifo);
+      if (pMsg != &msgs[i]) {
+        printf(LDR "segmented: round=%u expected pMsg=%p == &msgs[%u]=%p\n", ldr(), round, pMsg, i, &msgs[i]);
+        error |= true;
+      }
+    }
+
+    printf(LDR "segmented: round=%u add_batch %u to cmdFifo=%p\n", ldr(), round, count, &cmdFifo);
+    add_batch(&cmdFifo, msg_ptrs, count);
+    Msg_t* rmvd[100];
+    uint32_t rmvd_count = 0;
+    uint32_t n;
+    while ((n = rmv_batch(&cmdFifo, rmvd, sizeof(rmvd) / sizeof(rmvd[0]))) != 0) {
+      for (uint32_t i = 0; i < n; i++, rmvd_count++) {
+        if ((rmvd_count >= count) || (rmvd[i] != &msgs[rmvd_count])) {
+          printf(LDR "segmented: expected rmvd[%u]=%p == &msgs[%u]\n", ldr(), i, rmvd[i], rmvd_count);
+          error |= true;
+        }
+      }
+    }
+    if (rmvd_count != count) {
+      printf(LDR "segmented: expected rmvd_count=%u == count=%u\n", ldr(), rmvd_count, count);
+      error |= true;
+    }
+  }
+
+  printf(LDR "segmented: remove from empty cmdFifo=%p\n", ldr(), &cmdFifo);
+  bool busy = true;
+  Msg_t* pMsg = rmv_non_stalling(&cmdFifo, &busy);
+  if ((pMsg != NULL) || busy) {
+    printf(LDR "segmented: expected pMsg=%p == NULL and busy=%u == false\n", ldr(), pMsg, busy);
+    error |= true;
+  }
+  deinitMpscFifo(&cmdFifo);
+
+done:
+  free(msg_ptrs);
+  free(msgs);
+
+  printf(LDR "segmented:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool faa(void) {
+  bool error = false;
+  MpscFifo_t cmdFifo;
+  // More than fits in the ring so it overflows into the link lists
+  const uint32_t capacity = 0x10;
+  const uint32_t count = 0x30;
+
+  printf(LDR "faa:+capacity=%u count=%u\n", ldr(), capacity, count);
+
+  Msg_t msgs[count];
+  Cell_t cells[count];
+  Msg_t* msg_ptrs[count];
+  for (uint32_t i = 0; i < count; i++) {
+    msgs[i].pCell = &cells[i];
+    msgs[i].arg1 = i;
+    msg_ptrs[i] = &msgs[i];
+  }
+
+  printf(LDR "faa: init cmdFifo=%p\n", ldr(), &cmdFifo);
+  if (initMpscFifoFaa(&cmdFifo, 3) != NULL) {
+    printf(LDR "faa: expected capacity 3 to fail\n", ldr());
+    error |= true;
+  }
+  if (initMpscFifoFaa(&cmdFifo, capacity) == NULL) {
+    printf(LDR "faa: initMpscFifoFaa failed\n", ldr());
+    error |= true;
+    goto done;
+  }
+
+  for (uint32_t round = 0; round < 3; round++) {
+    printf(LDR "faa: round=%u add %u to cmdFifo=%p\n", ldr(), round, count, &cmdFifo);
+    for (uint32_t i = 0; i < count; i++) {
+      add(&cmdFifo, &msgs[i]);
+    }
+    for (uint32_t i = 0; i < count; i++) {
+      Msg_t* pMsg = rmv(&cmdFifo);
+      if (pMsg != &msgs[i]) {
+        printf(LDR "faa: round=%u expected pMsg=%p == &msgs[%u]=%p\n", ldr(), round, pMsg, i, &msgs[i]);
+        error |= true;
+      }
+    }
+    if (rmv(&cmdFifo) != NULL) {
+      printf(LDR "faa: round=%u expected empty\n", ldr(), round);
+      error |= true;
+    }
+
+    printf(LDR "faa: round=%u add_batch %u to cmdFifo=%p\n", ldr(), round, count, &cmdFifo);
+    add_batch(&cmdFifo, msg_ptrs, count);
+    Msg_t* rmvd[7];
+    uint32_t rmvd_count = 0;
+    uint32_t n;
+    while ((n = rmv_batch(&cmdFifo, rmvd, sizeof(rmvd) / sizeof(rmvd[0]))) != 0) {
+      for (uint32_t i = 0; i < n; i++, rmvd_count++) {
+        if ((rmvd_count >= count) || (rmvd[i] != &msgs[rmvd_count])) {
+          printf(LDR "faa: expected rmvd[%u]=%p == &msgs[%u]\n", ldr(), i, rmvd[i], rmvd_count);
+          error |= true;
+        }
+      }
+    }
+    if (rmvd_count != count) {
+      printf(LDR "faa: expected rmvd_count=%u == count=%u\n", ldr(), rmvd_count, count);
+      error |= true;
+    }
+  }
+  deinitMpscFifo(&cmdFifo);
+
+done:
+  printf(LDR "faa:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool lanes(void) {
+  bool error = false;
+  MpscFifo_t cmdFifo;
+  const uint32_t lane_size = 4;
+  Msg_t msgs[3 * lane_size];
+  Cell_t cells[3 * lane_size];
+  SpscRing_t* lanes[2];
+
+  printf(LDR "lanes:+\n", ldr());
+
+  for (uint32_t i = 0; i < 3 * lane_size; i++) {
+    msgs[i].pCell = &cells[i];
+    msgs[i].arg1 = i;
+  }
+
+  printf(LDR "lanes: init cmdFifo=%p\n", ldr(), &cmdFifo);
+  initMpscFifo(&cmdFifo);
+  for (uint32_t l = 0; l < 2; l++) {
+    lanes[l] = register_lane(&cmdFifo, lane_size);
+    if (lanes[l] == NULL) {
+      printf(LDR "lanes: register_lane %u failed\n", ldr(), l);
+      error |= true;
+      goto done;
+    }
+  }
+
+  printf(LDR "lanes: fill both lanes and add to cmdFifo=%p\n", ldr(), &cmdFifo);
+  for (uint32_t i = 0; i < lane_size; i++) {
+    for (uint32_t l = 0; l < 2; l++) {
+      if (!add_lane(&cmdFifo, lanes[l], &msgs[(l * lane_size) + i])) {
+        printf(LDR "lanes: add_lane lane=%u i=%u failed\n", ldr(), l, i);
+        error |= true;
+      }
+    }
+    add(&cmdFifo, &msgs[(2 * lane_size) + i]);
+  }
+  if (add_lane(&cmdFifo, lanes[0], &msgs[0])) {
+    printf(LDR "lanes: expected add_lane to a full lane to fail\n", ldr());
+    error |= true;
+  }
+
+  // Each source is in order and all are removed
+  uint32_t next[3] = { 0, lane_size, 2 * lane_size };
+  for (uint32_t i = 0; i < 3 * lane_size; i++) {
+    Msg_t* pMsg = rmv(&cmdFifo);
+    if (pMsg == NULL) {
+      printf(LDR "lanes: i=%u unexpected pMsg == NULL\n", ldr(), i);
+      error |= true;
+      break;
+    }
+    uint32_t src = pMsg->arg1 / lane_size;
+    if (pMsg->arg1 != next[src]) {
+      printf(LDR "lanes: expected arg1=%lu == %u\n", ldr(), pMsg->arg1, next[src]);
+      error |= true;
+    }
+    next[src] += 1;
+  }
+
+  printf(LDR "lanes: rmv_batch from lanes and cmdFifo=%p\n", ldr(), &cmdFifo);
+  add_lane(&cmdFifo, lanes[1], &msgs[0]);
+  add(&cmdFifo, &msgs[1]);
+  Msg_t* rmvd[4];
+  uint32_t n = rmv_batch(&cmdFifo, rmvd, 4);
+  if (n != 2) {
+    printf(LDR "lanes: expected rmv_batch n=%u == 2\n", ldr(), n);
+    error |= true;
+  }
+  if (rmv(&cmdFifo) != NULL) {
+    printf(LDR "lanes: expected cmdFifo empty\n", ldr());
+    error |= true;
+  }
+
+  printf(LDR "lanes: only an add to an empty lane sets it ready\n", ldr());
+  add_lane(&cmdFifo, lanes[1], &msgs[0]);
+  add_lane(&cmdFifo, lanes[1], &msgs[1]);
+  if (rmv(&cmdFifo) != &msgs[0]) {
+    printf(LDR "lanes: expected msgs[0] from the ready lane\n", ldr());
+    error |= true;
+  }
+  add_lane(&cmdFifo, lanes[1], &msgs[2]);
+  if (cmdFifo.lanes_ready != 0) {
+    printf(LDR "lanes: expected no ready bit adding to a non-empty lane\n", ldr());
+    error |= true;
+  }
+  if ((rmv(&cmdFifo) != &msgs[1]) || (rmv(&cmdFifo) != &msgs[2]) || (rmv(&cmdFifo) != NULL)) {
+    printf(LDR "lanes: expected msgs[1] and msgs[2] from the pending lane\n", ldr());
+    error |= true;
+  }
+
+  printf(LDR "lanes: sweep_lanes finds a lane whose ready bit was missed\n", ldr());
+  add_lane(&cmdFifo, lanes[1], &msgs[3]);
+  cmdFifo.lanes_ready = 0;
+  if (!sweep_lanes(&cmdFifo) || (rmv(&cmdFifo) != &msgs[3]) || (rmv(&cmdFifo) != NULL)) {
+    printf(LDR "lanes: expected sweep_lanes to find msgs[3]\n", ldr());
+    error |= true;
+  }
+
+  printf(LDR "lanes: register more than MPSC_MAX_LANES\n", ldr());
+  uint32_t registered = 2;
+  while (register_lane(&cmdFifo, lane_size) != NULL) {
+    registered += 1;
+  }
+  if (registered != MPSC_MAX_LANES) {
+    printf(LDR "lanes: expected registered=%u == MPSC_MAX_LANES\n", ldr(), registered);
+    error |= true;
+  }
+
+  printf(LDR "lanes: unregister a lane and register its slot again\n", ldr());
+  add_lane(&cmdFifo, lanes[0], &msgs[0]);
+  unregister_lane(&cmdFifo, lanes[0]);
+  if (register_lane(&cmdFifo, lane_size) != NULL) {
+    printf(LDR "lanes: expected the slot to be in use until the lane is empty\n", ldr());
+    error |= true;
+  }
+  if ((rmv(&cmdFifo) != &msgs[0]) || (rmv(&cmdFifo) != NULL)) {
+    printf(LDR "lanes: expected the message left in the unregistered lane\n", ldr());
+    error |= true;
+  }
+  lanes[0] = register_lane(&cmdFifo, lane_size);
+  if ((lanes[0] == NULL) || !add_lane(&cmdFifo, lanes[0], &msgs[1])
+      || (rmv(&cmdFifo) != &msgs[1])) {
+    printf(LDR "lanes: expected to register and use the freed slot\n", ldr());
+    error |= true;
+  }
+
+done:
+  deinitMpscFifo(&cmdFifo);
+
+  printf(LDR "lanes:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+typedef struct DelayedAddParams {
+  MpscFifo_t* pFifo;
+  Msg_t* pMsg;
+} DelayedAddParams;
+
+/**
+ * Sleep so the consumer parks and then add the message
+ */
+static void* delayed_add(void* p) {
+  DelayedAddParams* dp = (DelayedAddParams*)p;
+  struct timespec delay = { .tv_sec = 0, .tv_nsec = 20000000 };
+  nanosleep(&delay, NULL);
+  add(dp->pFifo, dp->pMsg);
+  return NULL;
+}
+
+static uint32_t park_hook_calls;
+
+static void count_park_hook(void) {
+  park_hook_calls += 1;
+}
+
+bool waiting(void) {
+  bool error = false;
+  MpscFifo_t cmdFifo;
+  Msg_t msg;
+  Cell_t cell;
+  pthread_t thread;
+  struct timespec time_start;
+  struct timespec time_stop;
+
+  printf(LDR "waiting:+\n", ldr());
+
+  msg.pCell = &cell;
+  initMpscFifo(&cmdFifo);
+  enable_rmv_wait(&cmdFifo, 10);
+
+  printf(LDR "waiting: rmv_timed_wait on empty cmdFifo=%p\n", ldr(), &cmdFifo);
+  MpscParkHook_t saved_hook = park_hook;
+  park_hook = count_park_hook;
+  park_hook_calls = 0;
+  clock_gettime(CLOCK_MONOTONIC, &time_start);
+  Msg_t* pMsg = rmv_timed_wait(&cmdFifo, 10000000);
+  clock_gettime(CLOCK_MONOTONIC, &time_stop);
+  park_hook = saved_hook;
+  double waited_ns = diff_timespec_ns(&time_stop, &time_start);
+  if ((pMsg != NULL) || (waited_ns < 10000000)) {
+    printf(LDR "waiting: expected pMsg=%p == NULL after waited_ns=%.0f >= 10ms\n", ldr(), pMsg, waited_ns);
+    error |= true;
+  }
+  if (park_hook_calls == 0) {
+    printf(LDR "waiting: expected park_hook to be called before parking\n", ldr());
+    error |= true;
+  }
+
+  printf(LDR "waiting: rmv_wait for a delayed add to cmdFifo=%p\n", ldr(), &cmdFifo);
+  DelayedAddParams dp = { .pFifo = &cmdFifo, .pMsg = &msg };
+  if (pthread_create(&thread, NULL, delayed_add, &dp) != 0) {
+    printf(LDR "waiting: unable to create thread\n", ldr());
+    error |= true;
+    goto done;
+  }
+  pMsg = rmv_wait(&cmdFifo);
+  pthread_join(thread, NULL);
+  if (pMsg != &msg) {
+    printf(LDR "waiting: expected pMsg=%p == &msg=%p\n", ldr(), pMsg, &msg);
+    error |= true;
+  }
+
+  printf(LDR "waiting: rmv_timed_wait with a msg in cmdFifo=%p\n", ldr(), &cmdFifo);
+  add(&cmdFifo, &msg);
+  pMsg = rmv_timed_wait(&cmdFifo, 0);
+  if (pMsg != &msg) {
+    printf(LDR "waiting: expected pMsg=%p == &msg=%p\n", ldr(), pMsg, &msg);
+    error |= true;
+  }
+
+done:
+  deinitMpscFifo(&cmdFifo);
+
+  printf(LDR "waiting:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool backoffs(void) {
+  bool error = false;
+  MpscFifo_t cmdFifo;
+  Backoff_t policy;
+
+  printf(LDR "backoffs:+\n", ldr());
+
+  const uint32_t kinds[] = { BACKOFF_SPIN, BACKOFF_SPIN_YIELD, BACKOFF_SPIN_SLEEP };
+  const uint64_t expected[][3] = {
+    // spins, yields, sleeps
+    { 6, 0, 0 },
+    { 2, 4, 0 },
+    { 2, 2, 2 },
+  };
+  for (uint32_t k = 0; k < 3; k++) {
+    backoff_init(&policy, kinds[k], 2, 2, 1000);
+    uint32_t attempt = 0;
+    for (uint32_t i = 0; i < 6; i++) {
+      backoff(&policy, &attempt);
+    }
+    if ((policy.spins != expected[k][0]) || (policy.yields != expected[k][1])
+        || (policy.sleeps != expected[k][2])) {
+      printf(LDR "backoffs: kind=%u spins=%lu yields=%lu sleeps=%lu not expected\n",
+          ldr(), kinds[k], policy.spins, policy.yields, policy.sleeps);
+      error |= true;
+    }
+  }
+
+  printf(LDR "backoffs: set_backoff on cmdFifo=%p\n", ldr(), &cmdFifo);
+  initMpscFifo(&cmdFifo);
+  set_backoff(&cmdFifo, &policy);
+  const Backoff_t* pB = get_backoff(&cmdFifo);
+  if ((pB->kind != BACKOFF_SPIN_SLEEP) || (pB->spins != 0) || (pB->sleeps != 0)) {
+    printf(LDR "backoffs: expected kind=%u == BACKOFF_SPIN_SLEEP and cleared counters\n", ldr(), pB->kind);
+    error |= true;
+  }
+  deinitMpscFifo(&cmdFifo);
+
+  printf(LDR "backoffs:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+/**
+ * Add count messages and remove them, then check the fifo is empty.
+ */
+static bool mode_round(MpscFifo_t* pQ, Msg_t* msgs, uint32_t count) {
+  bool error = false;
+  for (uint32_t i = 0; i < count; i++) {
+    add(pQ, &msgs[i]);
+  }
+  for (uint32_t i = 0; i < count; i++) {
+    Msg_t* pMsg = rmv(pQ);
+    if (pMsg != &msgs[i]) {
+      printf(LDR "mode_round: expected pMsg=%p == &msgs[%u]=%p\n", ldr(), pMsg, i, &msgs[i]);
+      error |= true;
+    }
+  }
+  if (rmv(pQ) != NULL) {
+    printf(LDR "mode_round: expected empty\n", ldr());
+    error |= true;
+  }
+  return error;
+}
+
+bool mode_policy(void) {
+  bool error = false;
+  MpscFifo_t cmdFifo;
+  MpscModePolicy_t policy = { 0 };
+  MpscModeStats_t stats;
+  // Twice what fits in the ring so it overflows into the link lists
+  const uint32_t capacity = 0x4;
+  const uint32_t count = 0x8;
+
+  printf(LDR "mode_policy:+capacity=%u count=%u\n", ldr(), capacity, count);
+
+  Msg_t msgs[count];
+  Cell_t cells[count];
+  for (uint32_t i = 0; i < count; i++) {
+    msgs[i].pCell = &cells[i];
+    msgs[i].arg1 = i;
+  }
+
+  printf(LDR "mode_policy: init cmdFifo=%p\n", ldr(), &cmdFifo);
+  initMpscFifoCapacity(&cmdFifo, capacity);
+
+  // The default policy leaves the link list as soon as it's empty
+  error |= mode_round(&cmdFifo, msgs, count);
+  get_mode_stats(&cmdFifo, &stats);
+  if ((stats.to_ll != 1) || (stats.to_rb != 1)) {
+    printf(LDR "mode_policy: default to_ll=%lu to_rb=%lu expected 1, 1\n", ldr(), stats.to_ll, stats.to_rb);
+    error |= true;
+  }
+
+  // A long dwell keeps us in the link list after it's empty
+  policy.ll_enter_retries = 2;
+  policy.ll_min_dwell_ns = 60 * ns_u64;
+  set_mode_policy(&cmdFifo, &policy);
+  error |= mode_round(&cmdFifo, msgs, count);
+  error |= mode_round(&cmdFifo, msgs, count);
+  get_mode_stats(&cmdFifo, &stats);
+  if ((stats.to_ll != 2) || (stats.to_rb != 1)) {
+    printf(LDR "mode_policy: dwell to_ll=%lu to_rb=%lu expected 2, 1\n", ldr(), stats.to_ll, stats.to_rb);
+    error |= true;
+  }
+
+  // With no dwell, stay while more than the watermark arrive between empties
+  policy.ll_min_dwell_ns = 0;
+  policy.ll_keep_while_busy = true;
+  policy.ll_exit_low_watermark = 2;
+  set_mode_policy(&cmdFifo, &policy);
+  error |= mode_round(&cmdFifo, msgs, count);
+  get_mode_stats(&cmdFifo, &stats);
+  if (stats.to_rb != 1) {
+    printf(LDR "mode_policy: burst to_rb=%lu expected 1\n", ldr(), stats.to_rb);
+    error |= true;
+  }
+  if (rmv(&cmdFifo) != NULL) {
+    printf(LDR "mode_policy: expected empty\n", ldr());
+    error |= true;
+  }
+  get_mode_stats(&cmdFifo, &stats);
+  if (stats.to_rb != 2) {
+    printf(LDR "mode_policy: burst over to_rb=%lu expected 2\n", ldr(), stats.to_rb);
+    error |= true;
+  }
+  if ((stats.rb_ns == 0) || (stats.ll_ns == 0)) {
+    printf(LDR "mode_policy: expected rb_ns=%lu and ll_ns=%lu != 0\n", ldr(), stats.rb_ns, stats.ll_ns);
+    error |= true;
+  }
+  if (get_mode_policy(&cmdFifo)->ll_exit_low_watermark != 2) {
+    printf(LDR "mode_policy: expected ll_exit_low_watermark == 2\n", ldr());
+    error |= true;
+  }
+  deinitMpscFifo(&cmdFifo);
+
+  printf(LDR "mode_policy:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+typedef struct RemoteRetParams {
+  Msg_t** msgs;
+  uint32_t count;
+} RemoteRetParams;
+
+/**
+ * Return messages from a thread that doesn't own their pool.
+ */
+static void* remote_ret(void* p) {
+  RemoteRetParams* rp = (RemoteRetParams*)p;
+  for (uint32_t i = 0; i < rp->count; i++) {
+    ret_msg(rp->msgs[i]);
+  }
+  // Those in a partial batch are flushed when we exit
+  return NULL;
+}
+
+bool quiescence(void) {
+  bool error = false;
+  QsSnapshot_t snap;
+  Backoff_t policy;
+  int obj;
+
+  printf(LDR "quiescence:+\n", ldr());
+
+  backoff_init(&policy, BACKOFF_SPIN_YIELD, 4, 16, 0);
+  qs_snapshot_init(&snap);
+  if (!qs_quiescent(&snap, &obj, false, &policy)) {
+    printf(LDR "quiescence: expected quiescent with no operation\n", ldr());
+    error |= true;
+  }
+
+  // An operation started before the snapshot keeps it busy
+  QsRecord_t* pRec = qs_enter(&obj);
+  if (qs_quiescent(&snap, &obj, false, &policy) || qs_quiescent(&snap, &obj, false, &policy)) {
+    printf(LDR "quiescence: expected busy while the operation is active\n", ldr());
+    error |= true;
+  }
+  qs_exit(pRec);
+
+  // One started after it has seen the new state so doesn't
+  pRec = qs_enter(&obj);
+  if (!qs_quiescent(&snap, &obj, false, &policy)) {
+    printf(LDR "quiescence: expected a later operation to be ignored\n", ldr());
+    error |= true;
+  }
+
+  // But it's found by the next snapshot
+  if (qs_quiescent(&snap, &obj, false, &policy)) {
+    printf(LDR "quiescence: expected the next snapshot to find it\n", ldr());
+    error |= true;
+  }
+  qs_exit(pRec);
+  if (!qs_quiescent(&snap, &obj, true, &policy)) {
+    printf(LDR "quiescence: expected quiescent after it finished\n", ldr());
+    error |= true;
+  }
+
+  printf(LDR "quiescence:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool pool_magazine(void) {
+  bool error = false;
+  MsgPool_t pool;
+  const uint32_t msg_count = 0x100;
+  Msg_t* msgs[msg_count];
+
+  printf(LDR "pool_magazine:+msg_count=%u\n", ldr(), msg_count);
+
+  if (MsgPool_init(&pool, msg_count)) {
+    printf(LDR "pool_magazine: MsgPool_init failed\n", ldr());
+    error |= true;
+    goto done;
+  }
+
+  for (uint32_t round = 0; round < 2; round++) {
+    for (uint32_t i = 0; i < msg_count; i++) {
+      msgs[i] = MsgPool_get_msg(&pool);
+      if (msgs[i] == NULL) {
+        printf(LDR "pool_magazine: round=%u get %u failed\n", ldr(), round, i);
+        error |= true;
+        goto done;
+      }
+    }
+    if (MsgPool_get_msg(&pool) != NULL) {
+      printf(LDR "pool_magazine: round=%u expected pool empty\n", ldr(), round);
+      error |= true;
+    }
+
+    if (round == 0) {
+      // Returned by the owner into its magazine
+      for (uint32_t i = 0; i < msg_count; i++) {
+        ret_msg(msgs[i]);
+      }
+    } else {
+      // Returned by another thread, a partial batch is left over
+      RemoteRetParams rp = { .msgs = msgs, .count = msg_count - 1 };
+      pthread_t thread;
+      if (pthread_create(&thread, NULL, remote_ret, &rp) != 0) {
+        printf(LDR "pool_magazine: unable to create thread\n", ldr());
+        CRASH();
+      }
+      pthread_join(thread, NULL);
+      ret_msg(msgs[msg_count - 1]);
+    }
+  }
+
+done:
+  if (MsgPool_deinit(&pool) == 0) {
+    printf(LDR "pool_magazine: expected msgs_processed != 0\n", ldr());
+    error |= true;
+  }
+
+  printf(LDR "pool_magazine:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool sized_pools(void) {
+  bool error = false;
+  MsgPools_t pools;
+  const uint32_t msg_count = 4;
+  const uint32_t sizes[] = { 1, 64, 65, 256, 1000, 4096 };
+  const uint32_t expected[] = { 64, 64, 256, 256, 1024, 4096 };
+  const uint32_t size_count = sizeof(sizes) / sizeof(sizes[0]);
+  Msg_t* msgs[size_count + msg_count];
+  uint32_t got = 0;
+
+  printf(LDR "sized_pools:+msg_count=%u\n", ldr(), msg_count);
+
+  if (MsgPools_init(&pools, msg_count)) {
+    printf(LDR "sized_pools: MsgPools_init failed\n", ldr());
+    return true;
+  }
+
+  for (uint32_t i = 0; i < size_count; i++) {
+    msgs[i] = MsgPool_get_msg_sized(&pools, sizes[i]);
+    got += (msgs[i] != NULL) ? 1 : 0;
+    if ((msgs[i] == NULL) || (MsgPool_data_size(msgs[i]) != expected[i])) {
+      printf(LDR "sized_pools: size=%u expected data_size=%u\n", ldr(), sizes[i], expected[i]);
+      error |= true;
+      goto done;
+    }
+    // The data is inline, writing all of it mustn't touch other messages
+    memset(msgs[i]->data, (int)i, MsgPool_data_size(msgs[i]));
+  }
+  for (uint32_t i = 0; i < size_count; i++) {
+    for (uint32_t j = 0; j < MsgPool_data_size(msgs[i]); j++) {
+      if (msgs[i]->data[j] != i) {
+        printf(LDR "sized_pools: msgs[%u]->data[%u]=%u corrupted\n", ldr(), i, j, msgs[i]->data[j]);
+        error |= true;
+        break;
+      }
+    }
+  }
+  if (MsgPool_get_msg_sized(&pools, 4097) != NULL) {
+    printf(LDR "sized_pools: expected size 4097 to fail\n", ldr());
+    error |= true;
+  }
+
+  // Two of the 64 byte class are in use, when it's empty the 256 byte class is used
+  for (uint32_t i = size_count; i < size_count + msg_count; i++) {
+    msgs[i] = MsgPool_get_msg_sized(&pools, 8);
+    got += (msgs[i] != NULL) ? 1 : 0;
+    uint32_t expected_size = (i < size_count + msg_count - 2) ? 64 : 256;
+    if ((msgs[i] == NULL) || (MsgPool_data_size(msgs[i]) != expected_size)) {
+      printf(LDR "sized_pools: msgs[%u] expected data_size=%u\n", ldr(), i, expected_size);
+      error |= true;
+      goto done;
+    }
+  }
+
+done:
+  // Return them all so the pools can be deinitialized
+  for (uint32_t i = 0; i < got; i++) {
+    ret_msg(msgs[i]);
+  }
+  MsgPools_deinit(&pools);
+  printf(LDR "sized_pools:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool pool_slabs(void) {
+  bool error = false;
+  MsgPool_t pool;
+  const uint32_t msg_count = 0x100;
+  const uint32_t slab_msgs = 0x20;
+  Msg_t* msgs[msg_count];
+
+  printf(LDR "pool_slabs:+msg_count=%u slab_msgs=%u\n", ldr(), msg_count, slab_msgs);
+
+  if (MsgPool_init_slabs(&pool, msg_count, 0, slab_msgs)) {
+    printf(LDR "pool_slabs: MsgPool_init_slabs failed\n", ldr());
+    return true;
+  }
+  if (pool.msg_count != slab_msgs) {
+    printf(LDR "pool_slabs: expected msg_count=%u == slab_msgs\n", ldr(), pool.msg_count);
+    error |= true;
+  }
+
+  for (uint32_t round = 0; round < 2; round++) {
+    uint32_t got;
+    for (got = 0; got < msg_count; got++) {
+      msgs[got] = MsgPool_get_msg(&pool);
+      if (msgs[got] == NULL) {
+        printf(LDR "pool_slabs: round=%u get %u failed\n", ldr(), round, got);
+        error |= true;
+        break;
+      }
+    }
+    if ((pool.msg_count != msg_count) || (MsgPool_get_msg(&pool) != NULL)) {
+      printf(LDR "pool_slabs: round=%u expected msg_count=%u at max and empty\n", ldr(), round, pool.msg_count);
+      error |= true;
+    }
+
+    // Only the slab with a message in use is kept
+    for (uint32_t i = 1; i < got; i++) {
+      ret_msg(msgs[i]);
+    }
+    uint32_t freed = MsgPool_trim(&pool);
+    if ((freed != (msg_count / slab_msgs) - 1) || (pool.msg_count != slab_msgs)) {
+      printf(LDR "pool_slabs: round=%u freed=%u msg_count=%u\n", ldr(), round, freed, pool.msg_count);
+      error |= true;
+    }
+
+    // The last slab is kept even when it's idle
+    ret_msg(msgs[0]);
+    freed = MsgPool_trim(&pool);
+    if ((freed != 0) || (pool.msg_count != slab_msgs)) {
+      printf(LDR "pool_slabs: round=%u freed=%u msg_count=%u keep one slab\n", ldr(), round, freed, pool.msg_count);
+      error |= true;
+    }
+  }
+  MsgPool_deinit(&pool);
+
+  // A full first slab is loaded into the ring
+  if (MsgPool_init(&pool, 2 * MSG_POOL_SLAB_MSGS)) {
+    printf(LDR "pool_slabs: MsgPool_init failed\n", ldr());
+    return true;
+  }
+  if (pool.fifo.add_state != ADD_STATE_RB) {
+    printf(LDR "pool_slabs: expected a new pool's fifo to be in ADD_STATE_RB\n", ldr());
+    error |= true;
+  }
+  MsgPool_deinit(&pool);
+
+  printf(LDR "pool_slabs:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool bulk_load(void) {
+  bool error = false;
+  MpscFifo_t cmdFifo;
+  const uint32_t count = 12;
+  Cell_t cells[count + 1];
+  Msg_t msgs[count + 1];
+  Msg_t* pMsgs[count];
+
+  printf(LDR "bulk_load:+count=%u\n", ldr(), count);
+
+  for (uint32_t backend = 0; backend < 3; backend++) {
+    for (uint32_t i = 0; i <= count; i++) {
+      msgs[i].pCell = &cells[i];
+      msgs[i].pPool = NULL;
+      msgs[i].arg1 = i;
+      if (i < count) {
+        pMsgs[i] = &msgs[i];
+      }
+    }
+
+    // A ring of 4 so the rest are loaded into the link list
+    MpscFifo_t* pQ;
+    if (backend == MPSC_BACKEND_SEGMENTED) {
+      pQ = initMpscFifoSegmented(&cmdFifo);
+    } else if (backend == MPSC_BACKEND_FAA_LL) {
+      pQ = initMpscFifoFaa(&cmdFifo, 4);
+    } else {
+      pQ = initMpscFifoCapacity(&cmdFifo, 4);
+    }
+    if (pQ == NULL) {
+      printf(LDR "bulk_load: backend=%u init failed\n", ldr(), backend);
+      error |= true;
+      continue;
+    }
+    load_batch(&cmdFifo, pMsgs, count / 2);
+    load_batch(&cmdFifo, &pMsgs[count / 2], count / 2);
+    add(&cmdFifo, &msgs[count]);
+
+    for (uint32_t i = 0; i <= count; i++) {
+      Msg_t* pMsg = rmv(&cmdFifo);
+      if ((pMsg == NULL) || (pMsg->arg1 != i)) {
+        printf(LDR "bulk_load: backend=%u expected arg1=%u pMsg=%p\n", ldr(), backend, i, pMsg);
+        error |= true;
+        break;
+      }
+    }
+    if (rmv(&cmdFifo) != NULL) {
+      printf(LDR "bulk_load: backend=%u expected empty\n", ldr(), backend);
+      error |= true;
+    }
+    deinitMpscFifo(&cmdFifo);
+  }
+
+  printf(LDR "bulk_load:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+/**
+ * Sleep so the consumer parks and then add a value
+ */
+static void* delayed_add_value(void* p) {
+  MpscFifo_t* pFifo = (MpscFifo_t*)p;
+  struct timespec delay = { .tv_sec = 0, .tv_nsec = 20000000 };
+  nanosleep(&delay, NULL);
+  add_value(pFifo, 3, -3);
+  return NULL;
+}
+
+bool values(void) {
+  bool error = false;
+  MpscFifo_t cmdFifo;
+  Msg_t msg;
+  Cell_t cell;
+  pthread_t thread;
+  uint64_t arg1;
+  uint64_t arg2;
+  const uint32_t size = 4;
+
+  printf(LDR "values:+size=%u\n", ldr(), size);
+
+  msg.pCell = &cell;
+  initMpscFifo(&cmdFifo);
+  enable_rmv_wait(&cmdFifo, 10);
+  if (add_value(&cmdFifo, 1, -1)) {
+    printf(LDR "values: expected add_value to fail before enable_values\n", ldr());
+    error |= true;
+  }
+  if (!enable_values(&cmdFifo, size)) {
+    printf(LDR "values: enable_values failed\n", ldr());
+    deinitMpscFifo(&cmdFifo);
+    return true;
+  }
+
+  // Fill the ring, the next add fails and they come out in order
+  for (uint32_t i = 0; i < size; i++) {
+    if (!add_value(&cmdFifo, i, -i)) {
+      printf(LDR "values: add_value %u failed\n", ldr(), i);
+      error |= true;
+    }
+  }
+  if (add_value(&cmdFifo, size, -size)) {
+    printf(LDR "values: expected add_value to a full ring to fail\n", ldr());
+    error |= true;
+  }
+  for (uint32_t i = 0; i < size; i++) {
+    if (!rmv_value(&cmdFifo, &arg1, &arg2) || (arg1 != i) || (arg2 != (uint64_t)-i)) {
+      printf(LDR "values: expected arg1=%u got arg1=%lu arg2=%lu\n", ldr(), i, arg1, arg2);
+      error |= true;
+    }
+  }
+  if (rmv_value(&cmdFifo, &arg1, &arg2) || (rmv(&cmdFifo) != NULL)) {
+    printf(LDR "values: expected empty\n", ldr());
+    error |= true;
+  }
+
+  // Values are taken before messages
+  add(&cmdFifo, &msg);
+  add_value(&cmdFifo, 2, -2);
+  if ((wait_for_input(&cmdFifo, &arg1, &arg2) != NULL) || (arg1 != 2)
+      || (wait_for_input(&cmdFifo, &arg1, &arg2) != &msg)) {
+    printf(LDR "values: expected the value and then the msg\n", ldr());
+    error |= true;
+  }
+
+  printf(LDR "values: wait_for_input for a delayed add_value to cmdFifo=%p\n", ldr(), &cmdFifo);
+  if (pthread_create(&thread, NULL, delayed_add_value, &cmdFifo) != 0) {
+    printf(LDR "values: unable to create thread\n", ldr());
+    error |= true;
+  } else {
+    Msg_t* pMsg = wait_for_input(&cmdFifo, &arg1, &arg2);
+    pthread_join(thread, NULL);
+    if ((pMsg != NULL) || (arg1 != 3) || (arg2 != (uint64_t)-3)) {
+      printf(LDR "values: expected pMsg=%p == NULL arg1=%lu == 3\n", ldr(), pMsg, arg1);
+      error |= true;
+    }
+  }
+  deinitMpscFifo(&cmdFifo);
+
+  printf(LDR "values:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool multicasts(void) {
+  bool error = false;
+  MsgPool_t pool;
+  MsgPool_t handle_pool;
+  const uint32_t fifo_count = 3;
+  MpscFifo_t fifos[fifo_count];
+  MpscFifo_t* pFifos[fifo_count + 1];
+
+  printf(LDR "multicasts:+fifo_count=%u\n", ldr(), fifo_count);
+
+  // One message so we can see when it's returned
+  if (MsgPool_init(&pool, 1) || MsgPool_init(&handle_pool, fifo_count)) {
+    printf(LDR "multicasts: MsgPool_init failed\n", ldr());
+    return true;
+  }
+  for (uint32_t i = 0; i < fifo_count; i++) {
+    initMpscFifo(&fifos[i]);
+    pFifos[i] = &fifos[i];
+  }
+  pFifos[fifo_count] = &fifos[0];
+
+  Msg_t* pMsg = MsgPool_get_msg(&pool);
+  pMsg->arg1 = 1;
+  pMsg->arg2 = -1;
+  pMsg->id = 1;
+  uint32_t sent = multicast(&handle_pool, pMsg, pFifos, fifo_count);
+  if (sent != fifo_count) {
+    printf(LDR "multicasts: expected sent=%u == %u\n", ldr(), sent, fifo_count);
+    error |= true;
+  }
+
+  // The parent is returned with the last handle
+  for (uint32_t i = 0; i < fifo_count; i++) {
+    Msg_t* pHandle = rmv(&fifos[i]);
+    if ((pHandle == NULL) || (pHandle->pParent != pMsg) || (pHandle->arg1 != 1)
+        || (pHandle->arg2 != (uint64_t)-1) || (pHandle->id != 0)) {
+      printf(LDR "multicasts: fifos[%u] bad handle=%p\n", ldr(), i, pHandle);
+      error |= true;
+      continue;
+    }
+    ret_msg(pHandle);
+    Msg_t* pGot = MsgPool_get_msg(&pool);
+    if ((pGot != NULL) != (i == (fifo_count - 1))) {
+      printf(LDR "multicasts: i=%u expected parent returned only after last handle\n", ldr(), i);
+      error |= true;
+    }
+    if (pGot != NULL) {
+      pMsg = pGot;
+    }
+  }
+
+  // Out of handles, only fifo_count are sent and the parent is still
+  // returned after the last one
+  sent = multicast(&handle_pool, pMsg, pFifos, fifo_count + 1);
+  if (sent != fifo_count) {
+    printf(LDR "multicasts: expected sent=%u == %u when out of handles\n", ldr(), sent, fifo_count);
+    error |= true;
+  }
+  for (uint32_t i = 0; i < sent; i++) {
+    Msg_t* pHandle = rmv(&fifos[i]);
+    if (pHandle != NULL) {
+      ret_msg(pHandle);
+    }
+  }
+  pMsg = MsgPool_get_msg(&pool);
+  if (pMsg == NULL) {
+    printf(LDR "multicasts: expected parent returned\n", ldr());
+    error |= true;
+  }
+
+  // Nothing sent, the parent is returned now
+  sent = multicast(&handle_pool, pMsg, pFifos, 0);
+  if ((sent != 0) || ((pMsg = MsgPool_get_msg(&pool)) == NULL)) {
+    printf(LDR "multicasts: expected sent=%u == 0 and parent returned\n", ldr(), sent);
+    error |= true;
+  }
+  ret_msg(pMsg);
+
+  for (uint32_t i = 0; i < fifo_count; i++) {
+    deinitMpscFifo(&fifos[i]);
+  }
+  MsgPool_deinit(&handle_pool);
+  MsgPool_deinit(&pool);
+
+  printf(LDR "multicasts:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+/**
+ * Record the response's arg1 in the uint64_t ctx points at.
+ */
+static void rpc_record(void* ctx, Msg_t* pRsp) {
+  *(uint64_t*)ctx = pRsp->arg1;
+}
+
+bool rpcs(void) {
+  bool error = false;
+  MsgPool_t pool;
+  MpscFifo_t reqQ;
+  MpscFifo_t rspQ;
+  RpcTable_t rpc;
+  const uint32_t size = 4;
+  uint64_t rsps[size + 1];
+  Msg_t* reqs[size];
+
+  printf(LDR "rpcs:+size=%u\n", ldr(), size);
+
+  if (MsgPool_init(&pool, size + 1)) {
+    printf(LDR "rpcs: MsgPool_init failed\n", ldr());
+    return true;
+  }
+  initMpscFifo(&reqQ);
+  initMpscFifo(&rspQ);
+  if (rpc_init(&rpc, &rspQ, 3) != NULL) {
+    printf(LDR "rpcs: expected rpc_init to fail if size isn't a power of 2\n", ldr());
+    error |= true;
+  }
+  rpc_init(&rpc, &rspQ, size);
+
+  // Fill the table, the next send fails
+  for (uint32_t i = 0; i < size; i++) {
+    Msg_t* pMsg = MsgPool_get_msg(&pool);
+    pMsg->arg1 = i;
+    rsps[i] = 0;
+    if (rpc_send(&rpc, &reqQ, pMsg, rpc_record, &rsps[i]) != (i + 1)) {
+      printf(LDR "rpcs: expected id=%u\n", ldr(), i + 1);
+      error |= true;
+    }
+  }
+  Msg_t* pExtra = MsgPool_get_msg(&pool);
+  if ((rpc_send(&rpc, &reqQ, pExtra, rpc_record, &rsps[size]) != 0) || (rpc_outstanding(&rpc) != size)) {
+    printf(LDR "rpcs: expected send to a full table to fail\n", ldr());
+    error |= true;
+  }
+
+  // Respond in reverse order, each is completed with its own callback
+  for (uint32_t i = 0; i < size; i++) {
+    reqs[i] = rmv(&reqQ);
+  }
+  for (uint32_t i = size; i > 0; i--) {
+    send_rsp_or_ret(reqs[i - 1], 100 + reqs[i - 1]->arg1);
+  }
+  if ((rpc_poll(&rpc) != size) || (rpc_outstanding(&rpc) != 0)) {
+    printf(LDR "rpcs: expected all %u completed\n", ldr(), size);
+    error |= true;
+  }
+  for (uint32_t i = 0; i < size; i++) {
+    if (rsps[i] != (100 + i)) {
+      printf(LDR "rpcs: rsps[%u]=%lu expected %u\n", ldr(), i, rsps[i], 100 + i);
+      error |= true;
+    }
+  }
+
+  // Keep id 5 outstanding, the ids of later requests skip its slot
+  // and a response with an id that isn't outstanding is unmatched
+  uint64_t first = rpc_send(&rpc, &reqQ, pExtra, rpc_record, &rsps[size]);
+  Msg_t* pFirst = rmv(&reqQ);
+  for (uint32_t i = 0; i < size; i++) {
+    rpc_send(&rpc, &reqQ, MsgPool_get_msg(&pool), NULL, NULL);
+    Msg_t* pMsg = rmv(&reqQ);
+    if ((pMsg->id & (size - 1)) == (first & (size - 1))) {
+      printf(LDR "rpcs: id=%lu uses the slot of outstanding id=%lu\n", ldr(), pMsg->id, first);
+      error |= true;
+    }
+    send_rsp_or_ret(pMsg, 0);
+    rpc_poll(&rpc);
+  }
+  Msg_t* pStale = MsgPool_get_msg(&pool);
+  pStale->id = first + 1;
+  pStale->pRspQ = &rspQ;
+  send_rsp_or_ret(pStale, 0);
+  send_rsp_or_ret(pFirst, 200);
+  if ((rpc_wait_all(&rpc) != 1) || (rsps[size] != 200) || (rpc.unmatched != 1)) {
+    printf(LDR "rpcs: expected id=%lu completed and one unmatched\n", ldr(), first);
+    error |= true;
+  }
+
+  if (rpc_deinit(&rpc) != (2 * size) + 1) {
+    printf(LDR "rpcs: expected %u completed\n", ldr(), (2 * size) + 1);
+    error |= true;
+  }
+  deinitMpscFifo(&rspQ);
+  deinitMpscFifo(&reqQ);
+  MsgPool_deinit(&pool);
+
+  printf(LDR "rpcs:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool credits(void) {
+  bool error = false;
+  MsgPool_t pool;
+  MpscFifo_t fifo;
+  MpscFifo_t rspQ;
+  const uint32_t limit = 2;
+
+  printf(LDR "credits:+limit=%u\n", ldr(), limit);
+
+  if (MsgPool_init(&pool, limit + 1)) {
+    printf(LDR "credits: MsgPool_init failed\n", ldr());
+    return true;
+  }
+  initMpscFifo(&fifo);
+  initMpscFifo(&rspQ);
+
+  // Without credits try_add is add
+  Msg_t* pMsg = MsgPool_get_msg(&pool);
+  if (!try_add(&fifo, pMsg) || (pMsg->pCreditQ != NULL)) {
+    printf(LDR "credits: expected try_add without credits to add\n", ldr());
+    error |= true;
+  }
+  ret_msg(rmv(&fifo));
+
+  // The limit is reached and the next try_add is refused
+  enable_credits(&fifo, limit);
+  for (uint32_t i = 0; i < limit; i++) {
+    pMsg = MsgPool_get_msg(&pool);
+    if (!try_add(&fifo, pMsg) || (pMsg->pCreditQ != &fifo)) {
+      printf(LDR "credits: i=%u expected try_add to take a credit\n", ldr(), i);
+      error |= true;
+    }
+  }
+  Msg_t* pExtra = MsgPool_get_msg(&pool);
+  if (try_add(&fifo, pExtra) || (fifo.credits != 0)) {
+    printf(LDR "credits: expected try_add to be refused credits=%d\n", ldr(), fifo.credits);
+    error |= true;
+  }
+
+  // Removing doesn't return a credit, responding and returning do
+  Msg_t* pFirst = rmv(&fifo);
+  if (try_add(&fifo, pExtra)) {
+    printf(LDR "credits: expected try_add to be refused until the consumer is done\n", ldr());
+    error |= true;
+  }
+  pFirst->pRspQ = &rspQ;
+  send_rsp_or_ret(pFirst, 1);
+  if ((fifo.credits != 1) || (pFirst->pCreditQ != NULL)) {
+    printf(LDR "credits: expected send_rsp_or_ret to return a credit credits=%d\n", ldr(), fifo.credits);
+    error |= true;
+  }
+  ret_msg(rmv(&fifo));
+  if (fifo.credits != (int32_t)limit) {
+    printf(LDR "credits: expected ret_msg to return a credit credits=%d\n", ldr(), fifo.credits);
+    error |= true;
+  }
+  if (!try_add(&fifo, pExtra)) {
+    printf(LDR "credits: expected try_add to add once credits are returned\n", ldr());
+    error |= true;
+  }
+  ret_msg(rmv(&fifo));
+
+  // Forwarding with try_add gives back the credit of the first fifo
+  enable_credits(&rspQ, limit);
+  pMsg = MsgPool_get_msg(&pool);
+  if (!try_add(&fifo, pMsg) || (rmv(&fifo) != pMsg) || !try_add(&rspQ, pMsg)
+      || (fifo.credits != (int32_t)limit) || (rspQ.credits != (int32_t)(limit - 1))
+      || (pMsg->pCreditQ != &rspQ)) {
+    printf(LDR "credits: expected forwarding to move the credit credits=%d rspQ.credits=%d\n",
+        ldr(), fifo.credits, rspQ.credits);
+    error |= true;
+  }
+  ret_msg(rmv(&rspQ));
+  ret_msg(rmv(&rspQ));
+  if (rspQ.credits != (int32_t)limit) {
+    printf(LDR "credits: expected rspQ credits=%d returned\n", ldr(), rspQ.credits);
+    error |= true;
+  }
+
+  deinitMpscFifo(&rspQ);
+  deinitMpscFifo(&fifo);
+  MsgPool_deinit(&pool);
+
+  printf(LDR "credits:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool fifo_sets(void) {
+  bool error = false;
+  MpscFifoSet_t set;
+  const uint32_t fifo_count = 3;
+  const uint32_t per_fifo = 4;
+  MpscFifo_t fifos[fifo_count];
+  Msg_t msgs[fifo_count * per_fifo];
+  Cell_t cells[fifo_count * per_fifo];
+  pthread_t thread;
+  uint32_t idx;
+  Msg_t msg;
+  Cell_t cell;
+
+  printf(LDR "fifo_sets:+fifo_count=%u\n", ldr(), fifo_count);
+
+  fs_init(&set, 10);
+  for (uint32_t i = 0; i < fifo_count; i++) {
+    initMpscFifo(&fifos[i]);
+    if (fs_register(&set, &fifos[i], (i == 0) ? 2 : 1) != (int32_t)i) {
+      printf(LDR "fifo_sets: expected fifos[%u] to be registered\n", ldr(), i);
+      error |= true;
+    }
+  }
+  if (fs_register(&set, &fifos[0], 0) != -1) {
+    printf(LDR "fifo_sets: expected weight 0 to be refused\n", ldr());
+    error |= true;
+  }
+
+  // fifos[0] has weight 2 so two of its messages are removed each round
+  for (uint32_t i = 0; i < fifo_count * per_fifo; i++) {
+    msgs[i].pCell = &cells[i];
+    msgs[i].arg1 = i % fifo_count;
+    add(&fifos[i % fifo_count], &msgs[i]);
+  }
+  const uint32_t expected[] = { 0, 0, 1, 2, 0, 0, 1, 2, 1, 2, 1, 2 };
+  for (uint32_t i = 0; i < fifo_count * per_fifo; i++) {
+    Msg_t* pMsg = fs_rmv(&set, &idx);
+    if ((pMsg == NULL) || (idx != expected[i]) || (pMsg->arg1 != idx)) {
+      printf(LDR "fifo_sets: i=%u pMsg=%p idx=%u expected %u\n", ldr(), i, pMsg, idx, expected[i]);
+      error |= true;
+    }
+  }
+  if (fs_rmv(&set, &idx) != NULL) {
+    printf(LDR "fifo_sets: expected empty\n", ldr());
+    error |= true;
+  }
+
+  // A fifo with only a value stays ready after fs_rmv
+  uint64_t arg1;
+  uint64_t arg2;
+  enable_values(&fifos[1], 4);
+  add_value(&fifos[1], 1, -1);
+  if (fs_rmv(&set, &idx) != NULL) {
+    printf(LDR "fifo_sets: expected no messages with only a value\n", ldr());
+    error |= true;
+  }
+  uint64_t bits = fs_wait_any(&set);
+  if ((bits != (1ULL << 1)) || !rmv_value(&fifos[1], &arg1, &arg2) || (arg1 != 1)) {
+    printf(LDR "fifo_sets: bits=0x%lx expected 0x2 with a value\n", ldr(), bits);
+    error |= true;
+  }
+
+  // Only the fifo added to is ready
+  add(&fifos[2], &msgs[0]);
+  bits = fs_wait_any(&set);
+  if ((bits != (1ULL << 2)) || (rmv(&fifos[2]) != &msgs[0])) {
+    printf(LDR "fifo_sets: bits=0x%lx expected 0x4\n", ldr(), bits);
+    error |= true;
+  }
+
+  // The consumer parks and is woken by an add from another thread
+  msg.pCell = &cell;
+  msg.arg1 = 3;
+  DelayedAddParams dp = { .pFifo = &fifos[1], .pMsg = &msg };
+  if (pthread_create(&thread, NULL, delayed_add, &dp) != 0) {
+    printf(LDR "fifo_sets: unable to create thread\n", ldr());
+    error |= true;
+  } else {
+    Msg_t* pMsg = fs_rmv_wait(&set, &idx);
+    pthread_join(thread, NULL);
+    if ((pMsg == NULL) || (idx != 1) || (pMsg->arg1 != 3)) {
+      printf(LDR "fifo_sets: expected pMsg=%p from fifos[1] idx=%u\n", ldr(), pMsg, idx);
+      error |= true;
+    }
+  }
+
+  fs_deinit(&set);
+  for (uint32_t i = 0; i < fifo_count; i++) {
+    deinitMpscFifo(&fifos[i]);
+  }
+
+  printf(LDR "fifo_sets:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+bool prio_fifos(void) {
+  bool error = false;
+  MpscPrioFifo_t pq;
+  const uint32_t level_count = 3;
+  const uint32_t bulk_count = 4;
+  Msg_t msgs[bulk_count + 2];
+  Cell_t cells[bulk_count + 2];
+  Msg_t* batch[bulk_count + 2];
+  pthread_t thread;
+  uint32_t prio;
+  uint64_t arg1;
+  uint64_t arg2;
+
+  printf(LDR "prio_fifos:+level_count=%u\n", ldr(), level_count);
+
+  if (pq_init(&pq, PQ_MAX_LEVELS + 1, 10) != NULL) {
+    printf(LDR "prio_fifos: expected pq_init to fail with too many levels\n", ldr());
+    error |= true;
+  }
+  pq_init(&pq, level_count, 10);
+  for (uint32_t i = 0; i < bulk_count + 2; i++) {
+    msgs[i].pCell = &cells[i];
+    msgs[i].arg1 = i;
+  }
+
+  // Urgent messages added after the bulk ones overtake them
+  for (uint32_t i = 0; i < bulk_count; i++) {
+    pq_add(&pq, 2, &msgs[i]);
+  }
+  pq_add(&pq, 1, &msgs[bulk_count]);
+  pq_add(&pq, 0, &msgs[bulk_count + 1]);
+  Msg_t* pMsg = pq_rmv(&pq, &prio);
+  if ((pMsg != &msgs[bulk_count + 1]) || (prio != 0)) {
+    printf(LDR "prio_fifos: expected level 0 first pMsg=%p prio=%u\n", ldr(), pMsg, prio);
+    error |= true;
+  }
+
+  // A batch doesn't mix levels
+  uint32_t cnt = pq_rmv_batch(&pq, batch, bulk_count + 2);
+  if ((cnt != 1) || (batch[0] != &msgs[bulk_count])) {
+    printf(LDR "prio_fifos: expected only level 1 cnt=%u\n", ldr(), cnt);
+    error |= true;
+  }
+  cnt = pq_rmv_batch(&pq, batch, bulk_count + 2);
+  if (cnt != bulk_count) {
+    printf(LDR "prio_fifos: expected cnt=%u == %u\n", ldr(), cnt, bulk_count);
+    error |= true;
+  }
+  for (uint32_t i = 0; i < cnt; i++) {
+    if (batch[i] != &msgs[i]) {
+      printf(LDR "prio_fifos: level 2 batch[%u]=%p out of order\n", ldr(), i, batch[i]);
+      error |= true;
+    }
+  }
+  if (pq_rmv(&pq, &prio) != NULL) {
+    printf(LDR "prio_fifos: expected empty\n", ldr());
+    error |= true;
+  }
+
+  // A level with only values stays ready until they're removed
+  enable_values(pq_level(&pq, 1), 4);
+  add_value(pq_level(&pq, 1), 1, -1);
+  if (pq_rmv(&pq, &prio) != NULL) {
+    printf(LDR "prio_fifos: expected no messages with only a value\n", ldr());
+    error |= true;
+  }
+  pq_wait(&pq);
+  if (!rmv_value(pq_level(&pq, 1), &arg1, &arg2) || (arg1 != 1)) {
+    printf(LDR "prio_fifos: expected value arg1=%lu == 1\n", ldr(), arg1);
+    error |= true;
+  }
+  if (pq_rmv(&pq, &prio) != NULL) {
+    printf(LDR "prio_fifos: expected empty after removing the value\n", ldr());
+    error |= true;
+  }
+
+  // pq_rmv_wait returns messages before values
+  add_value(pq_level(&pq, 1), 2, -2);
+  pq_add(&pq, 2, &msgs[0]);
+  pMsg = pq_rmv_wait(&pq, &prio, &arg1, &arg2);
+  if ((pMsg != &msgs[0]) || (prio != 2)) {
+    printf(LDR "prio_fifos: expected pq_rmv_wait pMsg=%p from level 2 prio=%u\n", ldr(), pMsg, prio);
+    error |= true;
+  }
+  pMsg = pq_rmv_wait(&pq, &prio, &arg1, &arg2);
+  if ((pMsg != NULL) || (prio != 1) || (arg1 != 2)) {
+    printf(LDR "prio_fifos: expected pq_rmv_wait value arg1=%lu == 2 prio=%u\n", ldr(), arg1, prio);
+    error |= true;
+  }
+
+  // The consumer parks and is woken by an add to any level
+  DelayedAddParams dp = { .pFifo = pq_level(&pq, 2), .pMsg = &msgs[0] };
+  if (pthread_create(&thread, NULL, delayed_add, &dp) != 0) {
+    printf(LDR "prio_fifos: unable to create thread\n", ldr());
+    error |= true;
+  } else {
+    pMsg = pq_rmv_wait(&pq, &prio, &arg1, &arg2);
+    pthread_join(thread, NULL);
+    if ((pMsg != &msgs[0]) || (prio != 2)) {
+      printf(LDR "prio_fifos: expected pMsg=%p from level 2 prio=%u\n", ldr(), pMsg, prio);
+      error |= true;
+    }
+  }
+
+  pq_deinit(&pq);
+
+  printf(LDR "prio_fifos:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
 bool perf(const uint64_t loops) {
   bool error = false;
   struct timespec time_start;
@@ -210,21 +1861,349 @@ bool perf(const uint64_t loops) {
   return error;
 }
 
+bool perf_batch(const uint64_t loops) {
+  bool error = false;
+  struct timespec time_start;
+  struct timespec time_stop;
+  MpscFifo_t cmdFifo;
+  Cell_t cells[16];
+  Msg_t msgs[16];
+  Msg_t* msg_ptrs[16];
+  const uint32_t batch_size = sizeof(msgs) / sizeof(msgs[0]);
+
+  printf(LDR "perf_batch:+loops=%lu batch_size=%u\n", ldr(), loops, batch_size);
+
+  for (uint32_t i = 0; i < batch_size; i++) {
+    msgs[i].pCell = &cells[i];
+    msgs[i].pPool = NULL;
+    msgs[i].arg1 = i;
+    msg_ptrs[i] = &msgs[i];
+  }
+
+  printf(LDR "perf_batch: init cmdFifo=%p\n", ldr(), &cmdFifo);
+  initMpscFifo(&cmdFifo);
+
+  uint64_t batch_loops = loops / batch_size;
+  clock_gettime(CLOCK_REALTIME, &time_start);
+  for (uint64_t i = 0; i < batch_loops; i++) {
+    add_batch(&cmdFifo, msg_ptrs, batch_size);
+    rmv_batch(&cmdFifo, msg_ptrs, batch_size);
+  }
+  clock_gettime(CLOCK_REALTIME, &time_stop);
+
+  uint64_t processed = batch_loops * batch_size;
+  double processing_ns = diff_timespec_ns(&time_stop, &time_start);
+  printf(LDR "perf_batch: add_batch rmv_batch processing=%.3fs\n", ldr(), processing_ns / ns_flt);
+  double ops_per_sec = (processed * ns_flt) / processing_ns;
+  printf(LDR "perf_batch: add_batch rmv_batch ops_per_sec=%.3f\n", ldr(), ops_per_sec);
+  double ns_per_op = (float)processing_ns / (double)processed;
+  printf(LDR "perf_batch: add_batch rmv_batch   ns_per_op=%.1fns\n", ldr(), ns_per_op);
+
+  if (rmv(&cmdFifo) != NULL) {
+    printf(LDR "perf_batch: expected cmdFifo=%p to be empty\n", ldr(), &cmdFifo);
+    error |= true;
+  }
+  deinitMpscFifo(&cmdFifo);
+  printf(LDR "perf_batch:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+/**
+ * Compare multicast with sending each fifo its own copy, for a
+ * message with no data and one with data_size bytes.
+ */
+static double perf_multicast_ns(MsgPool_t* pool, MsgPool_t* handle_pool, MpscFifo_t** pFifos,
+    uint32_t fifo_count, uint32_t data_size, bool copies, uint64_t loops, bool* pError) {
+  struct timespec time_start;
+  struct timespec time_stop;
+
+  clock_gettime(CLOCK_REALTIME, &time_start);
+  for (uint64_t i = 0; i < loops; i++) {
+    Msg_t* pMsg = MsgPool_get_msg(pool);
+    if (pMsg == NULL) {
+      *pError = true;
+      return 0;
+    }
+    pMsg->arg1 = i;
+    memset(pMsg->data, (int)i, data_size);
+    if (copies) {
+      add(pFifos[0], pMsg);
+      for (uint32_t f = 1; f < fifo_count; f++) {
+        Msg_t* pCopy = MsgPool_get_msg(pool);
+        if (pCopy == NULL) {
+          *pError = true;
+          return 0;
+        }
+        pCopy->arg1 = pMsg->arg1;
+        memcpy(pCopy->data, pMsg->data, data_size);
+        add(pFifos[f], pCopy);
+      }
+    } else if (multicast(handle_pool, pMsg, pFifos, fifo_count) != fifo_count) {
+      *pError = true;
+    }
+    for (uint32_t f = 0; f < fifo_count; f++) {
+      Msg_t* pGot = rmv(pFifos[f]);
+      if ((pGot == NULL) || (pGot->arg1 != i)) {
+        *pError = true;
+        continue;
+      }
+      ret_msg(pGot);
+    }
+  }
+  clock_gettime(CLOCK_REALTIME, &time_stop);
+
+  return diff_timespec_ns(&time_stop, &time_start) / (double)(loops * fifo_count);
+}
+
+bool perf_multicast(const uint64_t loops) {
+  bool error = false;
+  const uint32_t fifo_count = 8;
+  const uint32_t data_sizes[] = { 0, 256, 1024, 4096, 16384 };
+  MpscFifo_t fifos[fifo_count];
+  MpscFifo_t* pFifos[fifo_count];
+  MsgPool_t handle_pool;
+
+  printf(LDR "perf_multicast:+loops=%lu fifo_count=%u\n", ldr(), loops, fifo_count);
+
+  if (MsgPool_init(&handle_pool, fifo_count)) {
+    printf(LDR "perf_multicast: MsgPool_init failed\n", ldr());
+    return true;
+  }
+  for (uint32_t f = 0; f < fifo_count; f++) {
+    initMpscFifo(&fifos[f]);
+    pFifos[f] = &fifos[f];
+  }
+
+  uint64_t send_loops = (loops + fifo_count - 1) / fifo_count;
+  for (uint32_t s = 0; s < sizeof(data_sizes) / sizeof(data_sizes[0]); s++) {
+    MsgPool_t pool;
+    if (MsgPool_init_sized(&pool, fifo_count, data_sizes[s])) {
+      printf(LDR "perf_multicast: MsgPool_init_sized failed\n", ldr());
+      error |= true;
+      break;
+    }
+    // Warm up the pools and fifos first
+    perf_multicast_ns(&pool, &handle_pool, pFifos, fifo_count, data_sizes[s], true, 16, &error);
+    perf_multicast_ns(&pool, &handle_pool, pFifos, fifo_count, data_sizes[s], false, 16, &error);
+    double copies_ns = perf_multicast_ns(&pool, &handle_pool, pFifos, fifo_count,
+        data_sizes[s], true, send_loops, &error);
+    double multicast_ns = perf_multicast_ns(&pool, &handle_pool, pFifos, fifo_count,
+        data_sizes[s], false, send_loops, &error);
+    printf(LDR "perf_multicast: data_size=%u copies ns_per_fifo=%.1fns multicast ns_per_fifo=%.1fns\n",
+        ldr(), data_sizes[s], copies_ns, multicast_ns);
+    MsgPool_deinit(&pool);
+  }
+
+  for (uint32_t f = 0; f < fifo_count; f++) {
+    deinitMpscFifo(&fifos[f]);
+  }
+  MsgPool_deinit(&handle_pool);
+  printf(LDR "perf_multicast:-error=%u\n\n", ldr(), error);
+
+  return error;
+}
+
+typedef struct ProducerParams {
+  pthread_t thread;
+  MpscFifo_t* pFifo;
+  MsgPool_t pool;
+  uint64_t loops;
+  uint64_t no_msgs;
+} ProducerParams;
+
+/**
+ * Add loops messages from the producers pool to pFifo
+ */
+static void* producer(void* p) {
+  ProducerParams* pp = (ProducerParams*)p;
+  MsgPool_set_owner(&pp->pool);
+
+  for (uint64_t i = 0; i < pp->loops; i++) {
+    Msg_t* msg;
+    while ((msg = MsgPool_get_msg(&pp->pool)) == NULL) {
+      pp->no_msgs += 1;
+      sched_yield();
+    }
+    msg->arg1 = i;
+    add(pp->pFifo, msg);
+  }
+  return NULL;
+}
+
+static const char* backend_names[] = { "rb_ll", "segmented", "faa_ll" };
+
+/**
+ * Multiple producers adding to one consumer, useful with perf c2c
+ * to see the false sharing between producers and the consumer,
+ * see "make c2c". backend is one of the MPSC_BACKEND_xxx and
+ * *pOpsPerSec is the throughput.
+ */
+bool perf_mp(const uint32_t producer_count, const uint64_t loops, const uint32_t backend,
+    double* pOpsPerSec) {
+  bool error = false;
+  struct timespec time_start;
+  struct timespec time_stop;
+  MpscFifo_t cmdFifo;
+  const uint32_t msg_count = 0x100;
+
+  printf(LDR "perf_mp:+producer_count=%u loops=%lu backend=%s\n", ldr(), producer_count, loops,
+      backend_names[backend]);
+  *pOpsPerSec = 0;
+
+  ProducerParams* producers = calloc(producer_count, sizeof(ProducerParams));
+  if (producers == NULL) {
+    printf(LDR "perf_mp: unable to allocate producers\n", ldr());
+    return true;
+  }
+
+  switch (backend) {
+    case (MPSC_BACKEND_SEGMENTED): initMpscFifoSegmented(&cmdFifo); break;
+    case (MPSC_BACKEND_FAA_LL): initMpscFifoFaa(&cmdFifo, 0x100); break;
+    default: initMpscFifo(&cmdFifo); break;
+  }
+  for (uint32_t i = 0; i < producer_count; i++) {
+    producers[i].pFifo = &cmdFifo;
+    producers[i].loops = loops;
+    producers[i].no_msgs = 0;
+    if (MsgPool_init(&producers[i].pool, msg_count)) {
+      printf(LDR "perf_mp: unable to init pool %u\n", ldr(), i);
+      error |= true;
+    }
+  }
+  if (error) {
+    goto done;
+  }
+
+  clock_gettime(CLOCK_REALTIME, &time_start);
+  for (uint32_t i = 0; i < producer_count; i++) {
+    if (pthread_create(&producers[i].thread, NULL, producer, &producers[i]) != 0) {
+      printf(LDR "perf_mp: unable to create producer %u\n", ldr(), i);
+      CRASH();
+    }
+  }
+
+  uint64_t expected = loops * producer_count;
+  for (uint64_t received = 0; received < expected; ) {
+    Msg_t* msg = rmv(&cmdFifo);
+    if (msg == NULL) {
+      // Give the producers back the messages we've buffered
+      MsgPool_flush();
+      sched_yield();
+      continue;
+    }
+    received += 1;
+    ret_msg(msg);
+  }
+  clock_gettime(CLOCK_REALTIME, &time_stop);
+
+  uint64_t no_msgs = 0;
+  for (uint32_t i = 0; i < producer_count; i++) {
+    pthread_join(producers[i].thread, NULL);
+    no_msgs += producers[i].no_msgs;
+  }
+
+  double processing_ns = diff_timespec_ns(&time_stop, &time_start);
+  printf(LDR "perf_mp: producers=%u processing=%.3fs no_msgs=%lu\n", ldr(), producer_count, processing_ns / ns_flt, no_msgs);
+  double ops_per_sec = (expected * ns_flt) / processing_ns;
+  printf(LDR "perf_mp: producers=%u ops_per_sec=%.3f\n", ldr(), producer_count, ops_per_sec);
+  double ns_per_op = (float)processing_ns / (double)expected;
+  printf(LDR "perf_mp: producers=%u   ns_per_op=%.1fns\n", ldr(), producer_count, ns_per_op);
+  *pOpsPerSec = ops_per_sec;
+
+done:
+  for (uint32_t i = 0; i < producer_count; i++) {
+    MsgPool_deinit(&producers[i].pool);
+  }
+  deinitMpscFifo(&cmdFifo);
+  free(producers);
+
+  printf(LDR "perf_mp:-error=%u\n\n", ldr(), error);
+  return error;
+}
+
+/**
+ * Contention benchmark, the throughput of each backend with
+ * 1 to max_producers producers.
+ */
+bool perf_mp_sweep(const uint32_t max_producers, const uint64_t loops) {
+  bool error = false;
+  const uint32_t backends[] = { MPSC_BACKEND_RB_LL, MPSC_BACKEND_FAA_LL, MPSC_BACKEND_SEGMENTED };
+  const uint32_t backend_count = sizeof(backends) / sizeof(backends[0]);
+  double* ops_per_sec = calloc(max_producers * backend_count, sizeof(double));
+  if (ops_per_sec == NULL) {
+    printf(LDR "perf_mp_sweep: unable to allocate results\n", ldr());
+    return true;
+  }
+
+  for (uint32_t p = 1; p <= max_producers; p++) {
+    for (uint32_t b = 0; b < backend_count; b++) {
+      error |= perf_mp(p, loops, backends[b], &ops_per_sec[((p - 1) * backend_count) + b]);
+    }
+  }
+
+  printf(LDR "perf_mp_sweep: producers", ldr());
+  for (uint32_t b = 0; b < backend_count; b++) {
+    printf(" %14s", backend_names[backends[b]]);
+  }
+  printf("\n");
+  for (uint32_t p = 1; p <= max_producers; p++) {
+    printf(LDR "perf_mp_sweep: %9u", ldr(), p);
+    for (uint32_t b = 0; b < backend_count; b++) {
+      printf(" %14.0f", ops_per_sec[((p - 1) * backend_count) + b]);
+    }
+    printf("\n");
+  }
+  printf("\n");
+
+  free(ops_per_sec);
+  return error;
+}
+
 int main(int argc, char* argv[]) {
   bool error = false;
 
-  if (argc != 2) {
+  if ((argc != 2) && (argc != 3)) {
     printf("Usage:\n");
-    printf(" %s loops\n", argv[0]);
+    printf(" %s loops [producer_count]\n", argv[0]);
     return 1;
   }
 
   u_int64_t loops;
   sscanf(argv[1], "%lu", &loops);
-  printf("test loops=%lu\n", loops);
+  u_int32_t producer_count = 0;
+  if (argc == 3) {
+    sscanf(argv[2], "%u", &producer_count);
+  }
+  printf("test loops=%lu producer_count=%u\n", loops, producer_count);
 
   error |= simple();
+  error |= non_stalling();
+  error |= batch();
+  error |= adaptive();
+  error |= segmented();
+  error |= faa();
+  error |= lanes();
+  error |= waiting();
+  error |= backoffs();
+  error |= mode_policy();
+  error |= quiescence();
+  error |= pool_magazine();
+  error |= sized_pools();
+  error |= pool_slabs();
+  error |= bulk_load();
+  error |= values();
+  error |= multicasts();
+  error |= rpcs();
+  error |= credits();
+  error |= fifo_sets();
+  error |= prio_fifos();
   error |= perf(loops);
+  error |= perf_batch(loops);
+  error |= perf_multicast(loops);
+  if (producer_count != 0) {
+    error |= perf_mp_sweep(producer_count, loops);
+  }
 
   if (!error) {
     printf("Success\n");
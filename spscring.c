@@ -0,0 +1,133 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A SpscRing is a wait free single producer single consumer
+ * ring buffer, see spscring.h.
+ */
+
+#define NDEBUG
+
+#define _DEFAULT_SOURCE
+
+#include "msg.h"
+#include "spscring.h"
+#include "dpf.h"
+
+#include <sys/types.h>
+#include <pthread.h>
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+/**
+ * @see spscring.h
+ */
+SpscRing_t* sr_init(SpscRing_t* pSr, uint32_t size) {
+  DPF(LDR "sr_init:+pSr=%p size=%u\n", ldr(), pSr, size);
+  if ((size == 0) || ((size & (size - 1)) != 0)) {
+    printf(LDR "sr_init:-pSr=%p size=%u not power of 2 return NULL\n", ldr(), pSr, size);
+    return NULL;
+  }
+  pSr->ring = malloc(size * sizeof(pSr->ring[0]));
+  if (pSr->ring == NULL) {
+    printf(LDR "sr_init:-pSr=%p size=%u could not allocate ring return NULL\n", ldr(), pSr, size);
+    return NULL;
+  }
+  pSr->add_idx = 0;
+  pSr->rmv_idx_cache = 0;
+  pSr->rmv_idx = 0;
+  pSr->add_idx_cache = 0;
+  pSr->msgs_processed = 0;
+  pSr->size = size;
+  pSr->mask = size - 1;
+  DPF(LDR "sr_init:-pSr=%p size=%u\n", ldr(), pSr, size);
+  return pSr;
+}
+
+/**
+ * @see spscring.h
+ */
+uint64_t sr_deinit(SpscRing_t* pSr) {
+  DPF(LDR "sr_deinit:+pSr=%p\n", ldr(), pSr);
+  uint64_t msgs_processed = pSr->msgs_processed;
+  free(pSr->ring);
+  pSr->ring = NULL;
+  pSr->add_idx = 0;
+  pSr->rmv_idx = 0;
+  pSr->size = 0;
+  pSr->mask = 0;
+  pSr->msgs_processed = 0;
+  DPF(LDR "sr_deinit:-pSr=%p msgs_processed=%lu\n", ldr(), pSr, msgs_processed);
+  return msgs_processed;
+}
+
+/**
+ * @see spscring.h
+ */
+bool sr_add(SpscRing_t* pSr, Msg_t* pMsg) {
+  DPF(LDR "sr_add:+pSr=%p pMsg=%p\n", ldr(), pSr, pMsg);
+  uint32_t pos = pSr->add_idx;
+
+  if ((pos - pSr->rmv_idx_cache) >= pSr->size) {
+    pSr->rmv_idx_cache = __atomic_load_n(&pSr->rmv_idx, __ATOMIC_ACQUIRE);
+    if ((pos - pSr->rmv_idx_cache) >= pSr->size) {
+      DPF(LDR "sr_add:-pSr=%p FULL pMsg=%p\n", ldr(), pSr, pMsg);
+      return false;
+    }
+  }
+  pSr->ring[pos & pSr->mask] = pMsg;
+  __atomic_store_n(&pSr->add_idx, pos + 1, __ATOMIC_RELEASE);
+
+  DPF(LDR "sr_add:-pSr=%p pMsg=%p\n", ldr(), pSr, pMsg);
+  return true;
+}
+
+/**
+ * @see spscring.h
+ */
+Msg_t* sr_rmv(SpscRing_t* pSr) {
+  DPF(LDR "sr_rmv:+pSr=%p\n", ldr(), pSr);
+  uint32_t pos = pSr->rmv_idx;
+
+  if (pos == pSr->add_idx_cache) {
+    pSr->add_idx_cache = __atomic_load_n(&pSr->add_idx, __ATOMIC_ACQUIRE);
+    if (pos == pSr->add_idx_cache) {
+      DPF(LDR "sr_rmv:-pSr=%p EMPTY\n", ldr(), pSr);
+      return NULL;
+    }
+  }
+  Msg_t* pMsg = pSr->ring[pos & pSr->mask];
+  __atomic_store_n(&pSr->rmv_idx, pos + 1, __ATOMIC_RELEASE);
+  pSr->msgs_processed += 1;
+
+  DPF(LDR "sr_rmv:-pSr=%p pMsg=%p\n", ldr(), pSr, pMsg);
+  return pMsg;
+}
+
+/**
+ * @see spscring.h
+ */
+uint32_t sr_rmv_batch(SpscRing_t* pSr, Msg_t** msgs, uint32_t max) {
+  DPF(LDR "sr_rmv_batch:+pSr=%p max=%u\n", ldr(), pSr, max);
+  uint32_t pos = pSr->rmv_idx;
+
+  uint32_t avail = pSr->add_idx_cache - pos;
+  if (avail < max) {
+    pSr->add_idx_cache = __atomic_load_n(&pSr->add_idx, __ATOMIC_ACQUIRE);
+    avail = pSr->add_idx_cache - pos;
+  }
+  uint32_t cnt = (avail < max) ? avail : max;
+  for (uint32_t i = 0; i < cnt; i++) {
+    msgs[i] = pSr->ring[(pos + i) & pSr->mask];
+  }
+  if (cnt != 0) {
+    __atomic_store_n(&pSr->rmv_idx, pos + cnt, __ATOMIC_RELEASE);
+    pSr->msgs_processed += cnt;
+  }
+
+  DPF(LDR "sr_rmv_batch:-pSr=%p cnt=%u\n", ldr(), pSr, cnt);
+  return cnt;
+}
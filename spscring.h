@@ -0,0 +1,78 @@
+/**
+ * This software is released into the public domain.
+ *
+ * A SpscRing is a wait free single producer single consumer
+ * ring buffer. The producer only writes add_idx and the consumer
+ * only writes rmv_idx so neither needs an atomic read modify
+ * write, each also keeps a cached copy of the other's index so
+ * it only reads the other's cache line when it appears full or
+ * empty.
+ */
+
+#ifndef COM_SAVILLE_SPSCRING_H
+#define COM_SAVILLE_SPSCRING_H
+
+#include "msg.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+
+typedef struct SpscRing_t {
+  // Written by the producer
+  uint32_t volatile add_idx CACHE_LINE_ALIGNED;
+  uint32_t rmv_idx_cache;
+
+  // Written by the consumer
+  uint32_t volatile rmv_idx CACHE_LINE_ALIGNED;
+  uint32_t add_idx_cache;
+  uint64_t msgs_processed;
+
+  // Read mostly
+  uint32_t size CACHE_LINE_ALIGNED;
+  uint32_t mask;
+  Msg_t** ring;
+} SpscRing_t;
+
+#if !MPSC_PACKED_LAYOUT
+_Static_assert(!SAME_CACHE_LINE(SpscRing_t, add_idx, rmv_idx), "add_idx and rmv_idx share a cache line");
+_Static_assert(!SAME_CACHE_LINE(SpscRing_t, add_idx, mask), "add_idx and mask share a cache line");
+_Static_assert(!SAME_CACHE_LINE(SpscRing_t, rmv_idx, mask), "rmv_idx and mask share a cache line");
+#endif
+
+/**
+ * Initialize the SpscRing_t, size must be a power of two.
+ *
+ * @return NULL if size cannot be malloced or is not a power of 2.
+ */
+extern SpscRing_t* sr_init(SpscRing_t* pSr, uint32_t size);
+
+/**
+ * Deinitialize the SpscRing_t, assumes it's empty.
+ *
+ * @return number of messages removed.
+ */
+extern uint64_t sr_deinit(SpscRing_t* pSr);
+
+/**
+ * Add a Msg_t, this maybe used only by a single thread.
+ *
+ * @return true if added return false if full
+ */
+extern bool sr_add(SpscRing_t* pSr, Msg_t* pMsg);
+
+/**
+ * Remove a Msg_t, this maybe used only by a single thread.
+ *
+ * @return NULL if empty.
+ */
+extern Msg_t* sr_rmv(SpscRing_t* pSr);
+
+/**
+ * Remove up to max Msg_t's into msgs, this maybe used only by
+ * a single thread.
+ *
+ * @return number removed, 0 if empty.
+ */
+extern uint32_t sr_rmv_batch(SpscRing_t* pSr, Msg_t** msgs, uint32_t max);
+
+#endif
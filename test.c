@@ -7,12 +7,15 @@
 #define _DEFAULT_SOURCE
 
 #include "mpscfifo.h"
+#include "mpscprio.h"
 #include "msg_pool.h"
+#include "rpc.h"
 #include "diff_timespec.h"
 #include "dpf.h"
 
 #include <sys/types.h>
 #include <pthread.h>
+#include <sched.h>
 
 #include <assert.h>
 #include <stdbool.h>
@@ -33,25 +36,57 @@ _Atomic(uint64_t) gTick = 0;
 
 typedef struct ClientParams ClientParams;
 
+#define CLIENT_BATCH_SIZE 32
+
+// Number of times a client polls its empty cmdFifo before parking
+#define CLIENT_WAIT_SPIN_COUNT 100
+
+// A client's cmdFifo has a level for control commands, such as
+// CmdConnect and CmdStop, which overtake the bulk commands
+#define CLIENT_PRIO_CONTROL 0
+#define CLIENT_PRIO_BULK    1
+#define CLIENT_PRIO_LEVELS  2
+
+// Size of the lane a client registers with each peer it connects to
+#define CLIENT_LANE_SIZE 0x100
+
+// Size of a client's value ring, peers send CmdDoNothing as a value
+#define CLIENT_VALUE_RING_SIZE 0x100
+
+// Number of CmdSendToPeers a client may have queued or being
+// processed, multi_thread_main sends them with try_add. The peers'
+// CmdDoNothing use values, lanes and multicast which take no credits.
+#define CLIENT_CREDITS 0x40
+
+// Maximum requests multi_thread_main has outstanding, see rpc.h
+#define MAIN_RPC_SIZE 0x100
+
 typedef struct ClientParams {
-  MpscFifo_t cmdFifo;
+  MpscPrioFifo_t cmdFifo;
 
   pthread_t thread;
   uint32_t msg_count;
   uint32_t max_peer_count;
 
+  Msg_t* batch[CLIENT_BATCH_SIZE];
+  uint32_t batch_idx;
+  uint32_t batch_count;
+
   ClientParams** peers;
+  SpscRing_t** peer_lanes;
+  MpscFifo_t** peer_fifos;
   uint32_t peer_send_idx;
   uint32_t peers_connected;
 
 
   MsgPool_t pool;
 
+  bool init_failed;
   uint64_t error_count;
+  uint64_t sends_dropped;
   uint64_t cmds_processed;
   uint64_t msgs_processed;
   sem_t sem_ready;
-  sem_t sem_waiting;
 } ClientParams;
 
 #define CmdUnknown       0 // arg2 == the command that's unknown
@@ -67,41 +102,127 @@ typedef struct ClientParams {
 #define CmdSent          10
 
 /**
- * Send messages CmdDoNothing to all of the peers
+ * Send CmdDoNothing to all of the peers as a value, those whose
+ * value ring is full are sent a message on our lane and those whose
+ * lane is also full, or have none, a single message with multicast.
  */
 void send_to_peers(ClientParams* cp) {
   DPF(LDR "send_to_peers:+param=%p\n", ldr(), cp);
 
+  uint32_t fifo_count = 0;
   for (uint32_t i = 0; i < cp->peers_connected; i++) {
-    Msg_t* msg = MsgPool_get_msg(&cp->pool);
-    if (msg == NULL) {
-      DPF(LDR "send_to_peers: param=%p whoops no more messages, sent to %u peers\n",
-          ldr(), cp, i);
-      return;
-    }
     ClientParams* peer = cp->peers[cp->peer_send_idx];
-    msg->arg1 = CmdDoNothing;
-    DPF(LDR "send_to_peers: param=%p send to peer=%p msg=%p msg->arg1=%lu CmdDoNothing\n",
-       ldr(), cp, peer, msg, msg->arg1);
-    add(&peer->cmdFifo, msg);
-    sem_post(&peer->sem_waiting);
-    DPF(LDR "send_to_peers: param=%p SENT to peer=%p msg=%p msg->arg1=%lu CmdDoNothing\n",
-       ldr(), cp, peer, msg, msg->arg1);
+    MpscFifo_t* peer_bulk = pq_level(&peer->cmdFifo, CLIENT_PRIO_BULK);
+    if (add_value(peer_bulk, CmdDoNothing, 0)) {
+      DPF(LDR "send_to_peers: param=%p SENT value to peer=%p CmdDoNothing\n", ldr(), cp, peer);
+    } else {
+      bool sent = false;
+      SpscRing_t* lane = cp->peer_lanes[cp->peer_send_idx];
+      Msg_t* msg = (lane != NULL) ? MsgPool_get_msg(&cp->pool) : NULL;
+      if (msg != NULL) {
+        msg->arg1 = CmdDoNothing;
+        sent = add_lane(peer_bulk, lane, msg);
+        if (sent) {
+          DPF(LDR "send_to_peers: param=%p SENT on lane to peer=%p msg=%p CmdDoNothing\n",
+              ldr(), cp, peer, msg);
+        } else {
+          ret_msg(msg);
+        }
+      }
+      if (!sent) {
+        cp->peer_fifos[fifo_count++] = peer_bulk;
+      }
+    }
     cp->peer_send_idx += 1;
     if (cp->peer_send_idx >= cp->peers_connected) {
       cp->peer_send_idx = 0;
     }
   }
+
+  if (fifo_count != 0) {
+    // Our messages come back as our peers process them, waiting for
+    // them could deadlock with a peer waiting for us so the peers we
+    // have no message or handle for are skipped and counted
+    uint32_t sent = 0;
+    Msg_t* msg = MsgPool_get_msg(&cp->pool);
+    if (msg != NULL) {
+      msg->arg1 = CmdDoNothing;
+      sent = multicast(&cp->pool, msg, cp->peer_fifos, fifo_count);
+      DPF(LDR "send_to_peers: param=%p SENT msg=%p to %u of %u peers CmdDoNothing\n",
+         ldr(), cp, msg, sent, fifo_count);
+    }
+    if (sent < fifo_count) {
+      DPF(LDR "send_to_peers: param=%p whoops no more messages, %u peers not sent to\n",
+          ldr(), cp, fifo_count - sent);
+      cp->sends_dropped += fifo_count - sent;
+    }
+  }
   DPF(LDR "send_to_peers:-param=%p\n", ldr(), cp);
 }
 
+/**
+ * Process a value from the cmdFifo, peers only send CmdDoNothing
+ * which has no response.
+ */
+static void client_value(ClientParams* cp, uint64_t arg1, uint64_t arg2) {
+  cp->cmds_processed += 1;
+  DPF(LDR "client_value: param=%p arg1=%lu arg2=%lu cmds_processed=%lu\n",
+      ldr(), cp, arg1, arg2, cp->cmds_processed);
+  if (arg1 != CmdDoNothing) {
+    DPF(LDR "client_value: param=%p ERROR Uknown arg1=%lu\n", ldr(), cp, arg1);
+    cp->error_count += 1;
+  }
+}
+
+/**
+ * Return the next message from the cmdFifo, messages are removed
+ * CLIENT_BATCH_SIZE at a time from its most urgent level with
+ * pq_rmv_batch after processing up to as many values.
+ */
+static inline Msg_t* client_rmv(ClientParams* cp) {
+  MpscFifo_t* bulk = pq_level(&cp->cmdFifo, CLIENT_PRIO_BULK);
+  while (cp->batch_idx >= cp->batch_count) {
+    uint64_t arg1;
+    uint64_t arg2;
+    uint32_t values = 0;
+    for (; (values < CLIENT_BATCH_SIZE) && rmv_value(bulk, &arg1, &arg2); values++) {
+      client_value(cp, arg1, arg2);
+    }
+    cp->batch_idx = 0;
+    cp->batch_count = pq_rmv_batch(&cp->cmdFifo, cp->batch, CLIENT_BATCH_SIZE);
+    if ((cp->batch_count == 0) && (values < CLIENT_BATCH_SIZE)) {
+      return NULL;
+    }
+  }
+  return cp->batch[cp->batch_idx++];
+}
+
+/**
+ * Return the next message from the cmdFifo, if there are none
+ * flush the messages we're returning to other pools and wait for
+ * a message or value with pq_wait.
+ */
+static inline Msg_t* client_rmv_wait(ClientParams* cp) {
+  while (true) {
+    Msg_t* msg = client_rmv(cp);
+    if (msg != NULL) {
+      return msg;
+    }
+    pq_wait(&cp->cmdFifo);
+  }
+}
+
 static void* client(void* p) {
   DPF(LDR "client:+param=%p\n", ldr(), p);
   Msg_t* msg;
 
   ClientParams* cp = (ClientParams*)p;
+  bool pool_inited = false;
+  bool cmdFifo_inited = false;
 
+  cp->init_failed = false;
   cp->error_count = 0;
+  cp->sends_dropped = 0;
   cp->cmds_processed = 0;
   cp->msgs_processed = 0;
 
@@ -109,7 +230,9 @@ static void* client(void* p) {
     DPF(LDR "client: param=%p allocate peers max_peer_count=%u\n",
         ldr(), p, cp->max_peer_count);
     cp->peers = malloc(sizeof(ClientParams*) * cp->max_peer_count);
-    if (cp->peers == NULL) {
+    cp->peer_lanes = malloc(sizeof(SpscRing_t*) * cp->max_peer_count);
+    cp->peer_fifos = malloc(sizeof(MpscFifo_t*) * cp->max_peer_count);
+    if ((cp->peers == NULL) || (cp->peer_lanes == NULL) || (cp->peer_fifos == NULL)) {
       DPF(LDR "client: param=%p ERROR unable to allocate peers max_peer_count=%u\n",
           ldr(), p, cp->max_peer_count);
       cp->error_count += 1;
@@ -118,22 +241,35 @@ static void* client(void* p) {
     DPF(LDR "client: param=%p No peers max_peer_count=%d\n",
         ldr(), p, cp->max_peer_count);
     cp->peers = NULL;
+    cp->peer_lanes = NULL;
+    cp->peer_fifos = NULL;
   }
   cp->peers_connected = 0;
   cp->peer_send_idx = 0;
+  cp->batch_idx = 0;
+  cp->batch_count = 0;
 
 
   // Init local msg pool
   DPF(LDR "client: init msg pool=%p msg_count=%u\n", ldr(), &cp->pool, cp->msg_count);
-  bool error = MsgPool_init(&cp->pool, cp->msg_count);
-  if (error) {
+  if (MsgPool_init(&cp->pool, cp->msg_count)) {
     DPF(LDR "client: param=%p ERROR unable to create msgs for pool\n", ldr(), p);
-    cp->error_count += 1;
+    goto init_failed;
   }
+  pool_inited = true;
 
   // Init cmdFifo
-  initMpscFifo(&cp->cmdFifo);
-  DPF(LDR "client: param=%p cp->cmdFifo=%p count=%d\n", ldr(), p, &cp->cmdFifo, cp->cmdFifo.count);
+  if (pq_init(&cp->cmdFifo, CLIENT_PRIO_LEVELS, CLIENT_WAIT_SPIN_COUNT) == NULL) {
+    DPF(LDR "client: param=%p ERROR unable to init cmdFifo\n", ldr(), p);
+    goto init_failed;
+  }
+  cmdFifo_inited = true;
+  enable_credits(pq_level(&cp->cmdFifo, CLIENT_PRIO_BULK), CLIENT_CREDITS);
+  if (!enable_values(pq_level(&cp->cmdFifo, CLIENT_PRIO_BULK), CLIENT_VALUE_RING_SIZE)) {
+    DPF(LDR "client: param=%p ERROR unable to enable values\n", ldr(), p);
+    goto init_failed;
+  }
+  DPF(LDR "client: param=%p cp->cmdFifo=%p\n", ldr(), p, &cp->cmdFifo);
 
 
   // Signal we're ready
@@ -143,8 +279,7 @@ static void* client(void* p) {
   // do the work and signal work is complete.
   while (true) {
     DPF(LDR "client: param=%p waiting\n", ldr(), p);
-    sem_wait(&cp->sem_waiting);
-    while((msg = rmv(&cp->cmdFifo)) != NULL) {
+    while((msg = client_rmv_wait(cp)) != NULL) {
       if (msg != NULL) {
         cp->cmds_processed += 1;
         DPF(LDR "client:^param=%p msg=%p arg1=%lu cmds_processed=%lu\n",
@@ -165,9 +300,13 @@ static void* client(void* p) {
           case CmdConnect: {
             DPF(LDR "client:+param=%p msg=%p CmdConnect peers_connected=%u max_peer_count=%u\n",
                 ldr(), p, msg, cp->peers_connected, cp->max_peer_count);
-            if (cp->peers != NULL) {
+            if ((cp->peers != NULL) && (cp->peer_lanes != NULL) && (cp->peer_fifos != NULL)) {
               if (cp->peers_connected < cp->max_peer_count) {
-                cp->peers[cp->peers_connected] = (ClientParams*)msg->arg2;
+                ClientParams* peer = (ClientParams*)msg->arg2;
+                cp->peers[cp->peers_connected] = peer;
+                // If no lane is available multicast is used
+                cp->peer_lanes[cp->peers_connected] =
+                  register_lane(pq_level(&peer->cmdFifo, CLIENT_PRIO_BULK), CLIENT_LANE_SIZE);
                 DPF(LDR "client: param=%p CmdConnect to peer=%p\n",
                     ldr(), p, cp->peers[cp->peers_connected]);
                 cp->peers_connected += 1;
@@ -187,6 +326,12 @@ static void* client(void* p) {
             DPF(LDR "client:+param=%p msg=%p CmdDisconnectAll peers_connected=%u max_peer_count=%u\n",
                 ldr(), p, msg, cp->peers_connected, cp->max_peer_count);
             if (cp->peers != NULL) {
+              // The peers are still running so we can give back our lanes
+              for (uint32_t i = 0; i < cp->peers_connected; i++) {
+                if (cp->peer_lanes[i] != NULL) {
+                  unregister_lane(pq_level(&cp->peers[i]->cmdFifo, CLIENT_PRIO_BULK), cp->peer_lanes[i]);
+                }
+              }
               cp->peers_connected = 0;
             }
             send_rsp_or_ret(msg, CmdDisconnected);
@@ -219,71 +364,99 @@ static void* client(void* p) {
     }
   }
 
+init_failed:
+  // Tell multi_thread_main we won't be processing commands, it
+  // doesn't send us any once we've posted sem_ready
+  cp->init_failed = true;
+  cp->error_count += 1;
+  sem_post(&cp->sem_ready);
+
 done:
-  // Flush any messages in the cmdFifo
-  DPF(LDR "client: param=%p done, flushing cmdFifo=%p count=%d\n",
-      ldr(), p, &cp->cmdFifo, cp->cmdFifo.count);
-  uint32_t unprocessed = 0;
-  while ((msg = rmv(&cp->cmdFifo)) != NULL) {
-    DPF(LDR "client: param=%p ret msg=%p\n", ldr(), p, msg);
-    unprocessed += 1;
-    ret_msg(msg);
+  if (cmdFifo_inited) {
+    // Flush any messages in the cmdFifo
+    DPF(LDR "client: param=%p done, flushing cmdFifo=%p\n", ldr(), p, &cp->cmdFifo);
+    uint32_t unprocessed = 0;
+    while ((msg = client_rmv(cp)) != NULL) {
+      DPF(LDR "client: param=%p ret msg=%p\n", ldr(), p, msg);
+      unprocessed += 1;
+      ret_msg(msg);
+    }
+
+    // deinit cmd fifo
+    DPF(LDR "client: param=%p deinit cmdFifo=%p unprocessed=%u\n",ldr(), p, &cp->cmdFifo, unprocessed);
+    cp->msgs_processed = pq_deinit(&cp->cmdFifo);
+    DPF(LDR "client: param=%p after deinit cmds_processed=%lu msgs_processed=%lu\n",ldr(), p, cp->cmds_processed, cp->msgs_processed);
   }
 
-  // deinit cmd fifo
-  DPF(LDR "client: param=%p deinit cmdFifo=%p count=%d unprocessed=%u\n",ldr(), p, &cp->cmdFifo, cp->cmdFifo.count, unprocessed);
-  cp->msgs_processed = deinitMpscFifo(&cp->cmdFifo);
-  DPF(LDR "client: param=%p after deinit cmds_processed=%lu msgs_processed=%lu\n",ldr(), p, cp->cmds_processed, cp->msgs_processed);
+  if (pool_inited) {
+    // deinit msg pool, first returning messages of other pools
+    // whose owners may be waiting for them
+    DPF(LDR "client: param=%p deinit msg pool=%p msg_count=%u\n", ldr(), p, &cp->pool, cp->pool.msg_count);
+    MsgPool_flush();
+    cp->msgs_processed += MsgPool_deinit(&cp->pool);
+  }
 
-  // deinit msg pool
-  DPF(LDR "client: param=%p deinit msg pool=%p msg_count=%u\n", ldr(), p, &cp->pool, cp->pool.msg_count);
-  cp->msgs_processed += MsgPool_deinit(&cp->pool);
+  free(cp->peer_fifos);
+  free(cp->peer_lanes);
+  free(cp->peers);
 
   DPF(LDR "client:-param=%p error_count=%lu cmds_processed=%lu\n", ldr(), p, cp->error_count, cp->cmds_processed);
   return NULL;
 }
 
-// Return 0 if successful !0 if an error
-uint32_t wait_for_rsp(MpscFifo_t* fifo, uint64_t rsp_expected, void* client, uint32_t client_idx) {
-  uint32_t retv;
+typedef struct RspCheck {
+  uint64_t rsp_expected;
+  uint32_t error_count;
+} RspCheck;
+
+/**
+ * Check the response is the one expected, see rpc_send.
+ */
+static void check_rsp(void* ctx, Msg_t* rsp) {
+  RspCheck* check = (RspCheck*)ctx;
+  if (rsp->arg1 != check->rsp_expected) {
+    DPF(LDR "check_rsp: ERROR unexpected arg1=%lu expected %lu arg2=%lu id=%lu\n",
+        ldr(), rsp->arg1, check->rsp_expected, rsp->arg2, rsp->id);
+    check->error_count += 1;
+  }
+}
+
+/**
+ * Send a request to the client's control level without waiting for
+ * its response, while there's no msg or the rpc table is full
+ * complete responses.
+ */
+static void send_request(RpcTable_t* rpc, MsgPool_t* pool, ClientParams* client,
+    uint64_t arg1, uint64_t arg2, RspCheck* check) {
   Msg_t* msg;
-  DPF(LDR "wait_for_rsp:+fifo=%p rsp_expected %lu client[%u]=%p\n",
-      ldr(), fifo, rsp_expected, client_idx, client);
-
-  // TODO: Add MpscFifo_t.sem_waiting??
-  bool once = false;
-  while ((msg = rmv(fifo)) == NULL) {
-    if (!once) {
-      once = true;
-      DPF(LDR "wait_for_rsp: fifo=%p waiting for arg1=%lu client[%u]=%p\n",
-          ldr(), fifo, rsp_expected, client_idx, client);
+  while ((msg = MsgPool_get_msg(pool)) == NULL) {
+    if (rpc_outstanding(rpc) != 0) {
+      rpc_wait(rpc);
+    } else {
+      sched_yield();
     }
-    sched_yield();
   }
-  if (msg->arg1 != rsp_expected) {
-    DPF(LDR "wait_for_rsp: fifo=%p ERROR unexpected arg1=%lu expected %lu arg2=%lu, client[%u]=%p\n",
-        ldr(), fifo, msg->arg1, rsp_expected, msg->arg2, client_idx, client);
-    retv = 1;
-  } else {
-    DPF(LDR "wait_for_rsp: fifo=%p got ar1=%lu arg2=%lu client[%u]=%p\n",
-        ldr(), fifo, rsp_expected, msg->arg2, client_idx, client);
-    retv = 0;
-  }
-  ret_msg(msg);
-  DPF(LDR "wait_for_rsp:-fifo=%p rsp_expected %lu client[%u]=%p retv=%u\n",
-      ldr(), fifo, rsp_expected, client_idx, client, retv);
-  return retv;
+  msg->arg1 = arg1;
+  msg->arg2 = arg2;
+  DPF(LDR "send_request: send client=%p msg=%p arg1=%lu\n", ldr(), client, msg, msg->arg1);
+  MpscFifo_t* control = pq_level(&client->cmdFifo, CLIENT_PRIO_CONTROL);
+  while (rpc_send(rpc, control, msg, check_rsp, check) == 0) {
+    rpc_wait(rpc);
+  }
 }
 
 bool multi_thread_main(const uint32_t client_count, const uint64_t loops,
     const uint32_t msg_count) {
   bool error;
   MpscFifo_t cmdFifo;
+  bool cmdFifo_inited = false;
+  RpcTable_t rpc = { 0 };
   ClientParams* clients;
   MsgPool_t pool;
   uint32_t clients_created = 0;
   uint64_t mt_msgs_sent = 0;
   uint64_t mt_no_msgs = 0;
+  uint64_t mt_no_credits = 0;
 
   struct timespec time_start;
   struct timespec time_looping;
@@ -318,8 +491,19 @@ bool multi_thread_main(const uint32_t client_count, const uint64_t loops,
     goto done;
   }
 
-  initMpscFifo(&cmdFifo);
+  if (initMpscFifo(&cmdFifo) == NULL) {
+    printf(LDR "multi_thread_msg: ERROR Unable to init cmdFifo, aborting\n", ldr());
+    error = true;
+    goto done;
+  }
+  cmdFifo_inited = true;
+  enable_rmv_wait(&cmdFifo, CLIENT_WAIT_SPIN_COUNT);
   DPF(LDR "multi_thread_msg: cmdFifo=%p\n", ldr(), &cmdFifo);
+  if (rpc_init(&rpc, &cmdFifo, MAIN_RPC_SIZE) == NULL) {
+    printf(LDR "multi_thread_msg: ERROR Unable to init rpc table, aborting\n", ldr());
+    error = true;
+    goto done;
+  }
 
   // Create the clients
   for (uint32_t i = 0; i < client_count; i++, clients_created++) {
@@ -328,7 +512,6 @@ bool multi_thread_main(const uint32_t client_count, const uint64_t loops,
     param->max_peer_count = client_count;
 
     sem_init(&param->sem_ready, 0, 0);
-    sem_init(&param->sem_waiting, 0, 0);
 
     int retv = pthread_create(&param->thread, NULL, client, (void*)&clients[i]);
     if (retv != 0) {
@@ -340,33 +523,37 @@ bool multi_thread_main(const uint32_t client_count, const uint64_t loops,
 
     // Wait until it starts
     sem_wait(&param->sem_ready);
+    if (param->init_failed) {
+      // It has cleaned up and is exiting, it isn't one of the clients
+      // created so it's sent no commands
+      printf(LDR "multi_thread_msg: ERROR clients[%u]=%p failed to init\n", ldr(), i, param);
+      pthread_join(param->thread, NULL);
+      sem_destroy(&param->sem_ready);
+      error = true;
+      goto done;
+    }
   }
   DPF(LDR "multi_thread_msg: created %u clients\n", ldr(), clients_created);
 
 
-  // Connect every client to every other client except themselves
+  // Connect every client to every other client except themselves,
+  // the requests are all outstanding at once
+  RspCheck connected = { .rsp_expected = CmdConnected, .error_count = 0 };
   for (uint32_t i = 0; i < clients_created; i++) {
     ClientParams* client = &clients[i];
     for (uint32_t peer_idx = 0; peer_idx < clients_created; peer_idx++) {
-      ClientParams* peer = &clients[peer_idx];
       if (peer_idx != i) {
-        Msg_t* msg = MsgPool_get_msg(&pool);
-        if (msg != NULL) {
-          msg->pRspQ = &cmdFifo;
-          msg->arg1 = CmdConnect;
-          msg->arg2 = (uint64_t)peer;
-          DPF(LDR "multi_thread_msg: send client=%p msg=%p arg1=%lu CmdConnect\n",
-              ldr(), client, msg, msg->arg1);
-          add(&client->cmdFifo, msg);
-          sem_post(&client->sem_waiting);
-        }
-        if (wait_for_rsp(&cmdFifo, CmdConnected, client, i)) {
-          error = true;
-          goto done;
-        }
+        send_request(&rpc, &pool, client, CmdConnect, (uint64_t)&clients[peer_idx], &connected);
       }
     }
   }
+  rpc_wait_all(&rpc);
+  if (connected.error_count != 0) {
+    printf(LDR "multi_thread_msg: ERROR %u unexpected CmdConnect responses\n",
+        ldr(), connected.error_count);
+    error = true;
+    goto done;
+  }
 
   DPF(LDR "multi_thread_msg: send CmdSendToPeers to %u clients\n", ldr(), clients_created);
 
@@ -384,9 +571,15 @@ bool multi_thread_main(const uint32_t client_count, const uint64_t loops,
         msg->arg1 = CmdSendToPeers;
         DPF(LDR "multi_thread_msg: send client=%p msg=%p arg1=%lu CmdSendToPeers\n",
             ldr(), client, msg, msg->arg1);
-        add(&client->cmdFifo, msg);
-        sem_post(&client->sem_waiting);
-        mt_msgs_sent += 1;
+        if (try_add(pq_level(&client->cmdFifo, CLIENT_PRIO_BULK), msg)) {
+          mt_msgs_sent += 1;
+        } else {
+          mt_no_credits += 1;
+          DPF(LDR "multi_thread_msg: Whoops no credits c=%u mt_msgs_sent=%lu mt_no_credits=%lu\n",
+              ldr(), c, mt_msgs_sent, mt_no_credits);
+          ret_msg(msg);
+          sched_yield();
+        }
       } else {
         mt_no_msgs += 1;
         DPF(LDR "multi_thread_msg: Whoops msg == NULL c=%u mt_msgs_sent=%lu mt_no_msgs=%lu\n",
@@ -403,62 +596,34 @@ done:
 
   DPF(LDR "multi_thread_msg: done, send CmdDisconnectAll %u clients\n",
       ldr(), clients_created);
+  RspCheck disconnected = { .rsp_expected = CmdDisconnected, .error_count = 0 };
   for (uint32_t i = 0; i < clients_created; i++) {
-    ClientParams* client = &clients[i];
-
-    // Request the client to stop
-    Msg_t* msg = MsgPool_get_msg(&pool);
-    bool once = false;
-    while (msg == NULL) {
-      if (!once) {
-        once = true;
-        DPF(LDR "multi_thread_msg: waiting for msg to send %u CmdDisconnectAll\n",
-            ldr(), i);
-      }
-      sched_yield();
-      msg = MsgPool_get_msg(&pool);
-    }
-    msg->pRspQ = &cmdFifo;
-    msg->arg1 = CmdDisconnectAll;
-    DPF(LDR "multi_thread_msg: send %u client=%p msg=%p msg->arg1=%lu CmdDisconnectAll\n",
-        ldr(), i, client, msg, msg->arg1);
-    add(&client->cmdFifo, msg);
-    sem_post(&client->sem_waiting);
-    if (wait_for_rsp(&cmdFifo, CmdDisconnected, client, i)) {
-      error = true;
-      goto done;
-    }
+    send_request(&rpc, &pool, &clients[i], CmdDisconnectAll, 0, &disconnected);
+  }
+  rpc_wait_all(&rpc);
+  if (disconnected.error_count != 0) {
+    printf(LDR "multi_thread_msg: ERROR %u unexpected CmdDisconnectAll responses\n",
+        ldr(), disconnected.error_count);
+    error = true;
   }
 
   clock_gettime(CLOCK_REALTIME, &time_disconnected);
 
   DPF(LDR "multi_thread_msg: done, send CmdStop %u clients\n",
       ldr(), clients_created);
+  RspCheck stopped = { .rsp_expected = CmdStopped, .error_count = 0 };
   for (uint32_t i = 0; i < clients_created; i++) {
-    ClientParams* client = &clients[i];
-
-    // Request the client to stop
-    Msg_t* msg = MsgPool_get_msg(&pool);
-    bool once = false;
-    while (msg == NULL) {
-      if (!once) {
-        once = true;
-        DPF(LDR "multi_thread_msg: waiting for msg to send %u CmdStop\n", ldr(), i);
-      }
-      sched_yield();
-      msg = MsgPool_get_msg(&pool);
-    }
-    DPF(LDR "multi_thread_msg: send %u CmdStop\n", ldr(), i);
-    msg->pRspQ = &cmdFifo;
-    msg->arg1 = CmdStop;
-    DPF(LDR "multi_thread_msg: send client=%p msg=%p msg->arg1=%lu CmdStop\n", ldr(),
-       client, msg, msg->arg1);
-    add(&client->cmdFifo, msg);
-    sem_post(&client->sem_waiting);
-    if (wait_for_rsp(&cmdFifo, CmdStopped, client, i)) {
-      error = true;
-      goto done;
-    }
+    send_request(&rpc, &pool, &clients[i], CmdStop, 0, &stopped);
+  }
+  rpc_wait_all(&rpc);
+  if (stopped.error_count != 0) {
+    printf(LDR "multi_thread_msg: ERROR %u unexpected CmdStop responses\n",
+        ldr(), stopped.error_count);
+    error = true;
+  }
+  if (rpc.unmatched != 0) {
+    printf(LDR "multi_thread_msg: ERROR %lu unmatched responses\n", ldr(), rpc.unmatched);
+    error = true;
   }
 
   clock_gettime(CLOCK_REALTIME, &time_stopped);
@@ -466,6 +631,7 @@ done:
   DPF(LDR "multi_thread_msg: done, joining %u clients\n", ldr(), clients_created);
   uint64_t cmds_processed = 0;
   uint64_t msgs_processed = 0;
+  uint64_t sends_dropped = 0;
   for (uint32_t i = 0; i < clients_created; i++) {
     ClientParams* client = &clients[i];
     // Wait until the thread completes
@@ -477,7 +643,6 @@ done:
 
     // Cleanup resources
     sem_destroy(&client->sem_ready);
-    sem_destroy(&client->sem_waiting);
 
     // Record if clients discovered any errors
     if (client->error_count != 0) {
@@ -487,13 +652,20 @@ done:
     }
     cmds_processed += client->cmds_processed;
     msgs_processed += client->msgs_processed;
+    sends_dropped += client->sends_dropped;
     DPF(LDR "multi_thread_msg: clients[%u]=%p cmds_processed=%lu msgs_processed=%lu error_count=%lu\n",
         ldr(), i, (void*)client, client->cmds_processed, client->msgs_processed, client->error_count);
   }
 
-  // Deinit the cmdFifo
-  DPF(LDR "multi_thread_msg: deinit cmdFifo=%p\n", ldr(), &cmdFifo);
-  msgs_processed += deinitMpscFifo(&cmdFifo);
+  // Deinit the rpc table, unless rpc_init wasn't reached or failed,
+  // and cmdFifo
+  if (rpc.slots != NULL) {
+    rpc_deinit(&rpc);
+  }
+  if (cmdFifo_inited) {
+    DPF(LDR "multi_thread_msg: deinit cmdFifo=%p\n", ldr(), &cmdFifo);
+    msgs_processed += deinitMpscFifo(&cmdFifo);
+  }
 
   // Deinit the msg pool
   DPF(LDR "multi_thread_msg: deinit msg pool=%p\n", ldr(), &pool);
@@ -502,7 +674,7 @@ done:
   clock_gettime(CLOCK_REALTIME, &time_complete);
 
   uint64_t expected_value = loops * clients_created;
-  uint64_t sum = mt_msgs_sent + mt_no_msgs;
+  uint64_t sum = mt_msgs_sent + mt_no_msgs + mt_no_credits;
   if (sum != expected_value) {
     printf(LDR "multi_thread_msg: ERROR sum=%lu != expected_value=%lu\n",
        ldr(), sum, expected_value);
@@ -510,7 +682,8 @@ done:
   }
 
   printf(LDR "multi_thread_msg: cmds_processed=%lu msgs_processed=%lu mt_msgs_sent=%lu "
-      "mt_no_msgs=%lu\n", ldr(), cmds_processed, msgs_processed, mt_msgs_sent, mt_no_msgs);
+      "mt_no_msgs=%lu mt_no_credits=%lu sends_dropped=%lu\n", ldr(), cmds_processed,
+      msgs_processed, mt_msgs_sent, mt_no_msgs, mt_no_credits, sends_dropped);
 
   DPF(LDR "time_start=%lu.%lu\n", ldr(), time_start.tv_sec, time_start.tv_nsec);
   DPF(LDR "time_looping=%lu.%lu\n", ldr(), time_looping.tv_sec, time_looping.tv_nsec);